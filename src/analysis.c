@@ -0,0 +1,288 @@
+#include "analysis.h"
+#include "arena.h"
+#include "json.h"
+#include "position.h"
+#include "uci.h"
+#include "utils.h"
+#include <string.h>
+
+/* The FEN is parsed in full, which also keeps newlines from smuggling extra
+   commands into the engine. */
+bool analysis_valid_fen(const char *fen) {
+  Position pos;
+  size_t len = strlen(fen);
+  return len > 0 && len <= ANALYSIS_MAX_FEN_LEN && position_from_fen(&pos, fen);
+}
+
+static bool get_limit(const JsonValue *json, const char *key, double max,
+                      uint64_t *out, const char **error) {
+  const JsonValue *value = json_get(json, key);
+  if (!value) {
+    return true;
+  }
+  if (value->type != JSON_NUMBER || value->number < 1 || value->number > max ||
+      (double)(uint64_t)value->number != value->number) {
+    *error = key;
+    return false;
+  }
+  *out = (uint64_t)value->number;
+  return true;
+}
+
+static bool get_flag(const JsonValue *json, const char *key, bool *out,
+                     const char **error) {
+  const JsonValue *value = json_get(json, key);
+  if (!value || value->type == JSON_NULL) {
+    return true;
+  }
+  if (value->type != JSON_BOOL) {
+    *error = key;
+    return false;
+  }
+  *out = value->boolean;
+  return true;
+}
+
+static bool play_move(Arena *arena, Position *pos, StrView token,
+                      StringBuilder *sb) {
+  uint16_t move;
+  if (!position_parse_move(pos, token, &move)) {
+    return false;
+  }
+  position_make_move(pos, move);
+  sb_appendf(arena, sb, "%s%.*s", sb->count ? " " : "", (int)token.len,
+             token.data);
+  return true;
+}
+
+/* Appends the moves to sb, accepting either a JSON array of UCI moves or a
+   single space separated string. Every move is played on pos and has to be
+   legal there. */
+static bool collect_moves(Arena *arena, const JsonValue *moves, Position *pos,
+                          StringBuilder *sb) {
+  if (moves->type == JSON_STRING) {
+    StrView rest = {moves->string, strlen(moves->string)}, token;
+    while (sv_next_token(&rest, &token)) {
+      if (!play_move(arena, pos, token, sb)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (moves->type != JSON_ARRAY) {
+    return false;
+  }
+  for (size_t i = 0; i < moves->count; i++) {
+    const JsonValue *item = &moves->items[i];
+    if (item->type != JSON_STRING ||
+        !play_move(arena, pos,
+                   (StrView){item->string, strlen(item->string)}, sb)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool analysis_request_from_json(Arena *arena, const JsonValue *json,
+                                AnalysisRequest *request, const char **error) {
+  memset(request, 0, sizeof(*request));
+  request->moves = "";
+  request->multipv = 1;
+  request->use_book = true;
+
+  if (!json || json->type != JSON_OBJECT) {
+    *error = "body";
+    return false;
+  }
+
+  // The engine is sent the FEN as written out again, so requests for the
+  // same position that spell it differently share cache entries and searches
+  Position pos;
+  const JsonValue *fen = json_get(json, "fen");
+  if (fen && fen->type != JSON_NULL) {
+    if (fen->type != JSON_STRING || !analysis_valid_fen(fen->string)) {
+      *error = "fen";
+      return false;
+    }
+    position_from_fen(&pos, fen->string);
+    char *canonical = arena_alloc(arena, POSITION_FEN_SIZE);
+    position_to_fen(&pos, canonical);
+    request->fen = canonical;
+  } else {
+    position_from_fen(&pos, STARTPOS_FEN);
+  }
+
+  const JsonValue *moves = json_get(json, "moves");
+  if (moves && moves->type != JSON_NULL) {
+    StringBuilder sb = {0};
+    if (!collect_moves(arena, moves, &pos, &sb)) {
+      *error = "moves";
+      return false;
+    }
+    arena_sb_append_null(arena, &sb);
+    request->moves = sb.items;
+  }
+
+  uint64_t depth = 0, movetime = 0, nodes = 0, multipv = 1, deadline = 0;
+  if (!get_limit(json, "depth", 255, &depth, error) ||
+      !get_limit(json, "movetime", 3600 * 1000, &movetime, error) ||
+      !get_limit(json, "nodes", 1e15, &nodes, error) ||
+      !get_limit(json, "multipv", UCI_MAX_MULTIPV, &multipv, error) ||
+      !get_limit(json, "deadline", 3600 * 1000, &deadline, error)) {
+    return false;
+  }
+
+  const JsonValue *priority = json_get(json, "priority");
+  if (priority && priority->type != JSON_NULL) {
+    if (priority->type == JSON_STRING &&
+        strcmp(priority->string, "batch") == 0) {
+      request->priority = PRIORITY_BATCH;
+    } else if (priority->type != JSON_STRING ||
+               strcmp(priority->string, "interactive") != 0) {
+      *error = "priority";
+      return false;
+    }
+  }
+
+  if (!get_flag(json, "stream", &request->stream, error) ||
+      !get_flag(json, "book", &request->use_book, error) ||
+      !get_flag(json, "trace", &request->trace, error)) {
+    return false;
+  }
+
+  if (!depth && !movetime && !nodes) {
+    depth = ANALYSIS_DEFAULT_DEPTH;
+  }
+
+  request->depth = (uint32_t)depth;
+  request->movetime = (uint32_t)movetime;
+  request->nodes = nodes;
+  request->multipv = (uint16_t)multipv;
+  request->deadline_ms = (uint32_t)deadline;
+  return true;
+}
+
+/* Sets pos to the position the request's moves lead to. */
+void analysis_final_position(const AnalysisRequest *request, Position *pos) {
+  // Requests only get here once analysis_request_from_json() checked them
+  position_from_fen(pos, request->fen ? request->fen : STARTPOS_FEN);
+
+  StrView rest = {request->moves, strlen(request->moves)}, token;
+  uint16_t move;
+  while (sv_next_token(&rest, &token)) {
+    if (uci_parse_move(token, &move)) {
+      position_make_move(pos, move);
+    }
+  }
+}
+
+char *analysis_position_command(Arena *arena, const AnalysisRequest *request) {
+  StringBuilder sb = {0};
+
+  if (request->fen) {
+    sb_appendf(arena, &sb, "position fen %s", request->fen);
+  } else {
+    sb_appendf(arena, &sb, "position startpos");
+  }
+  if (request->moves[0] != '\0') {
+    sb_appendf(arena, &sb, " moves %s", request->moves);
+  }
+
+  arena_sb_append_null(arena, &sb);
+  return sb.items;
+}
+
+char *analysis_go_command(Arena *arena, const AnalysisRequest *request) {
+  StringBuilder sb = {0};
+
+  sb_appendf(arena, &sb, "go");
+  if (request->depth) {
+    sb_appendf(arena, &sb, " depth %u", request->depth);
+  }
+  if (request->movetime) {
+    sb_appendf(arena, &sb, " movetime %u", request->movetime);
+  }
+  if (request->nodes) {
+    sb_appendf(arena, &sb, " nodes %lu", (unsigned long)request->nodes);
+  }
+
+  arena_sb_append_null(arena, &sb);
+  return sb.items;
+}
+
+/* Whether a stored result is at least as deep as the request asks for, so it
+   can be served in place of a new search. */
+bool analysis_result_satisfies(const SearchResult *result,
+                               const AnalysisRequest *request) {
+  if (result->line_count < request->multipv) {
+    return false;
+  }
+  if (request->depth && result->lines[0].depth < request->depth) {
+    return false;
+  }
+  if (request->nodes && result->nodes < request->nodes) {
+    return false;
+  }
+  if (request->movetime && result->time_ms < request->movetime) {
+    return false;
+  }
+  return true;
+}
+
+static void append_score(Arena *arena, StringBuilder *sb,
+                         const UciScore *score) {
+  sb_appendf(arena, sb, "{\"%s\":%d",
+             score->kind == SCORE_MATE ? "mate" : "cp", score->value);
+  if (score->bound == BOUND_LOWER) {
+    sb_appendf(arena, sb, ",\"bound\":\"lower\"");
+  } else if (score->bound == BOUND_UPPER) {
+    sb_appendf(arena, sb, ",\"bound\":\"upper\"");
+  }
+  sb_appendf(arena, sb, "}");
+}
+
+/* source tells clients where the answer came from ("engine", "cache"). */
+void analysis_result_to_json(Arena *arena, StringBuilder *sb,
+                             const SearchResult *result, const char *source,
+                             bool partial) {
+  char move[UCI_MOVE_MAX_LEN];
+  const uint16_t *moves = search_result_moves(result);
+
+  if (result->bestmove == MOVE_NONE) {
+    sb_appendf(arena, sb, "{\"bestmove\":null");
+  } else {
+    uci_format_move(result->bestmove, move);
+    sb_appendf(arena, sb, "{\"bestmove\":\"%s\"", move);
+  }
+  if (result->ponder != MOVE_NONE) {
+    uci_format_move(result->ponder, move);
+    sb_appendf(arena, sb, ",\"ponder\":\"%s\"", move);
+  }
+
+  sb_appendf(arena, sb,
+             ",\"source\":\"%s\",\"nodes\":%lu,\"nps\":%lu,\"time\":%lu",
+             source, (unsigned long)result->nodes, (unsigned long)result->nps,
+             (unsigned long)result->time_ms);
+  if (partial) {
+    sb_appendf(arena, sb, ",\"partial\":true");
+  }
+  sb_appendf(arena, sb, ",\"lines\":[");
+
+  for (size_t i = 0; i < result->line_count; i++) {
+    const PvLine *line = &result->lines[i];
+    sb_appendf(arena, sb,
+               "%s{\"multipv\":%zu,\"depth\":%u,\"seldepth\":%u,\"score\":",
+               i ? "," : "", i + 1, line->depth, line->seldepth);
+    append_score(arena, sb, &line->score);
+
+    sb_appendf(arena, sb, ",\"pv\":[");
+    for (size_t j = 0; j < line->pv_count; j++) {
+      uci_format_move(moves[line->pv_offset + j], move);
+      sb_appendf(arena, sb, "%s\"%s\"", j ? "," : "", move);
+    }
+    sb_appendf(arena, sb, "]}");
+  }
+
+  sb_appendf(arena, sb, "]}");
+}
@@ -0,0 +1,49 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "arena.h"
+#include "json.h"
+#include "position.h"
+#include "uci.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ANALYSIS_DEFAULT_DEPTH 18
+#define ANALYSIS_MAX_FEN_LEN 100
+
+/* Waiting requests are served interactive first; a batch search can be
+   stopped to make room for an interactive request that is about to miss its
+   deadline. */
+typedef enum {
+  PRIORITY_INTERACTIVE,
+  PRIORITY_BATCH,
+} AnalysisPriority;
+
+typedef struct {
+  const char *fen;   // NULL means the standard starting position
+  const char *moves; // Space separated UCI moves, empty if none
+  uint32_t depth;
+  uint32_t movetime;
+  uint64_t nodes;
+  uint16_t multipv;
+  AnalysisPriority priority;
+  uint32_t deadline_ms; // Time the answer is wanted within, 0 for no limit
+  bool stream;          // Send every new depth before the final result
+  bool use_book;        // May be answered with a move from the opening book
+  bool trace;           // Return the request's trace with the result
+} AnalysisRequest;
+
+bool analysis_valid_fen(const char *fen);
+bool analysis_request_from_json(Arena *arena, const JsonValue *json,
+                                AnalysisRequest *request, const char **error);
+void analysis_final_position(const AnalysisRequest *request, Position *pos);
+char *analysis_position_command(Arena *arena, const AnalysisRequest *request);
+char *analysis_go_command(Arena *arena, const AnalysisRequest *request);
+bool analysis_result_satisfies(const SearchResult *result,
+                               const AnalysisRequest *request);
+void analysis_result_to_json(Arena *arena, StringBuilder *sb,
+                             const SearchResult *result, const char *source,
+                             bool partial);
+
+#endif
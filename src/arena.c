@@ -1,3 +1,3 @@
+#define ARENA_BACKEND ARENA_BACKEND_LINUX_MMAP
 #define ARENA_IMPLEMENTATION
 #include "arena.h"
-
@@ -66,6 +66,19 @@ typedef struct  {
 #define ARENA_REGION_DEFAULT_CAPACITY (8*1024)
 #endif // ARENA_REGION_DEFAULT_CAPACITY
 
+// Regions of the default capacity are not given back to the backend when an
+// arena lets go of them but kept on a process wide lock-free free list, so
+// arenas in any thread can take them again without a system call. Each arena
+// still belongs to a single thread; only the free list is shared.
+typedef struct {
+    size_t regions;     // Regions currently obtained from the backend
+    size_t bytes;       // Their size, pooled or not
+    size_t in_use;      // Bytes of regions held by arenas
+    size_t high_water;  // Most bytes ever held by arenas at once
+    size_t pool_hits;   // Regions handed out from the free list
+    size_t pool_misses; // Regions the backend had to provide
+} Arena_Stats;
+
 Region *new_region(size_t capacity);
 void free_region(Region *r);
 
@@ -85,6 +98,11 @@ void arena_rewind(Arena *a, Arena_Mark m);
 void arena_free(Arena *a);
 void arena_trim(Arena *a);
 
+void arena_stats(Arena_Stats *stats);
+// Gives the free list back to the backend. Only safe once no other thread
+// uses arenas anymore.
+void arena_pool_drain(void);
+
 #ifndef ARENA_DA_INIT_CAP
 #define ARENA_DA_INIT_CAP 256
 #endif // ARENA_DA_INIT_CAP
@@ -145,6 +163,32 @@ void arena_trim(Arena *a);
 
 #ifdef ARENA_IMPLEMENTATION
 
+#include <stdatomic.h>
+
+#ifndef ARENA_PAGE_SIZE
+#define ARENA_PAGE_SIZE (4*1024)
+#endif // ARENA_PAGE_SIZE
+
+#ifndef ARENA_HUGE_PAGE_SIZE
+#define ARENA_HUGE_PAGE_SIZE (2*1024*1024)
+#endif // ARENA_HUGE_PAGE_SIZE
+
+// Mapped regions fill whole pages, so the size a region really gets is what
+// the free list goes by
+#if ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP && defined(ARENA_HUGE_PAGES)
+#define ARENA__REGION_ALIGN ARENA_HUGE_PAGE_SIZE
+#elif ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP
+#define ARENA__REGION_ALIGN ARENA_PAGE_SIZE
+#else
+#define ARENA__REGION_ALIGN sizeof(uintptr_t)
+#endif
+
+#define ARENA__ROUND_UP(n, to) (((n) + (to) - 1)/(to)*(to))
+#define ARENA__REGION_BYTES(capacity) \
+    ARENA__ROUND_UP(sizeof(Region) + sizeof(uintptr_t)*(capacity), ARENA__REGION_ALIGN)
+#define ARENA__POOLED_CAPACITY \
+    ((ARENA__REGION_BYTES(ARENA_REGION_DEFAULT_CAPACITY) - sizeof(Region))/sizeof(uintptr_t))
+
 #if ARENA_BACKEND == ARENA_BACKEND_LIBC_MALLOC
 #include <stdlib.h>
 
@@ -172,12 +216,22 @@ void free_region(Region *r)
 
 Region *new_region(size_t capacity)
 {
-    size_t size_bytes = sizeof(Region) + sizeof(uintptr_t) * capacity;
-    Region *r = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    size_t size_bytes = ARENA__REGION_BYTES(capacity);
+    Region *r = MAP_FAILED;
+#ifdef ARENA_HUGE_PAGES
+    // Reserved huge pages first, then transparent ones
+    r = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+    if (r == MAP_FAILED) {
+        r = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (r != MAP_FAILED) madvise(r, size_bytes, MADV_HUGEPAGE);
+    }
+#else
+    r = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+#endif // ARENA_HUGE_PAGES
     ARENA_ASSERT(r != MAP_FAILED);
     r->next = NULL;
     r->count = 0;
-    r->capacity = capacity;
+    r->capacity = (size_bytes - sizeof(Region))/sizeof(uintptr_t);
     return r;
 }
 
@@ -285,11 +339,94 @@ void free_region(Region *r)
 #  error "Unknown Arena backend"
 #endif
 
-// TODO: add debug statistic collection mode for arena
-// Should collect things like:
-// - How many times new_region was called
-// - How many times existing region was skipped
-// - How many times allocation exceeded ARENA_REGION_DEFAULT_CAPACITY
+// The free list head packs the region pointer into the low 48 bits, which
+// is all user space addresses use on x86-64 and AArch64, and a counter bumped
+// by every change into the rest, so a pop cannot succeed on a head that was
+// popped and pushed back in between (ABA).
+#define ARENA__POINTER_MASK ((UINT64_C(1) << 48) - 1)
+#define ARENA__TAG_ONE (UINT64_C(1) << 48)
+
+static _Atomic uint64_t arena__pool_head;
+static atomic_size_t arena__regions;
+static atomic_size_t arena__bytes;
+static atomic_size_t arena__in_use;
+static atomic_size_t arena__high_water;
+static atomic_size_t arena__pool_hits;
+static atomic_size_t arena__pool_misses;
+
+static Region *arena__pool_pop(void)
+{
+    uint64_t head = atomic_load_explicit(&arena__pool_head, memory_order_acquire);
+    for (;;) {
+        Region *r = (Region*)(uintptr_t)(head & ARENA__POINTER_MASK);
+        if (r == NULL) return NULL;
+        // Pooled regions are never unmapped while others may use the pool, so
+        // reading next is safe even if r was taken meanwhile; the CAS fails then
+        uint64_t next = ((head + ARENA__TAG_ONE) & ~ARENA__POINTER_MASK) | (uintptr_t)r->next;
+        if (atomic_compare_exchange_weak_explicit(&arena__pool_head, &head, next,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            return r;
+        }
+    }
+}
+
+static void arena__pool_push(Region *r)
+{
+    ARENA_ASSERT(((uintptr_t)r & ~ARENA__POINTER_MASK) == 0);
+    uint64_t head = atomic_load_explicit(&arena__pool_head, memory_order_relaxed);
+    uint64_t next;
+    do {
+        r->next = (Region*)(uintptr_t)(head & ARENA__POINTER_MASK);
+        next = ((head + ARENA__TAG_ONE) & ~ARENA__POINTER_MASK) | (uintptr_t)r;
+    } while (!atomic_compare_exchange_weak_explicit(&arena__pool_head, &head, next,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+static size_t arena__region_bytes(const Region *r)
+{
+    return sizeof(Region) + sizeof(uintptr_t)*r->capacity;
+}
+
+// A region with room for size words, from the free list when it fits one
+static Region *arena__acquire_region(size_t size)
+{
+    Region *r = NULL;
+    if (size <= ARENA__POOLED_CAPACITY) {
+        r = arena__pool_pop();
+    }
+    if (r != NULL) {
+        atomic_fetch_add_explicit(&arena__pool_hits, 1, memory_order_relaxed);
+        r->next = NULL;
+        r->count = 0;
+    } else {
+        atomic_fetch_add_explicit(&arena__pool_misses, 1, memory_order_relaxed);
+        r = new_region(size <= ARENA_REGION_DEFAULT_CAPACITY ? ARENA_REGION_DEFAULT_CAPACITY : size);
+        atomic_fetch_add_explicit(&arena__regions, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&arena__bytes, arena__region_bytes(r), memory_order_relaxed);
+    }
+
+    size_t in_use = atomic_fetch_add_explicit(&arena__in_use, arena__region_bytes(r),
+                                              memory_order_relaxed) + arena__region_bytes(r);
+    size_t high_water = atomic_load_explicit(&arena__high_water, memory_order_relaxed);
+    while (in_use > high_water &&
+           !atomic_compare_exchange_weak_explicit(&arena__high_water, &high_water, in_use,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+    return r;
+}
+
+static void arena__release_region(Region *r)
+{
+    size_t bytes = arena__region_bytes(r);
+    atomic_fetch_sub_explicit(&arena__in_use, bytes, memory_order_relaxed);
+    if (r->capacity == ARENA__POOLED_CAPACITY) {
+        arena__pool_push(r);
+    } else {
+        atomic_fetch_sub_explicit(&arena__regions, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&arena__bytes, bytes, memory_order_relaxed);
+        free_region(r);
+    }
+}
 
 void *arena_alloc(Arena *a, size_t size_bytes)
 {
@@ -297,9 +434,7 @@ void *arena_alloc(Arena *a, size_t size_bytes)
 
     if (a->end == NULL) {
         ARENA_ASSERT(a->begin == NULL);
-        size_t capacity = ARENA_REGION_DEFAULT_CAPACITY;
-        if (capacity < size) capacity = size;
-        a->end = new_region(capacity);
+        a->end = arena__acquire_region(size);
         a->begin = a->end;
     }
 
@@ -309,9 +444,7 @@ void *arena_alloc(Arena *a, size_t size_bytes)
 
     if (a->end->count + size > a->end->capacity) {
         ARENA_ASSERT(a->end->next == NULL);
-        size_t capacity = ARENA_REGION_DEFAULT_CAPACITY;
-        if (capacity < size) capacity = size;
-        a->end->next = new_region(capacity);
+        a->end->next = arena__acquire_region(size);
         a->end = a->end->next;
     }
 
@@ -432,7 +565,7 @@ void arena_free(Arena *a)
     while (r) {
         Region *r0 = r;
         r = r->next;
-        free_region(r0);
+        arena__release_region(r0);
     }
     a->begin = NULL;
     a->end = NULL;
@@ -443,9 +576,29 @@ void arena_trim(Arena *a){
     while (r) {
         Region *r0 = r;
         r = r->next;
-        free_region(r0);
+        arena__release_region(r0);
     }
     a->end->next = NULL;
 }
 
+void arena_stats(Arena_Stats *stats)
+{
+    stats->regions = atomic_load_explicit(&arena__regions, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&arena__bytes, memory_order_relaxed);
+    stats->in_use = atomic_load_explicit(&arena__in_use, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&arena__high_water, memory_order_relaxed);
+    stats->pool_hits = atomic_load_explicit(&arena__pool_hits, memory_order_relaxed);
+    stats->pool_misses = atomic_load_explicit(&arena__pool_misses, memory_order_relaxed);
+}
+
+void arena_pool_drain(void)
+{
+    Region *r;
+    while ((r = arena__pool_pop()) != NULL) {
+        atomic_fetch_sub_explicit(&arena__regions, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&arena__bytes, arena__region_bytes(r), memory_order_relaxed);
+        free_region(r);
+    }
+}
+
 #endif // ARENA_IMPLEMENTATION
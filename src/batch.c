@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include "analysis.h"
+#include "arena.h"
+#include "cache.h"
+#include "engine.h"
+#include "evalstore.h"
+#include "game.h"
+#include "json.h"
+#include "linebuf.h"
+#include "metrics.h"
+#include "pgn.h"
+#include "pool.h"
+#include "uci.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECKPOINT_FORMAT "stockfish-api-batch 1 %lu %lu %lu\n"
+
+typedef enum {
+  SLOT_FREE,
+  SLOT_RUNNING,
+  SLOT_DONE,    // Output ready, waiting for its turn in input order
+  SLOT_WRITTEN, // Output written, waiting for older positions to finish
+} SlotState;
+
+typedef struct {
+  SlotState state;
+  uint64_t line_no;
+  uint64_t input_end;  // Input offset just past the position's line
+  uint64_t out_offset; // Where its output starts, once written
+  char *output;
+  size_t output_len;
+} BatchSlot;
+
+/* Positions are numbered in input order and live in a ring of inflight
+   slots until they are retired, which happens strictly in input order. The
+   retired prefix is what a checkpoint records, so a resumed run starts
+   reading right after it. */
+typedef struct {
+  const BatchOptions *options;
+  EnginePool *pool;
+  EvalStore *store;
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+
+  int input_fd;
+  LineBuffer input;
+  uint64_t input_base; // Input offset of the line buffer's first byte
+  uint64_t line_no;    // Last input line read
+  bool input_eof;
+  bool input_done;
+
+  int output_fd;
+  uint64_t output_size;
+  char *checkpoint_path;
+  time_t last_checkpoint;
+
+  BatchSlot *slots;
+  size_t window;
+  uint64_t next_seq; // Sequence number of the next position read
+  uint64_t base_seq; // Oldest position not yet retired
+  uint64_t done_line;
+  uint64_t done_offset;
+
+  // Lines an interrupted run already wrote past its checkpoint
+  uint64_t *resumed;
+  size_t resumed_count;
+  uint64_t resume_offset;
+
+  uint64_t searched;
+  bool failed;
+} Batch;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static void write_checkpoint(Batch *batch) {
+  if (!batch->checkpoint_path) {
+    return;
+  }
+  batch->last_checkpoint = time(NULL);
+
+  // Everything an interrupted run may have written out of order lies past
+  // the oldest output of a position that is not retired yet
+  uint64_t scan = batch->output_size;
+  for (uint64_t seq = batch->base_seq; seq < batch->next_seq; seq++) {
+    BatchSlot *slot = &batch->slots[seq % batch->window];
+    if (slot->state == SLOT_WRITTEN && slot->out_offset < scan) {
+      scan = slot->out_offset;
+    }
+  }
+
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", batch->checkpoint_path);
+  FILE *file = fopen(tmp_path, "w");
+  if (!file || fdatasync(batch->output_fd) == -1) {
+    fprintf(stderr, "Failed to write checkpoint %s: %s\n", tmp_path,
+            strerror(errno));
+    if (file) {
+      fclose(file);
+    }
+    return;
+  }
+  fprintf(file, CHECKPOINT_FORMAT, (unsigned long)batch->done_offset,
+          (unsigned long)batch->done_line, (unsigned long)scan);
+  if (fflush(file) != 0 || fsync(fileno(file)) == -1 || fclose(file) != 0 ||
+      rename(tmp_path, batch->checkpoint_path) == -1) {
+    fprintf(stderr, "Failed to write checkpoint %s: %s\n",
+            batch->checkpoint_path, strerror(errno));
+  }
+}
+
+static void write_slot(Batch *batch, BatchSlot *slot) {
+  if (!batch->failed &&
+      write_all(batch->output_fd, slot->output, slot->output_len) == -1) {
+    fprintf(stderr, "Failed to write batch output: %s\n", strerror(errno));
+    batch->failed = true;
+  }
+  slot->out_offset = batch->output_size;
+  batch->output_size += slot->output_len;
+  free(slot->output);
+  slot->output = NULL;
+  slot->state = SLOT_WRITTEN;
+}
+
+/* Retires finished positions from the front of the window, writing them
+   first when the output follows input order. */
+static void retire(Batch *batch) {
+  while (batch->base_seq < batch->next_seq) {
+    BatchSlot *slot = &batch->slots[batch->base_seq % batch->window];
+    if (slot->state == SLOT_DONE) {
+      write_slot(batch, slot);
+    }
+    if (slot->state != SLOT_WRITTEN) {
+      break;
+    }
+    batch->done_line = slot->line_no;
+    batch->done_offset = slot->input_end;
+    slot->state = SLOT_FREE;
+    batch->base_seq++;
+  }
+
+  pthread_cond_broadcast(&batch->progress);
+  if (time(NULL) != batch->last_checkpoint) {
+    write_checkpoint(batch);
+  }
+}
+
+/* Returns the next input line, including a last one without a newline. The
+   view is only valid while the lock is held. */
+static bool next_line(Batch *batch, StrView *line) {
+  for (;;) {
+    if (linebuf_next(&batch->input, line)) {
+      batch->line_no++;
+      return true;
+    }
+    if (batch->input_eof) {
+      if (!linebuf_rest(&batch->input, line)) {
+        return false;
+      }
+      batch->line_no++;
+      return true;
+    }
+
+    ssize_t n = linebuf_fill(&batch->input, batch->input_fd);
+    if (n == 0) {
+      batch->input_eof = true;
+    } else if (n == -1 && errno != EINTR) {
+      fprintf(stderr, "Failed to read batch input: %s\n", strerror(errno));
+      batch->failed = true;
+      return false;
+    }
+  }
+}
+
+/* Copies the next unit of work into the arena: a position line for EPD input
+   or a whole game for PGN. Blank lines between them, and '#' comments in EPD,
+   are skipped. */
+static bool read_item(Batch *batch, Arena *arena, StrView *item,
+                      uint64_t *first_line) {
+  StringBuilder sb = {0};
+  PgnSplitter splitter = {0};
+  StrView line;
+
+  while (next_line(batch, &line)) {
+    StrView rest = line, token;
+    bool blank = !sv_next_token(&rest, &token);
+    if (sb.count == 0 &&
+        (blank || (batch->options->format == BATCH_FORMAT_EPD &&
+                   token.data[0] == '#'))) {
+      continue;
+    }
+    if (sb.count == 0) {
+      *first_line = batch->line_no;
+    }
+
+    sb_appendf(arena, &sb, "%.*s\n", (int)line.len, line.data);
+    if (batch->options->format == BATCH_FORMAT_EPD ||
+        pgn_split_line(&splitter, line)) {
+      break;
+    }
+  }
+  if (sb.count == 0) {
+    return false;
+  }
+
+  sb.items[sb.count - 1] = '\0';
+  *item = (StrView){sb.items, sb.count - 1};
+  return true;
+}
+
+static bool was_resumed(const Batch *batch, uint64_t line_no) {
+  size_t lo = 0, hi = batch->resumed_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (batch->resumed[mid] < line_no) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < batch->resumed_count && batch->resumed[lo] == line_no;
+}
+
+/* Splits an EPD or FEN line into the position and the EPD "id" operation,
+   if any. Move counters are kept when the line carries them. */
+static bool parse_position(Arena *arena, StrView line, char **fen,
+                           char **id) {
+  StrView rest = line, token;
+  StringBuilder sb = {0};
+
+  for (int field = 0; field < 4 && sv_next_token(&rest, &token); field++) {
+    sb_appendf(arena, &sb, "%s%.*s", field ? " " : "", (int)token.len,
+               token.data);
+  }
+  for (int field = 0; field < 2; field++) {
+    StrView peek = rest;
+    if (!sv_next_token(&peek, &token) ||
+        strspn(token.data, "0123456789") < token.len) {
+      break;
+    }
+    sb_appendf(arena, &sb, " %.*s", (int)token.len, token.data);
+    rest = peek;
+  }
+  arena_sb_append_null(arena, &sb);
+  *fen = sb.items;
+
+  *id = NULL;
+  const char *op = memmem(rest.data, rest.len, "id \"", 4);
+  if (op) {
+    const char *start = op + 4;
+    const char *end = memchr(start, '"', rest.data + rest.len - start);
+    if (end) {
+      *id = arena_alloc(arena, end - start + 1);
+      memcpy(*id, start, end - start);
+      (*id)[end - start] = '\0';
+    }
+  }
+
+  return analysis_valid_fen(*fen);
+}
+
+/* Moves a finished record out of the worker's arena so it can outlive the
+   next item. */
+static char *detach_output(StringBuilder sb, size_t *len) {
+  char *output = malloc(sb.count);
+  if (output) {
+    memcpy(output, sb.items, sb.count);
+    *len = sb.count;
+  }
+  return output;
+}
+
+/* Analyzes one position and returns its JSONL record, or NULL if the engine
+   failed and the position has to be retried by a later run. */
+static char *analyze_position(Batch *batch, Arena *arena, uint64_t line_no,
+                              StrView line, size_t *len) {
+  StringBuilder sb = {0};
+  char *fen, *id;
+  bool valid = parse_position(arena, line, &fen, &id);
+
+  sb_appendf(arena, &sb, "{\"line\":%lu", (unsigned long)line_no);
+  if (id) {
+    sb_appendf(arena, &sb, ",\"id\":");
+    json_append_string(arena, &sb, id);
+  }
+  sb_appendf(arena, &sb, ",\"fen\":");
+  json_append_string(arena, &sb, fen);
+
+  if (!valid) {
+    sb_appendf(arena, &sb, ",\"error\":\"fen\"}\n");
+  } else {
+    AnalysisRequest request = batch->options->limits;
+    request.fen = fen;
+    request.moves = "";
+
+    uint64_t key = cache_key(&request);
+    const char *source = "store";
+    SearchResult *result =
+        batch->store ? evalstore_lookup(batch->store, key, &request, arena)
+                     : NULL;
+    if (result) {
+      metrics_count(METRIC_STORE_HITS);
+    } else {
+      source = "engine";
+      uint64_t wait_us = metrics_now_us();
+      Engine *engine = pool_acquire(batch->pool);
+      metrics_record(METRIC_QUEUE_WAIT, metrics_now_us() - wait_us);
+      result = engine_search(engine, analysis_position_command(arena, &request),
+                             analysis_go_command(arena, &request),
+                             request.multipv, arena);
+      pool_release(batch->pool, engine);
+      if (!result) {
+        return NULL;
+      }
+      if (batch->store) {
+        evalstore_put(batch->store, key, result);
+      }
+    }
+
+    sb_appendf(arena, &sb, ",\"result\":");
+    analysis_result_to_json(arena, &sb, result, source, false);
+    sb_appendf(arena, &sb, "}\n");
+  }
+
+  return detach_output(sb, len);
+}
+
+/* Analyzes one PGN game on a single engine; NULL means the engine failed. */
+static char *analyze_game(Batch *batch, Arena *arena, uint64_t line_no,
+                          StrView text, size_t *len) {
+  StringBuilder sb = {0};
+  PgnGame game;
+
+  sb_appendf(arena, &sb, "{\"line\":%lu", (unsigned long)line_no);
+  if (!pgn_parse_game(arena, text.data, text.len, &game)) {
+    sb_appendf(arena, &sb, ",\"error\":\"pgn\"");
+  } else if (!game_analyze(batch->pool, arena, &game, &batch->options->limits,
+                           &sb)) {
+    return NULL;
+  }
+  sb_appendf(arena, &sb, "}\n");
+
+  return detach_output(sb, len);
+}
+
+static void *batch_worker(void *arg) {
+  Batch *batch = arg;
+  Arena arena = {0};
+
+  pthread_mutex_lock(&batch->lock);
+  for (;;) {
+    while (!batch->input_done && !batch->failed && !stop_requested &&
+           batch->next_seq - batch->base_seq == batch->window) {
+      pthread_cond_wait(&batch->progress, &batch->lock);
+    }
+    if (batch->input_done || batch->failed || stop_requested) {
+      break;
+    }
+
+    StrView item;
+    uint64_t first_line = 0;
+    arena_reset(&arena);
+    if (!read_item(batch, &arena, &item, &first_line)) {
+      batch->input_done = true;
+      pthread_cond_broadcast(&batch->progress);
+      break;
+    }
+
+    BatchSlot *slot = &batch->slots[batch->next_seq++ % batch->window];
+    slot->state = SLOT_RUNNING;
+    slot->line_no = first_line;
+    slot->input_end = batch->input_base + batch->input.head;
+
+    if (was_resumed(batch, slot->line_no)) {
+      slot->state = SLOT_WRITTEN;
+      slot->out_offset = batch->resume_offset;
+      retire(batch);
+      continue;
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    size_t len = 0;
+    char *output =
+        batch->options->format == BATCH_FORMAT_PGN
+            ? analyze_game(batch, &arena, slot->line_no, item, &len)
+            : analyze_position(batch, &arena, slot->line_no, item, &len);
+
+    pthread_mutex_lock(&batch->lock);
+    if (!output) {
+      // Leave the slot unretired so the checkpoint stops short of it
+      if (!stop_requested) {
+        fprintf(stderr, "Engine failed on item at line %lu, stopping\n",
+                (unsigned long)slot->line_no);
+      }
+      batch->failed = true;
+      pthread_cond_broadcast(&batch->progress);
+      break;
+    }
+
+    slot->output = output;
+    slot->output_len = len;
+    slot->state = SLOT_DONE;
+    batch->searched++;
+    if (batch->options->order == BATCH_ORDER_COMPLETION) {
+      write_slot(batch, slot);
+    }
+    retire(batch);
+  }
+  pthread_mutex_unlock(&batch->lock);
+
+  arena_free(&arena);
+  return NULL;
+}
+
+static int compare_lines(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Picks up where an interrupted run stopped: drops a partially written last
+   record and collects the lines already written past the checkpoint. */
+static int resume_output(Batch *batch, uint64_t scan_offset) {
+  LineBuffer lb;
+  if (linebuf_init(&lb, LINEBUF_DEFAULT_CAPACITY) != 0 ||
+      lseek(batch->output_fd, scan_offset, SEEK_SET) == -1) {
+    return -1;
+  }
+
+  size_t capacity = 0;
+  StrView line;
+  for (;;) {
+    while (linebuf_next(&lb, &line)) {
+      unsigned long line_no;
+      if (sscanf(line.data, "{\"line\":%lu", &line_no) != 1) {
+        continue;
+      }
+      if (batch->resumed_count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        batch->resumed =
+            realloc(batch->resumed, capacity * sizeof(*batch->resumed));
+      }
+      batch->resumed[batch->resumed_count++] = line_no;
+    }
+    ssize_t n = linebuf_fill(&lb, batch->output_fd);
+    if (n == 0) {
+      break;
+    }
+    if (n == -1 && errno != EINTR) {
+      linebuf_free(&lb);
+      return -1;
+    }
+  }
+
+  batch->output_size = scan_offset + lb.head;
+  linebuf_free(&lb);
+  if (ftruncate(batch->output_fd, batch->output_size) == -1 ||
+      lseek(batch->output_fd, batch->output_size, SEEK_SET) == -1) {
+    return -1;
+  }
+
+  qsort(batch->resumed, batch->resumed_count, sizeof(*batch->resumed),
+        compare_lines);
+  batch->resume_offset = scan_offset;
+  return 0;
+}
+
+static int open_output(Batch *batch) {
+  const char *path = batch->options->output_path;
+  if (!path) {
+    batch->output_fd = STDOUT_FILENO;
+    return 0;
+  }
+
+  size_t len = strlen(path) + sizeof(BATCH_CHECKPOINT_SUFFIX);
+  batch->checkpoint_path = malloc(len);
+  snprintf(batch->checkpoint_path, len, "%s" BATCH_CHECKPOINT_SUFFIX, path);
+
+  unsigned long offset = 0, line_no = 0, scan = 0;
+  FILE *checkpoint = fopen(batch->checkpoint_path, "r");
+  bool resuming = checkpoint != NULL;
+  if (checkpoint) {
+    int fields = fscanf(checkpoint, CHECKPOINT_FORMAT, &offset, &line_no,
+                        &scan);
+    fclose(checkpoint);
+    if (fields != 3) {
+      fprintf(stderr, "Unreadable checkpoint %s\n", batch->checkpoint_path);
+      return -1;
+    }
+  }
+
+  batch->output_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC |
+                                    (resuming ? 0 : O_TRUNC),
+                          0644);
+  if (batch->output_fd == -1 || (resuming && resume_output(batch, scan) != 0)) {
+    fprintf(stderr, "Failed to open batch output %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  if (resuming) {
+    fprintf(stderr, "Resuming after line %lu\n", line_no);
+    batch->input_base = offset;
+    batch->line_no = line_no;
+    batch->done_offset = offset;
+    batch->done_line = line_no;
+  }
+  return 0;
+}
+
+/* Streams positions from the input file through every engine in the pool,
+   keeping at most options->inflight positions between reading and writing.
+   Returns 0 once the whole input has been written. */
+int batch_run(const BatchOptions *options, EnginePool *pool, EvalStore *store) {
+  Batch batch = {0};
+  batch.options = options;
+  batch.pool = pool;
+  batch.store = store;
+  batch.input_fd = -1;
+  batch.output_fd = -1;
+  batch.window = options->inflight ? options->inflight
+                                   : pool->size * BATCH_INFLIGHT_PER_ENGINE;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.progress, NULL);
+
+  int rc = -1;
+  pthread_t *threads = calloc(pool->size, sizeof(*threads));
+  batch.slots = calloc(batch.window, sizeof(*batch.slots));
+  if (!threads || !batch.slots ||
+      linebuf_init(&batch.input, LINEBUF_DEFAULT_CAPACITY) != 0 ||
+      open_output(&batch) != 0) {
+    goto cleanup;
+  }
+
+  batch.input_fd = open(options->input_path, O_RDONLY | O_CLOEXEC);
+  if (batch.input_fd == -1 ||
+      lseek(batch.input_fd, batch.input_base, SEEK_SET) == -1) {
+    fprintf(stderr, "Failed to open batch input %s: %s\n", options->input_path,
+            strerror(errno));
+    goto cleanup;
+  }
+
+  signal(SIGINT, handle_stop_signal);
+  signal(SIGTERM, handle_stop_signal);
+
+  size_t started = 0;
+  while (started < pool->size &&
+         pthread_create(&threads[started], NULL, batch_worker, &batch) == 0) {
+    started++;
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  if (started == 0) {
+    fprintf(stderr, "Failed to start batch workers\n");
+    goto cleanup;
+  }
+
+  write_checkpoint(&batch);
+  bool complete = batch.input_done && !batch.failed && !stop_requested &&
+                  batch.base_seq == batch.next_seq;
+  if (complete && batch.checkpoint_path) {
+    unlink(batch.checkpoint_path);
+  }
+  fprintf(stderr, "%s after line %lu (%lu analyzed)\n",
+          complete ? "Finished" : "Stopped", (unsigned long)batch.done_line,
+          (unsigned long)batch.searched);
+  rc = complete ? 0 : -1;
+
+cleanup:
+  for (size_t i = 0; batch.slots && i < batch.window; i++) {
+    free(batch.slots[i].output);
+  }
+  if (batch.input_fd != -1) {
+    close(batch.input_fd);
+  }
+  if (batch.output_fd != -1 && batch.output_fd != STDOUT_FILENO) {
+    close(batch.output_fd);
+  }
+  linebuf_free(&batch.input);
+  free(batch.checkpoint_path);
+  free(batch.resumed);
+  free(batch.slots);
+  free(threads);
+  pthread_cond_destroy(&batch.progress);
+  pthread_mutex_destroy(&batch.lock);
+  return rc;
+}
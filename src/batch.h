@@ -0,0 +1,33 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "analysis.h"
+#include "evalstore.h"
+#include "pool.h"
+#include <stddef.h>
+
+#define BATCH_CHECKPOINT_SUFFIX ".checkpoint"
+#define BATCH_INFLIGHT_PER_ENGINE 4
+
+typedef enum {
+  BATCH_ORDER_INPUT,
+  BATCH_ORDER_COMPLETION,
+} BatchOrder;
+
+typedef enum {
+  BATCH_FORMAT_EPD, // One FEN or EPD position per line
+  BATCH_FORMAT_PGN, // Whole games, each analyzed move by move
+} BatchFormat;
+
+typedef struct {
+  const char *input_path;
+  BatchFormat format;
+  const char *output_path; // NULL writes to stdout, without checkpoints
+  BatchOrder order;
+  size_t inflight; // Items read but not yet written; 0 picks a default
+  AnalysisRequest limits; // Search limits applied to every position searched
+} BatchOptions;
+
+int batch_run(const BatchOptions *options, EnginePool *pool, EvalStore *store);
+
+#endif
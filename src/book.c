@@ -0,0 +1,122 @@
+#include "book.h"
+#include "uci.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(BookEntry) == 16, "entries must match the file");
+
+/* Maps the book at path. Only the pages a lookup touches are ever read, so
+   opening even a large book is cheap. */
+int book_open(Book *book, const char *path) {
+  memset(book, 0, sizeof(*book));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open opening book %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0 ||
+      st.st_size % sizeof(BookEntry) != 0) {
+    fprintf(stderr, "%s is not a Polyglot book\n", path);
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map opening book %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  // Lookups jump around the file; readahead would only waste memory
+  madvise(map, st.st_size, MADV_RANDOM);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  book->entries = map;
+  book->count = st.st_size / sizeof(BookEntry);
+  book->rng = (uint64_t)ts.tv_sec << 32 ^ (uint64_t)ts.tv_nsec;
+  printf("Loaded opening book %s with %zu entries\n", path, book->count);
+  return 0;
+}
+
+void book_close(Book *book) {
+  if (book->entries) {
+    munmap((void *)book->entries, book->count * sizeof(BookEntry));
+    book->entries = NULL;
+  }
+}
+
+// splitmix64: seeded from the clock, so repeated requests vary
+static uint64_t next_random(Book *book) {
+  uint64_t z = (book->rng += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Book moves pack the to square in bits 0-5, the from square in bits 6-11
+   and the promotion in bits 12-14, and write castling as the king taking its
+   own rook. */
+static uint16_t book_move(const Position *pos, uint16_t packed) {
+  int to = packed & 0x3f, from = (packed >> 6) & 0x3f;
+  int promotion = (packed >> 12) & 0x7;
+  if (promotion > PROMOTE_QUEEN) {
+    return MOVE_NONE;
+  }
+
+  uint8_t piece = pos->squares[from];
+  if (piece == PIECE_NONE || PIECE_COLOR(piece) != pos->side) {
+    return MOVE_NONE;
+  }
+  if (PIECE_TYPE(piece) == KING &&
+      pos->squares[to] == PIECE_MAKE(pos->side, ROOK)) {
+    to = to > from ? from + 2 : from - 2;
+  }
+  return MOVE_MAKE(from, to, promotion);
+}
+
+/* Picks one of the book's moves for the position, each with a chance in
+   proportion to its weight. Returns MOVE_NONE if the book has none. */
+uint16_t book_probe(Book *book, const Position *pos) {
+  uint64_t key = pos->key;
+
+  size_t lo = 0, hi = book->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (be64toh(book->entries[mid].key) < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  uint64_t total = 0;
+  size_t end = lo;
+  for (; end < book->count && be64toh(book->entries[end].key) == key; end++) {
+    total += be16toh(book->entries[end].weight);
+  }
+  if (total == 0) {
+    return MOVE_NONE;
+  }
+
+  uint64_t pick = next_random(book) % total;
+  for (size_t i = lo; i < end; i++) {
+    uint16_t weight = be16toh(book->entries[i].weight);
+    if (pick < weight) {
+      return book_move(pos, be16toh(book->entries[i].move));
+    }
+    pick -= weight;
+  }
+  return MOVE_NONE;
+}
@@ -0,0 +1,27 @@
+#ifndef BOOK_H
+#define BOOK_H
+
+#include "position.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* One entry of a Polyglot book, stored big endian and sorted by key. A
+   position has one entry per book move. */
+typedef struct {
+  uint64_t key;
+  uint16_t move;
+  uint16_t weight;
+  uint32_t learn;
+} BookEntry;
+
+typedef struct {
+  const BookEntry *entries; // Mapped read only
+  size_t count;
+  uint64_t rng;
+} Book;
+
+int book_open(Book *book, const char *path);
+void book_close(Book *book);
+uint16_t book_probe(Book *book, const Position *pos);
+
+#endif
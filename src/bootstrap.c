@@ -0,0 +1,115 @@
+#include "bootstrap.h"
+#include "download.h"
+#include "layout.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Threads per engine as configured with --option Threads, or 0 to have the
+   layout calibrated. */
+static size_t configured_threads(const Bootstrap *bootstrap) {
+  for (size_t i = 0; i < bootstrap->option_count; i++) {
+    if (strcasecmp(bootstrap->options[i].name, "Threads") == 0) {
+      long threads = atol(bootstrap->options[i].value);
+      return threads > 0 ? (size_t)threads : 1;
+    }
+  }
+  return 0;
+}
+
+static void *bootstrap_thread(void *arg) {
+  Bootstrap *bootstrap = arg;
+  BootstrapState state = BOOTSTRAP_FAILED;
+
+  const char *exec_path;
+  EngineLayout layout = {0};
+  size_t threads = configured_threads(bootstrap);
+  if (get_stockfish(bootstrap->arena, &exec_path) == -1) {
+    fprintf(stderr, "Failed to get stockfish engine\n");
+  } else if ((threads ? layout_init(&layout, threads)
+                      : layout_calibrate(&layout, exec_path)) != 0) {
+    fprintf(stderr, "Failed to lay out the engines\n");
+    layout_free(&layout);
+  } else if (pool_init(bootstrap->pool, bootstrap->workers,
+                       bootstrap->max_workers, exec_path, bootstrap->options,
+                       bootstrap->option_count, &layout,
+                       bootstrap->budget) != 0) {
+    fprintf(stderr, "Failed to start the engine pool\n");
+  } else {
+    printf("%zu engines of %zu threads ready\n", bootstrap->pool->size,
+           bootstrap->pool->layout.threads);
+    state = BOOTSTRAP_READY;
+  }
+
+  atomic_store(&bootstrap->state, state);
+  uint64_t one = 1;
+  if (write(bootstrap->event_fd, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr, "Failed to signal the end of the engine setup: %s\n",
+            strerror(errno));
+  }
+  return NULL;
+}
+
+int bootstrap_start(Bootstrap *bootstrap, EnginePool *pool, size_t workers,
+                    size_t max_workers, const EngineOption *options,
+                    size_t option_count, const MemoryBudget *budget,
+                    Arena *arena) {
+  memset(bootstrap, 0, sizeof(*bootstrap));
+  bootstrap->pool = pool;
+  bootstrap->workers = workers;
+  bootstrap->max_workers = max_workers;
+  bootstrap->options = options;
+  bootstrap->option_count = option_count;
+  bootstrap->budget = budget;
+  bootstrap->arena = arena;
+  atomic_init(&bootstrap->state, BOOTSTRAP_RUNNING);
+
+  bootstrap->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (bootstrap->event_fd == -1) {
+    fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+    return -1;
+  }
+
+  int rc = pthread_create(&bootstrap->thread, NULL, bootstrap_thread,
+                          bootstrap);
+  if (rc != 0) {
+    fprintf(stderr, "Failed to start the engine setup: %s\n", strerror(rc));
+    close(bootstrap->event_fd);
+    return -1;
+  }
+  return 0;
+}
+
+BootstrapState bootstrap_state(Bootstrap *bootstrap) {
+  return atomic_load(&bootstrap->state);
+}
+
+/* Blocks until the engine setup is over, for callers that cannot do
+   anything without an engine. */
+BootstrapState bootstrap_wait(Bootstrap *bootstrap) {
+  if (!bootstrap->joined) {
+    pthread_join(bootstrap->thread, NULL);
+    bootstrap->joined = true;
+  }
+  return bootstrap_state(bootstrap);
+}
+
+/* Tears down the pool once the setup has finished. A setup still running,
+   e.g. a download at shutdown, is abandoned instead of waited for: it
+   resumes on the next start, and orphaned engines exit on EOF. */
+void bootstrap_destroy(Bootstrap *bootstrap) {
+  if (bootstrap_state(bootstrap) == BOOTSTRAP_RUNNING) {
+    printf("Abandoning the unfinished engine setup\n");
+    pthread_detach(bootstrap->thread);
+    return;
+  }
+  if (bootstrap_wait(bootstrap) == BOOTSTRAP_READY) {
+    pool_destroy(bootstrap->pool);
+  }
+  close(bootstrap->event_fd);
+}
@@ -0,0 +1,43 @@
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include "arena.h"
+#include "budget.h"
+#include "engine.h"
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+  BOOTSTRAP_RUNNING,
+  BOOTSTRAP_READY, // The pool is initialized and every engine sent readyok
+  BOOTSTRAP_FAILED,
+} BootstrapState;
+
+/* Fetches the engine and starts the pool on a thread of its own, so the
+   server can take requests meanwhile. */
+typedef struct {
+  EnginePool *pool;
+  size_t workers; // 0 follows the number of cores
+  size_t max_workers;
+  const EngineOption *options;
+  size_t option_count;
+  const MemoryBudget *budget; // NULL without --mem-budget
+  Arena *arena; // Scratch memory for the download
+  int event_fd; // Becomes readable once the state leaves BOOTSTRAP_RUNNING
+  _Atomic BootstrapState state;
+  pthread_t thread;
+  bool joined;
+} Bootstrap;
+
+int bootstrap_start(Bootstrap *bootstrap, EnginePool *pool, size_t workers,
+                    size_t max_workers, const EngineOption *options,
+                    size_t option_count, const MemoryBudget *budget,
+                    Arena *arena);
+BootstrapState bootstrap_state(Bootstrap *bootstrap);
+BootstrapState bootstrap_wait(Bootstrap *bootstrap);
+void bootstrap_destroy(Bootstrap *bootstrap);
+
+#endif
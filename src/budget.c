@@ -0,0 +1,83 @@
+#include "budget.h"
+#include "cache.h"
+#include <stdio.h>
+
+void budget_init(MemoryBudget *budget, size_t total_mb, size_t cache_mb) {
+  budget->total_mb = total_mb;
+  budget->cache_share_mb = cache_mb;
+  budget->cache_capacity_mb = cache_mb;
+  budget->cache_max_mb = cache_mb;
+  budget->window_start_ms = 0;
+  budget->window_hits = 0;
+  budget->window_misses = 0;
+}
+
+/* Hash each of `engines` engines gets once the cache has its share. Rounded
+   down to a power of two, so small changes in the pool size do not make
+   every engine reallocate its table. */
+size_t budget_engine_hash(const MemoryBudget *budget, size_t engines) {
+  size_t reserved =
+      budget->cache_share_mb + engines * BUDGET_ENGINE_OVERHEAD_MB;
+  if (engines == 0 || budget->total_mb < reserved + engines) {
+    return 1;
+  }
+
+  size_t hash = (budget->total_mb - reserved) / engines;
+  size_t rounded = 1;
+  while (rounded * 2 <= hash) {
+    rounded *= 2;
+  }
+  return rounded;
+}
+
+/* Memory left when `engines` engines hold `hash_mb` of hash between them. */
+size_t budget_free_mb(const MemoryBudget *budget, size_t engines,
+                      size_t hash_mb) {
+  size_t used = budget->cache_capacity_mb + hash_mb +
+                engines * BUDGET_ENGINE_OVERHEAD_MB;
+  return budget->total_mb > used ? budget->total_mb - used : 0;
+}
+
+/* Once per window, halves the cache's share if hardly any lookup hit it, or
+   doubles it back towards --cache-size if it is full and paying off. The
+   capacity follows a smaller share right away; returns true if the share
+   changed. */
+bool budget_review_cache(MemoryBudget *budget, EvalCache *cache,
+                         uint64_t now_ms) {
+  if (budget->cache_max_mb == 0 ||
+      now_ms - budget->window_start_ms < BUDGET_WINDOW_MS) {
+    return false;
+  }
+
+  uint64_t hits = atomic_load(&cache->hits);
+  uint64_t misses = atomic_load(&cache->misses);
+  uint64_t window_hits = hits - budget->window_hits;
+  uint64_t lookups = window_hits + misses - budget->window_misses;
+  budget->window_start_ms = now_ms;
+  budget->window_hits = hits;
+  budget->window_misses = misses;
+  if (lookups < BUDGET_MIN_LOOKUPS) {
+    return false;
+  }
+
+  double rate = (double)window_hits / (double)lookups;
+  size_t share = budget->cache_share_mb;
+  if (rate < BUDGET_LOW_HIT_RATE && share > BUDGET_MIN_CACHE_MB) {
+    share = share / 2 > BUDGET_MIN_CACHE_MB ? share / 2 : BUDGET_MIN_CACHE_MB;
+  } else if (rate > BUDGET_HIGH_HIT_RATE && share < budget->cache_max_mb &&
+             cache_size(cache) >= (budget->cache_capacity_mb << 20) / 10 * 9) {
+    share = share * 2 < budget->cache_max_mb ? share * 2 : budget->cache_max_mb;
+  }
+  if (share == budget->cache_share_mb) {
+    return false;
+  }
+
+  printf("Cache hit rate %.1f%%, giving it %zu MB of the memory budget\n",
+         rate * 100, share);
+  budget->cache_share_mb = share;
+  if (budget->cache_capacity_mb > share) {
+    budget->cache_capacity_mb = share;
+    cache_resize(cache, share << 20);
+  }
+  return true;
+}
@@ -0,0 +1,36 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "cache.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An engine process without its hash table: code, networks, stacks
+#define BUDGET_ENGINE_OVERHEAD_MB 96
+#define BUDGET_MIN_CACHE_MB 4
+#define BUDGET_WINDOW_MS 60000
+#define BUDGET_MIN_LOOKUPS 100 // Fewer lookups in a window say nothing
+#define BUDGET_LOW_HIT_RATE 0.05
+#define BUDGET_HIGH_HIT_RATE 0.25
+
+/* Splits --mem-budget between the engines' hash tables and the evaluation
+   cache. The cache has a share, which the engines' Hash is sized around, and
+   a capacity, which only grows into memory the engines have given back. */
+typedef struct {
+  size_t total_mb;
+  size_t cache_share_mb;
+  size_t cache_capacity_mb;
+  size_t cache_max_mb; // As configured with --cache-size
+  uint64_t window_start_ms;
+  uint64_t window_hits, window_misses; // Cache counters at window_start_ms
+} MemoryBudget;
+
+void budget_init(MemoryBudget *budget, size_t total_mb, size_t cache_mb);
+size_t budget_engine_hash(const MemoryBudget *budget, size_t engines);
+size_t budget_free_mb(const MemoryBudget *budget, size_t engines,
+                      size_t hash_mb);
+bool budget_review_cache(MemoryBudget *budget, EvalCache *cache,
+                         uint64_t now_ms);
+
+#endif
@@ -0,0 +1,224 @@
+#include "cache.h"
+#include "analysis.h"
+#include "arena.h"
+#include "position.h"
+#include "uci.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_AVERAGE_ENTRY_SIZE 256
+
+static SearchResult *entry_result(CacheEntry *entry) {
+  return (SearchResult *)entry->data;
+}
+
+static CacheShard *shard_for(EvalCache *cache, uint64_t key) {
+  return &cache->shards[key >> 58];
+}
+
+int cache_init(EvalCache *cache, size_t capacity_bytes) {
+  size_t shard_capacity = capacity_bytes / CACHE_SHARDS;
+  size_t bucket_count = 16;
+  while (bucket_count * CACHE_AVERAGE_ENTRY_SIZE < shard_capacity) {
+    bucket_count *= 2;
+  }
+
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &cache->shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->buckets = calloc(bucket_count, sizeof(*shard->buckets));
+    shard->bucket_count = bucket_count;
+    shard->lru_head = NULL;
+    shard->lru_tail = NULL;
+    shard->bytes = 0;
+    shard->capacity = shard_capacity;
+
+    if (!shard->buckets) {
+      fprintf(stderr, "Failed to allocate evaluation cache\n");
+      for (size_t j = 0; j <= i; j++) {
+        free(cache->shards[j].buckets);
+        pthread_mutex_destroy(&cache->shards[j].lock);
+      }
+      return -1;
+    }
+  }
+
+  atomic_init(&cache->hits, 0);
+  atomic_init(&cache->misses, 0);
+  return 0;
+}
+
+void cache_destroy(EvalCache *cache) {
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &cache->shards[i];
+    CacheEntry *entry = shard->lru_head;
+    while (entry) {
+      CacheEntry *next = entry->next;
+      free(entry);
+      entry = next;
+    }
+    free(shard->buckets);
+    shard->buckets = NULL;
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
+
+/* The key is the position reached after the moves, whichever order they
+   came in and whatever the move counters say. The limits and the number of
+   lines are left out on purpose: a deeper search, or one with more lines,
+   answers a request asking for less. */
+uint64_t cache_key(const AnalysisRequest *request) {
+  Position pos;
+  analysis_final_position(request, &pos);
+  return pos.key;
+}
+
+static CacheEntry **find(CacheShard *shard, uint64_t key) {
+  CacheEntry **link = &shard->buckets[key & (shard->bucket_count - 1)];
+  while (*link && (*link)->key != key) {
+    link = &(*link)->chain;
+  }
+  return link;
+}
+
+static void lru_unlink(CacheShard *shard, CacheEntry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    shard->lru_head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    shard->lru_tail = entry->prev;
+  }
+}
+
+static void lru_push_front(CacheShard *shard, CacheEntry *entry) {
+  entry->prev = NULL;
+  entry->next = shard->lru_head;
+  if (shard->lru_head) {
+    shard->lru_head->prev = entry;
+  } else {
+    shard->lru_tail = entry;
+  }
+  shard->lru_head = entry;
+}
+
+static void remove_entry(CacheShard *shard, CacheEntry *entry) {
+  CacheEntry **link = find(shard, entry->key);
+  *link = entry->chain;
+  lru_unlink(shard, entry);
+  shard->bytes -= entry->size;
+  free(entry);
+}
+
+/* Copies the first count lines of result into the arena. PV moves are laid
+   out line after line, so theirs are a prefix of the moves. */
+static SearchResult *copy_lines(Arena *arena, const SearchResult *result,
+                                size_t count) {
+  const PvLine *last = &result->lines[count - 1];
+  size_t move_count = last->pv_offset + last->pv_count;
+  size_t size = sizeof(SearchResult) + count * sizeof(PvLine) +
+                move_count * sizeof(uint16_t);
+  SearchResult *copy = arena_alloc(arena, size);
+  memcpy(copy, result, sizeof(SearchResult) + count * sizeof(PvLine));
+  copy->size = (uint32_t)size;
+  copy->line_count = (uint16_t)count;
+  memcpy((uint16_t *)search_result_moves(copy), search_result_moves(result),
+         move_count * sizeof(uint16_t));
+  return copy;
+}
+
+/* Returns a copy of the cached result, allocated in the arena, if it was
+   searched at least as deep as the request asks for. Lines beyond the
+   requested number are dropped from the copy. */
+SearchResult *cache_lookup(EvalCache *cache, uint64_t key,
+                           const AnalysisRequest *request, Arena *arena) {
+  CacheShard *shard = shard_for(cache, key);
+  SearchResult *copy = NULL;
+
+  pthread_mutex_lock(&shard->lock);
+  CacheEntry *entry = *find(shard, key);
+  if (entry && analysis_result_satisfies(entry_result(entry), request)) {
+    lru_unlink(shard, entry);
+    lru_push_front(shard, entry);
+    copy = copy_lines(arena, entry_result(entry), request->multipv);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  atomic_fetch_add(copy ? &cache->hits : &cache->misses, 1);
+  return copy;
+}
+
+/* Stores a result, evicting least recently used entries to stay within
+   capacity. A result held for the same key is only replaced by one at least
+   as deep and with at least as many lines, so no lookup is answered worse
+   than before. */
+void cache_store(EvalCache *cache, uint64_t key, const SearchResult *result) {
+  CacheShard *shard = shard_for(cache, key);
+  size_t size = sizeof(CacheEntry) + result->size;
+  if (result->line_count == 0 || size > shard->capacity) {
+    return;
+  }
+
+  CacheEntry *entry = malloc(size);
+  if (!entry) {
+    return;
+  }
+  entry->key = key;
+  entry->size = size;
+  memcpy(entry->data, result, result->size);
+
+  pthread_mutex_lock(&shard->lock);
+  CacheEntry *existing = *find(shard, key);
+  if (existing) {
+    const SearchResult *held = entry_result(existing);
+    if (result->lines[0].depth < held->lines[0].depth ||
+        result->line_count < held->line_count) {
+      pthread_mutex_unlock(&shard->lock);
+      free(entry);
+      return;
+    }
+    remove_entry(shard, existing);
+  }
+
+  while (shard->bytes + size > shard->capacity && shard->lru_tail) {
+    remove_entry(shard, shard->lru_tail);
+  }
+
+  CacheEntry **bucket = &shard->buckets[key & (shard->bucket_count - 1)];
+  entry->chain = *bucket;
+  *bucket = entry;
+  lru_push_front(shard, entry);
+  shard->bytes += size;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Bytes held by cached results across all shards. */
+size_t cache_size(EvalCache *cache) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  return bytes;
+}
+
+/* Changes the capacity, evicting least recently used entries if it shrank.
+   The bucket arrays keep their size. */
+void cache_resize(EvalCache *cache, size_t capacity_bytes) {
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    shard->capacity = capacity_bytes / CACHE_SHARDS;
+    while (shard->bytes > shard->capacity && shard->lru_tail) {
+      remove_entry(shard, shard->lru_tail);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "analysis.h"
+#include "arena.h"
+#include "uci.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_SHARDS 64
+#define CACHE_DEFAULT_SIZE_MB 64
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+  uint64_t key;
+  CacheEntry *chain;       // Next entry in the same hash bucket
+  CacheEntry *prev, *next; // LRU order, most recently used first
+  size_t size;             // Bytes charged against the shard
+  uintptr_t data[];        // The SearchResult, copied as a whole
+};
+
+/* Each shard is an independent LRU with its own lock, picked by the top bits
+   of the key, so threads only contend when they hit the same shard. */
+typedef struct {
+  pthread_mutex_t lock;
+  CacheEntry **buckets;
+  size_t bucket_count; // Power of two
+  CacheEntry *lru_head, *lru_tail;
+  size_t bytes;
+  size_t capacity;
+} CacheShard;
+
+typedef struct {
+  CacheShard shards[CACHE_SHARDS];
+  atomic_uint_fast64_t hits;
+  atomic_uint_fast64_t misses;
+} EvalCache;
+
+int cache_init(EvalCache *cache, size_t capacity_bytes);
+void cache_destroy(EvalCache *cache);
+uint64_t cache_key(const AnalysisRequest *request);
+SearchResult *cache_lookup(EvalCache *cache, uint64_t key,
+                           const AnalysisRequest *request, Arena *arena);
+void cache_store(EvalCache *cache, uint64_t key, const SearchResult *result);
+size_t cache_size(EvalCache *cache);
+void cache_resize(EvalCache *cache, size_t capacity_bytes);
+
+#endif
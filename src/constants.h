@@ -1,13 +1,32 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-#define STOCKFISH_TAR_FILENAME ".cache/stockfish.tar"
-#define STOCKFISH_EXEC_REGEX_PATTERN "stockfish/stockfish-ubuntu-x86-64"
-#define STOCKFISH_EXEC_PATH ".cache/stockfish/stockfish-ubuntu-x86-64"
+#define STOCKFISH_TAR_PART_FILENAME ".cache/stockfish.tar.part"
+#define STOCKFISH_TAR_STATE_FILENAME ".cache/stockfish.tar.part.state"
+#define STOCKFISH_ROOTDIR ".cache/"
+// Installed builds live under the SHA-256 of their tarball, each build name
+// being a symlink into here
+#define STOCKFISH_ENGINES_SUBDIR "engines/"
+#define STOCKFISH_ENGINES_DIR STOCKFISH_ROOTDIR STOCKFISH_ENGINES_SUBDIR
+#define STOCKFISH_LOCK_FILENAME ".cache/stockfish.lock"
+#define EVAL_STORE_FILENAME ".cache/evals.bin"
+// Threads per engine found by the last calibration
+#define ENGINE_LAYOUT_FILENAME ".cache/layout"
 // TODO: Support Windows and MacOS as well (once cross-platform compilation is
 // implemented)
-#define STOCKFISH_TAR_URL                                                      \
-  "https://github.com/official-stockfish/Stockfish/releases/download/sf_17.1/" \
-  "stockfish-ubuntu-x86-64.tar"
+// The builds themselves are listed in download.c
+#define STOCKFISH_RELEASE_URL                                                  \
+  "https://github.com/official-stockfish/Stockfish/releases/download/sf_17.1/"
+// Lists the SHA-256 of every tarball in the release
+#define STOCKFISH_RELEASE_API_URL                                              \
+  "https://api.github.com/repos/official-stockfish/Stockfish/releases/tags/"  \
+  "sf_17.1"
+#define STOCKFISH_RELEASE_MAX_SIZE (4 << 20) // Largest release listing read
+// The URL of the selected build can be overridden from the environment, e.g.
+// to use a mirror, and so can the selection itself. A digest given there
+// only applies to the build STOCKFISH_BUILD selects.
+#define STOCKFISH_BUILD_ENV "STOCKFISH_BUILD"
+#define STOCKFISH_TAR_URL_ENV "STOCKFISH_TAR_URL"
+#define STOCKFISH_TAR_SHA256_ENV "STOCKFISH_TAR_SHA256"
 
 #endif
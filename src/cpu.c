@@ -0,0 +1,64 @@
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+static uint64_t xgetbv(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return (uint64_t)hi << 32 | lo;
+}
+
+unsigned cpu_features(void) {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  unsigned max_leaf = eax;
+  bool amd = ebx == 0x68747541; // "Auth" of AuthenticAMD
+
+  __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+  unsigned family = eax >> 8 & 0xf;
+  if (family == 0xf) {
+    family += eax >> 20 & 0xff;
+  }
+  unsigned features = 0;
+  if (ecx & bit_POPCNT) {
+    features |= CPU_POPCNT;
+  }
+  if (ecx & bit_SSE4_1) {
+    features |= CPU_SSE41;
+  }
+
+  // The vector extensions also need the OS to save their registers
+  uint64_t xcr0 = ecx & bit_OSXSAVE ? xgetbv() : 0;
+  bool avx_state = (xcr0 & 0x6) == 0x6;     // SSE and AVX
+  bool avx512_state = (xcr0 & 0xe6) == 0xe6; // Plus opmask and ZMM
+  if (max_leaf < 7) {
+    return features;
+  }
+
+  __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+  if (avx_state && (ebx & bit_AVX2)) {
+    features |= CPU_AVX2;
+  }
+  // Zen 1 and 2 implement PEXT and PDEP in microcode, slower than AVX2 alone
+  if ((ebx & bit_BMI2) && !(amd && family < 0x19)) {
+    features |= CPU_BMI2;
+  }
+  if (avx512_state && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW)) {
+    features |= CPU_AVX512;
+    if (ecx & bit_AVX512VNNI) {
+      features |= CPU_VNNI512;
+    }
+  }
+  return features;
+}
+
+#else
+
+unsigned cpu_features(void) { return 0; }
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef CPU_H
+#define CPU_H
+
+/* Instruction set extensions the Stockfish release builds are compiled for.
+   A bit is only set when the OS also saves the registers it needs. */
+enum {
+  CPU_POPCNT = 1 << 0,
+  CPU_SSE41 = 1 << 1,
+  CPU_AVX2 = 1 << 2,
+  CPU_BMI2 = 1 << 3, // Only where PEXT/PDEP are fast, i.e. not AMD before Zen 3
+  CPU_AVX512 = 1 << 4, // AVX-512 F and BW
+  CPU_VNNI512 = 1 << 5,
+};
+
+unsigned cpu_features(void);
+
+#endif
@@ -1,10 +1,501 @@
+#define _GNU_SOURCE
 #include "download.h"
 #include "constants.h"
+#include "cpu.h"
+#include "engine.h"
+#include "json.h"
+#include "metrics.h"
+#include "sha256.h"
 #include "tar.h"
 #include "utils.h"
 #include <curl/curl.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
 
-int download_stockfish_executable() {
+#define STATE_HEADER_FORMAT "stockfish-api-download 2 %" PRIu64 " %zu\n"
+
+/* One HTTP range of the tarball. Bytes below start + done are already in the
+   file, so a retry or a later run asks only for the rest. */
+typedef struct {
+  uint64_t start;
+  uint64_t end; // Exclusive
+  uint64_t done;
+  int retries;
+  int fd;
+  CURL *easy;
+  char range[48];
+} Chunk;
+
+typedef struct {
+  const char *url;      // As configured; identifies the download in the state
+  const char *sha256;   // Expected digest; a part file for another is dropped
+  const char *location; // Where the ranges are fetched from, after redirects
+  uint64_t size;
+  size_t count;
+  Chunk chunks[DOWNLOAD_CHUNK_COUNT];
+  time_t last_save;
+} RangedDownload;
+
+#define RELEASE_BUILD(name, asset, features)                                   \
+  {name,                                                                       \
+   features,                                                                   \
+   asset ".tar",                                                               \
+   STOCKFISH_RELEASE_URL asset ".tar",                                         \
+   STOCKFISH_ROOTDIR "stockfish-" name,                                        \
+   "stockfish/" asset,                                                         \
+   STOCKFISH_ROOTDIR "stockfish-" name "/stockfish/" asset,                    \
+   "^stockfish/" asset "$"}
+
+/* Best first; the first build whose features the CPU has is used, unless it
+   fails to run. */
+// TODO: Support Windows and MacOS as well (once cross-platform compilation is
+// implemented)
+static const EngineBuild engine_builds[] = {
+    RELEASE_BUILD("vnni512", "stockfish-ubuntu-x86-64-vnni512",
+                  CPU_AVX512 | CPU_VNNI512 | CPU_BMI2),
+    RELEASE_BUILD("avx512", "stockfish-ubuntu-x86-64-avx512",
+                  CPU_AVX512 | CPU_BMI2),
+    RELEASE_BUILD("bmi2", "stockfish-ubuntu-x86-64-bmi2", CPU_AVX2 | CPU_BMI2),
+    RELEASE_BUILD("avx2", "stockfish-ubuntu-x86-64-avx2", CPU_AVX2),
+    RELEASE_BUILD("sse41-popcnt", "stockfish-ubuntu-x86-64-sse41-popcnt",
+                  CPU_SSE41 | CPU_POPCNT),
+    RELEASE_BUILD("x86-64", "stockfish-ubuntu-x86-64", 0),
+};
+
+static const char *tar_url(const EngineBuild *build) {
+  const char *url = getenv(STOCKFISH_TAR_URL_ENV);
+  return url && *url ? url : build->url;
+}
+
+/* A digest given in the environment is for one tarball, so it only counts
+   for the build STOCKFISH_BUILD picks. */
+static const char *digest_override(const EngineBuild *build) {
+  const char *forced = getenv(STOCKFISH_BUILD_ENV);
+  const char *digest = getenv(STOCKFISH_TAR_SHA256_ENV);
+  if (!forced || strcmp(forced, build->name) != 0 || !digest || !*digest) {
+    return NULL;
+  }
+  return digest;
+}
+
+typedef struct {
+  Arena *arena;
+  StringBuilder sb;
+} ResponseBody;
+
+static size_t body_write_cb(void *ptr, size_t size, size_t nmemb,
+                            void *userdata) {
+  ResponseBody *body = userdata;
+  if (body->sb.count + size * nmemb > STOCKFISH_RELEASE_MAX_SIZE) {
+    return 0;
+  }
+  arena_da_append_many(body->arena, &body->sb, (char *)ptr, size * nmemb);
+  return size * nmemb;
+}
+
+/* The SHA-256 the release lists for the build's tarball, fetched over HTTPS
+   from GitHub's API, or NULL if it cannot be had. */
+static const char *published_digest(Arena *arena, CURL *curl,
+                                    const EngineBuild *build) {
+  ResponseBody body = {.arena = arena};
+  curl_easy_reset(curl);
+  curl_easy_setopt(curl, CURLOPT_URL, STOCKFISH_RELEASE_API_URL);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "stockfish-api");
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, body_write_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+  CURLcode result = curl_easy_perform(curl);
+  curl_easy_reset(curl);
+  if (result != CURLE_OK) {
+    fprintf(stderr, "Failed to fetch the release's digests from %s: %s\n",
+            STOCKFISH_RELEASE_API_URL, curl_easy_strerror(result));
+    return NULL;
+  }
+
+  // Assets list theirs as "digest": "sha256:<hex>"
+  JsonValue *json = json_parse(arena, body.sb.items, body.sb.count);
+  const JsonValue *assets = json ? json_get(json, "assets") : NULL;
+  size_t count = assets && assets->type == JSON_ARRAY ? assets->count : 0;
+  for (size_t i = 0; i < count; i++) {
+    const JsonValue *name = json_get(&assets->items[i], "name");
+    const JsonValue *digest = json_get(&assets->items[i], "digest");
+    if (name && name->type == JSON_STRING &&
+        strcmp(name->string, build->asset) == 0 && digest &&
+        digest->type == JSON_STRING &&
+        strncmp(digest->string, "sha256:", 7) == 0 &&
+        strlen(digest->string + 7) == SHA256_HEX_SIZE - 1) {
+      return digest->string + 7;
+    }
+  }
+  fprintf(stderr, "The release lists no SHA-256 for %s\n", build->asset);
+  return NULL;
+}
+
+static bool digest_matches(const char *expected, const char *actual) {
+  if (strcasecmp(actual, expected) != 0) {
+    fprintf(stderr, "Tarball checksum mismatch: expected %s, got %s\n",
+            expected, actual);
+    return false;
+  }
+  return true;
+}
+
+typedef struct {
+  TarStream tar;
+  Sha256 sha;
+} StreamTarget;
+
+/* Feeds downloaded bytes straight into the tar reader; returning less than
+   was handed in makes curl abort the transfer. */
+static size_t tar_write_cb(void *ptr, size_t size, size_t nmemb,
+                           void *userdata) {
+  StreamTarget *target = userdata;
+  sha256_update(&target->sha, ptr, size * nmemb);
+  return tar_stream_feed(&target->tar, ptr, size * nmemb) ? size * nmemb : 0;
+}
+
+/* Downloads the tarball in a single request and extracts the engine from it
+   while the transfer is still running. Used when the server cannot serve
+   ranges; the checksum is only known once the engine is already extracted,
+   so on a mismatch the caller throws the directory away. */
+static int stream_download(Arena *arena, CURL *curl, const EngineBuild *build,
+                           const char *url, const char *expected,
+                           const char *rootdir, char digest[SHA256_HEX_SIZE]) {
+  StreamTarget target;
+  if (tar_stream_init(&target.tar, arena, rootdir, build->exec_pattern) != 0) {
+    return -1;
+  }
+  sha256_init(&target.sha);
+
+  curl_easy_reset(curl);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, tar_write_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target);
+
+  CURLcode result = curl_easy_perform(curl);
+  if (result != CURLE_OK) {
+    fprintf(stderr, "Failed to download %s: %s\n", url,
+            curl_easy_strerror(result));
+  }
+
+  int rc = tar_stream_finish(&target.tar) == 0 && result == CURLE_OK ? 0 : -1;
+  sha256_final(&target.sha, digest);
+  return rc == 0 && digest_matches(expected, digest) ? 0 : -1;
+}
+
+static size_t probe_header_cb(char *buffer, size_t size, size_t nitems,
+                              void *userdata) {
+  static const char name[] = "accept-ranges:";
+  bool *ranges = userdata;
+  size_t len = size * nitems;
+  if (len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    *ranges = false; // A new response, after a redirect
+  } else if (len > sizeof(name) - 1 &&
+             strncasecmp(buffer, name, sizeof(name) - 1) == 0 &&
+             memmem(buffer, len, "bytes", 5)) {
+    *ranges = true;
+  }
+  return len;
+}
+
+/* Asks for the tarball's size and final location. Returns 1 when the server
+   does not take range requests for it. */
+static int probe(Arena *arena, CURL *curl, RangedDownload *dl) {
+  bool ranges = false;
+  curl_easy_setopt(curl, CURLOPT_URL, dl->url);
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, probe_header_cb);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &ranges);
+
+  CURLcode result = curl_easy_perform(curl);
+  if (result != CURLE_OK) {
+    fprintf(stderr, "Failed to download %s: %s\n", dl->url,
+            curl_easy_strerror(result));
+    return -1;
+  }
+
+  curl_off_t length = -1;
+  char *location = NULL;
+  if (curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) !=
+          CURLE_OK ||
+      curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &location) != CURLE_OK ||
+      !ranges || length <= 0 || !location) {
+    return 1;
+  }
+  dl->size = length;
+  dl->location = arena_sprintf(arena, "%s", location);
+  return 0;
+}
+
+static void split_chunks(RangedDownload *dl) {
+  size_t count = dl->size / DOWNLOAD_MIN_CHUNK_SIZE;
+  count = count < 1 ? 1 : count;
+  count = count > DOWNLOAD_CHUNK_COUNT ? DOWNLOAD_CHUNK_COUNT : count;
+  dl->count = count;
+  for (size_t i = 0; i < count; i++) {
+    dl->chunks[i].start = dl->size * i / count;
+    dl->chunks[i].end = dl->size * (i + 1) / count;
+    dl->chunks[i].done = 0;
+  }
+}
+
+/* Restores the chunk progress of an interrupted download of the same
+   tarball, if there is one. */
+static bool load_state(RangedDownload *dl) {
+  FILE *file = fopen(STOCKFISH_TAR_STATE_FILENAME, "r");
+  if (!file) {
+    return false;
+  }
+  uint64_t size;
+  size_t count;
+  char url[PATH_MAX] = "", sha256[SHA256_HEX_SIZE + 1] = "";
+  bool ok = fscanf(file, "stockfish-api-download 2 %" SCNu64 " %zu\n", &size,
+                   &count) == 2 &&
+            fgets(url, sizeof(url), file) != NULL &&
+            fgets(sha256, sizeof(sha256), file) != NULL && size == dl->size &&
+            count >= 1 && count <= DOWNLOAD_CHUNK_COUNT;
+  url[strcspn(url, "\n")] = '\0';
+  sha256[strcspn(sha256, "\n")] = '\0';
+  ok = ok && strcmp(url, dl->url) == 0 && strcasecmp(sha256, dl->sha256) == 0;
+  for (size_t i = 0; ok && i < count; i++) {
+    Chunk *chunk = &dl->chunks[i];
+    ok = fscanf(file, "%" SCNu64 " %" SCNu64 " %" SCNu64 "\n", &chunk->start,
+                &chunk->end, &chunk->done) == 3 &&
+         chunk->start <= chunk->end && chunk->end <= size &&
+         chunk->done <= chunk->end - chunk->start;
+  }
+  fclose(file);
+  dl->count = count;
+  return ok;
+}
+
+static void save_state(RangedDownload *dl) {
+  dl->last_save = time(NULL);
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", STOCKFISH_TAR_STATE_FILENAME);
+  FILE *file = fopen(tmp_path, "w");
+  if (!file) {
+    fprintf(stderr, "Failed to save download state: %s\n", strerror(errno));
+    return;
+  }
+  fprintf(file, STATE_HEADER_FORMAT "%s\n%s\n", dl->size, dl->count, dl->url,
+          dl->sha256);
+  for (size_t i = 0; i < dl->count; i++) {
+    Chunk *chunk = &dl->chunks[i];
+    fprintf(file, "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n", chunk->start,
+            chunk->end, chunk->done);
+  }
+  if (fclose(file) != 0 || rename(tmp_path, STOCKFISH_TAR_STATE_FILENAME) != 0) {
+    fprintf(stderr, "Failed to save download state: %s\n", strerror(errno));
+  }
+}
+
+/* Writes a chunk's bytes at their place in the file. A server that ignores
+   the range and sends more than asked for fails the chunk. */
+static size_t chunk_write_cb(void *ptr, size_t size, size_t nmemb,
+                             void *userdata) {
+  Chunk *chunk = userdata;
+  size_t len = size * nmemb;
+  if (len > chunk->end - chunk->start - chunk->done) {
+    return 0;
+  }
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = pwrite(chunk->fd, (char *)ptr + written, len - written,
+                       chunk->start + chunk->done);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Failed to write downloaded data: %s\n",
+              strerror(errno));
+      return 0;
+    }
+    written += n;
+    chunk->done += n;
+  }
+  return len;
+}
+
+static bool start_chunk(RangedDownload *dl, CURLM *multi, Chunk *chunk) {
+  chunk->easy = curl_easy_init();
+  if (!chunk->easy) {
+    return false;
+  }
+  snprintf(chunk->range, sizeof(chunk->range), "%" PRIu64 "-%" PRIu64,
+           chunk->start + chunk->done, chunk->end - 1);
+  curl_easy_setopt(chunk->easy, CURLOPT_URL, dl->location);
+  curl_easy_setopt(chunk->easy, CURLOPT_RANGE, chunk->range);
+  curl_easy_setopt(chunk->easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(chunk->easy, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(chunk->easy, CURLOPT_WRITEFUNCTION, chunk_write_cb);
+  curl_easy_setopt(chunk->easy, CURLOPT_WRITEDATA, chunk);
+  curl_easy_setopt(chunk->easy, CURLOPT_PRIVATE, chunk);
+  return curl_multi_add_handle(multi, chunk->easy) == CURLM_OK;
+}
+
+static void stop_chunk(CURLM *multi, Chunk *chunk) {
+  if (chunk->easy) {
+    curl_multi_remove_handle(multi, chunk->easy);
+    curl_easy_cleanup(chunk->easy);
+    chunk->easy = NULL;
+  }
+}
+
+/* Fetches every unfinished chunk concurrently. A chunk that fails is asked
+   again for whatever it is still missing, a few times, before giving up. */
+static bool fetch_chunks(RangedDownload *dl, int fd) {
+  CURLM *multi = curl_multi_init();
+  if (!multi) {
+    return false;
+  }
+
+  bool ok = true;
+  int running = 0;
+  for (size_t i = 0; ok && i < dl->count; i++) {
+    Chunk *chunk = &dl->chunks[i];
+    chunk->fd = fd;
+    chunk->retries = 0;
+    chunk->easy = NULL;
+    if (chunk->done < chunk->end - chunk->start) {
+      ok = start_chunk(dl, multi, chunk);
+      running++;
+    }
+  }
+
+  while (ok && running > 0) {
+    int still_running;
+    if (curl_multi_perform(multi, &still_running) != CURLM_OK ||
+        curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+      ok = false;
+      break;
+    }
+
+    CURLMsg *msg;
+    int queued;
+    while (ok && (msg = curl_multi_info_read(multi, &queued))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      Chunk *chunk;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&chunk);
+      CURLcode result = msg->data.result;
+      stop_chunk(multi, chunk);
+
+      bool complete = chunk->done == chunk->end - chunk->start;
+      if (result == CURLE_OK && complete) {
+        running--;
+      } else if (chunk->retries++ < DOWNLOAD_MAX_RETRIES) {
+        fprintf(stderr, "Retrying bytes %" PRIu64 "-%" PRIu64 ": %s\n",
+                chunk->start + chunk->done, chunk->end - 1,
+                result == CURLE_OK ? "short response"
+                                   : curl_easy_strerror(result));
+        ok = start_chunk(dl, multi, chunk);
+      } else {
+        fprintf(stderr, "Failed to download %s: %s\n", dl->url,
+                curl_easy_strerror(result));
+        ok = false;
+      }
+    }
+
+    if (time(NULL) != dl->last_save) {
+      save_state(dl);
+    }
+  }
+
+  for (size_t i = 0; i < dl->count; i++) {
+    stop_chunk(multi, &dl->chunks[i]);
+  }
+  curl_multi_cleanup(multi);
+  save_state(dl);
+  return ok;
+}
+
+/* Downloads the tarball as concurrent range requests into a preallocated
+   file and extracts it once its checksum is verified. Returns 1 when the
+   server does not support ranges. */
+static int ranged_download(Arena *arena, CURL *curl, const EngineBuild *build,
+                           const char *url, const char *expected,
+                           const char *rootdir, char digest[SHA256_HEX_SIZE]) {
+  RangedDownload dl = {.url = url, .sha256 = expected};
+  int rc = probe(arena, curl, &dl);
+  if (rc != 0) {
+    return rc;
+  }
+
+  bool resumed = load_state(&dl) &&
+                 check_file_accessible(STOCKFISH_TAR_PART_FILENAME);
+  if (!resumed) {
+    split_chunks(&dl);
+  }
+
+  int fd = open(STOCKFISH_TAR_PART_FILENAME,
+                O_RDWR | O_CREAT | (resumed ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create %s: %s\n", STOCKFISH_TAR_PART_FILENAME,
+            strerror(errno));
+    return -1;
+  }
+  // Reserve the space up front so the chunks do not fragment the file and a
+  // full disk fails now rather than halfway
+  rc = posix_fallocate(fd, 0, dl.size);
+  if (rc != 0 && (rc != EOPNOTSUPP || ftruncate(fd, dl.size) != 0)) {
+    fprintf(stderr, "Failed to allocate %" PRIu64 " bytes for %s: %s\n",
+            dl.size, STOCKFISH_TAR_PART_FILENAME, strerror(rc));
+    close(fd);
+    return -1;
+  }
+
+  if (resumed) {
+    uint64_t have = 0;
+    for (size_t i = 0; i < dl.count; i++) {
+      have += dl.chunks[i].done;
+    }
+    printf("Resuming download at %" PRIu64 " of %" PRIu64 " bytes...\n", have,
+           dl.size);
+  }
+
+  bool ok = fetch_chunks(&dl, fd);
+  if (close(fd) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    return -1;
+  }
+
+  if (sha256_file(STOCKFISH_TAR_PART_FILENAME, digest) != 0) {
+    return -1;
+  }
+  unlink(STOCKFISH_TAR_STATE_FILENAME);
+  rc = -1;
+  if (digest_matches(expected, digest)) {
+    uint64_t start_us = metrics_now_us();
+    rc = extract_tar(arena, STOCKFISH_TAR_PART_FILENAME, rootdir,
+                     build->exec_pattern);
+    metrics_record(METRIC_EXTRACT, metrics_now_us() - start_us);
+  }
+  unlink(STOCKFISH_TAR_PART_FILENAME);
+  return rc;
+}
+
+/* Fetches the build's release tarball and extracts the engine into rootdir,
+   leaving the tarball's SHA-256 in digest. */
+int download_stockfish_executable(Arena *arena, const EngineBuild *build,
+                                  const char *rootdir,
+                                  char digest[SHA256_HEX_SIZE]) {
   CURLcode result;
   CURL *curl;
 
@@ -21,68 +512,209 @@ int download_stockfish_executable() {
     return CURLE_FAILED_INIT;
   }
 
-  FILE *stockfish_tar;
-
-  curl_easy_setopt(curl, CURLOPT_URL, STOCKFISH_TAR_URL);
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-
-  if (ensure_directory_exists(".cache") != 0) {
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
-    return -1;
+  // Nothing is fetched without a digest to check it against
+  const char *expected = digest_override(build);
+  expected = expected ? expected : published_digest(arena, curl, build);
+  const char *url = tar_url(build);
+  int rc = -1;
+  if (expected) {
+    rc = ranged_download(arena, curl, build, url, expected, rootdir, digest);
   }
-
-  stockfish_tar = fopen(STOCKFISH_TAR_FILENAME, "wb");
-  if (stockfish_tar) {
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, stockfish_tar);
-
-    result = curl_easy_perform(curl);
-
-    fclose(stockfish_tar);
+  if (rc == 1) {
+    printf("Server does not support ranged downloads; streaming instead\n");
+    rc = stream_download(arena, curl, build, url, expected, rootdir, digest);
   }
 
   curl_easy_cleanup(curl);
 
   curl_global_cleanup();
 
-  return (int)result;
+  return rc;
 }
 
-int get_stockfish(Arena *arena) {
-  printf("Setting up stockfish...\n");
+/* Runs a short bench. A binary using instructions this machine lacks dies
+   with SIGILL, closing its output before the readyok queued behind it. */
+static bool passes_bench(const char *path) {
+  Engine engine;
+  if (engine_spawn(&engine, path, NULL, true) != 0) {
+    return false;
+  }
+  bool ok = engine_send(&engine, "uci") == 0 &&
+            engine_wait_for(&engine, "uciok") == 0 &&
+            engine_send(&engine, "bench 16 1 1 default depth") == 0 &&
+            engine_send(&engine, "isready") == 0 &&
+            engine_wait_for(&engine, "readyok") == 0;
+  engine_close(&engine);
+  return ok;
+}
+
+/* Removes extraction directories left behind by processes that died while
+   installing. Only called with the install lock held. */
+static void remove_stale_extractions(void) {
+  DIR *dir = opendir(STOCKFISH_ENGINES_DIR);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, ".tmp-", 5) == 0) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s%s", STOCKFISH_ENGINES_DIR,
+               entry->d_name);
+      remove_directory(path);
+    }
+  }
+  closedir(dir);
+}
 
-  if (!check_file_accessible(STOCKFISH_EXEC_PATH)) {
-    if (!check_file_accessible(STOCKFISH_TAR_FILENAME)) {
-      printf("Downloading stockfish...\n");
+/* Points the build's link at its content directory, replacing whatever it
+   pointed at before in one step. */
+static int publish(const EngineBuild *build, const char *digest) {
+  char target[PATH_MAX], tmp_link[PATH_MAX];
+  snprintf(target, sizeof(target), "%s%s", STOCKFISH_ENGINES_SUBDIR, digest);
+  snprintf(tmp_link, sizeof(tmp_link), "%s.tmp", build->link_path);
+  unlink(tmp_link);
+  if (symlink(target, tmp_link) != 0 ||
+      rename(tmp_link, build->link_path) != 0) {
+    fprintf(stderr, "Failed to link %s: %s\n", build->link_path,
+            strerror(errno));
+    unlink(tmp_link);
+    return -1;
+  }
+  return 0;
+}
 
-      int download_rc = download_stockfish_executable();
+/* Downloads, extracts and checks the build in a private directory, then
+   moves it under its tarball's digest. Only called with the install lock
+   held, so nobody else is extracting. */
+static int install_locked(Arena *arena, const EngineBuild *build) {
+  remove_stale_extractions();
 
-      if (download_rc != CURLE_OK) {
-        return -1;
-      }
+  char tmp_dir[256], rootdir[sizeof(tmp_dir) + 1], exec_path[PATH_MAX];
+  snprintf(tmp_dir, sizeof(tmp_dir), "%s.tmp-XXXXXX", STOCKFISH_ENGINES_DIR);
+  if (!mkdtemp(tmp_dir)) {
+    fprintf(stderr, "Failed to create a directory in %s: %s\n",
+            STOCKFISH_ENGINES_DIR, strerror(errno));
+    return -1;
+  }
+  snprintf(rootdir, sizeof(rootdir), "%s/", tmp_dir);
+  snprintf(exec_path, sizeof(exec_path), "%s%s", rootdir, build->exec_name);
 
-      printf("Stockfish has been downloaded.\n");
-    }
+  printf("Downloading the %s build of stockfish...\n", build->name);
+  char digest[SHA256_HEX_SIZE];
+  uint64_t start_us = metrics_now_us();
+  int rc = download_stockfish_executable(arena, build, rootdir, digest);
+  metrics_record(METRIC_DOWNLOAD, metrics_now_us() - start_us);
+  if (rc != 0 || !check_file_accessible(exec_path)) {
+    fprintf(stderr, "Failed extracting stockfish to %s\n", exec_path);
+    remove_directory(tmp_dir);
+    return -1;
+  }
+  if (make_file_executable(exec_path) == -1) {
+    fprintf(stderr,
+            "Failed setting executable permissions to stockfish engine at %s\n",
+            exec_path);
+    remove_directory(tmp_dir);
+    return -1;
+  }
+  if (!passes_bench(exec_path)) {
+    fprintf(stderr, "The %s build of stockfish failed its bench check\n",
+            build->name);
+    remove_directory(tmp_dir);
+    char failed_path[PATH_MAX];
+    snprintf(failed_path, sizeof(failed_path), "%s.failed", build->link_path);
+    ensure_file_exists(failed_path);
+    return -1;
+  }
 
-    const char *rootdir = ".cache/";
-    if (extract_tar(arena, STOCKFISH_TAR_FILENAME, rootdir,
-                    STOCKFISH_EXEC_REGEX_PATTERN) != 0) {
-      arena_free(arena);
-      fprintf(stderr, "Failed extracting stockfish tarball at %s\n",
-              STOCKFISH_TAR_FILENAME);
+  char content_dir[PATH_MAX];
+  snprintf(content_dir, sizeof(content_dir), "%s%s", STOCKFISH_ENGINES_DIR,
+           digest);
+  if (rename(tmp_dir, content_dir) != 0) {
+    if (errno != EEXIST && errno != ENOTEMPTY) {
+      fprintf(stderr, "Failed to move %s into place: %s\n", tmp_dir,
+              strerror(errno));
+      remove_directory(tmp_dir);
       return -1;
     }
-    arena_free(arena);
+    // Same tarball as another build's; its directory is just as good
+    remove_directory(tmp_dir);
   }
+  return publish(build, digest);
+}
 
-  if (make_file_executable(STOCKFISH_EXEC_PATH) == -1) {
-    fprintf(stderr,
-            "Failed setting executable permissions to stockfish engine at %s\n",
-            STOCKFISH_EXEC_PATH);
+/* Builds that did not run here are not fetched again, unless asked for. */
+static bool failed_here(const EngineBuild *build) {
+  char failed_path[PATH_MAX];
+  snprintf(failed_path, sizeof(failed_path), "%s.failed", build->link_path);
+  return check_file_accessible(failed_path);
+}
+
+/* Installs the build. Concurrent cold starts queue on a lock file, so the
+   first one installs and the rest find its result once they get the lock. */
+static int install(Arena *arena, const EngineBuild *build, bool forced) {
+  if (ensure_directory_exists(STOCKFISH_ROOTDIR) != 0 ||
+      ensure_directory_exists(STOCKFISH_ENGINES_DIR) != 0) {
     return -1;
   }
 
-  return 0;
+  int lock_fd = open(STOCKFISH_LOCK_FILENAME, O_RDWR | O_CREAT | O_CLOEXEC,
+                     0644);
+  if (lock_fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", STOCKFISH_LOCK_FILENAME,
+            strerror(errno));
+    return -1;
+  }
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    printf("Waiting for another process to install stockfish...\n");
+    while (flock(lock_fd, LOCK_EX) != 0 && errno == EINTR) {
+    }
+  }
+
+  int rc = 0;
+  if (!forced && failed_here(build)) {
+    rc = -1;
+  } else if (!check_file_accessible(build->exec_path)) {
+    rc = install_locked(arena, build);
+    arena_free(arena);
+    if (rc == 0) {
+      printf("Stockfish is ready at %s\n", build->exec_path);
+    }
+  }
+  close(lock_fd);
+  return rc;
+}
+
+/* Installs the fastest build this CPU supports, falling back to slower ones
+   when a build cannot be fetched or does not run. */
+int get_stockfish(Arena *arena, const char **exec_path) {
+  printf("Setting up stockfish...\n");
+
+  unsigned features = cpu_features();
+  const char *forced = getenv(STOCKFISH_BUILD_ENV);
+  forced = forced && *forced ? forced : NULL;
+  const char *digest = getenv(STOCKFISH_TAR_SHA256_ENV);
+  if (digest && *digest && !forced) {
+    fprintf(stderr, "Ignoring %s, which needs %s to name its build\n",
+            STOCKFISH_TAR_SHA256_ENV, STOCKFISH_BUILD_ENV);
+  }
+  size_t count = sizeof(engine_builds) / sizeof(engine_builds[0]);
+  for (size_t i = 0; i < count; i++) {
+    const EngineBuild *build = &engine_builds[i];
+    if (forced ? strcmp(build->name, forced) != 0
+                          : (build->features & ~features) != 0) {
+      continue;
+    }
+    // An installed build costs a single stat; it was benched when installed
+    if (!check_file_accessible(build->exec_path) &&
+        ((!forced && failed_here(build)) || install(arena, build, forced) != 0)) {
+      continue;
+    }
+    printf("Using the %s build of stockfish\n", build->name);
+    *exec_path = build->exec_path;
+    return 0;
+  }
+
+  fprintf(stderr, "No build of stockfish works on this machine\n");
+  return -1;
 }
@@ -1,9 +1,28 @@
 #ifndef DOWNLOAD_H
 #define DOWNLOAD_H
 
+#include "sha256.h"
 #include "tar.h"
 
-int download_stockfish_executable();
-int get_stockfish(Arena *arena);
+#define DOWNLOAD_CHUNK_COUNT 4
+#define DOWNLOAD_MIN_CHUNK_SIZE (4 << 20) // Smaller tarballs use fewer chunks
+#define DOWNLOAD_MAX_RETRIES 5            // Per chunk and run
+
+/* A release build of the engine and the CPU features it needs. */
+typedef struct {
+  const char *name;
+  unsigned features; // CPU_* bits
+  const char *asset; // Tarball's name in the release
+  const char *url;
+  const char *link_path; // Symlink to the installed content directory
+  const char *exec_name; // Binary's path inside the tarball
+  const char *exec_path; // The same, through link_path
+  const char *exec_pattern; // Selects the binary inside the tarball
+} EngineBuild;
+
+int download_stockfish_executable(Arena *arena, const EngineBuild *build,
+                                  const char *rootdir,
+                                  char digest[SHA256_HEX_SIZE]);
+int get_stockfish(Arena *arena, const char **exec_path);
 
 #endif
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include "engine.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Starts the engine with its threads confined to `cpus`, if given. A quiet
+   engine's stderr goes to /dev/null. */
+int engine_spawn(Engine *engine, const char *path, const CpuSet *cpus,
+                 bool quiet) {
+  if (linebuf_init(&engine->output, LINEBUF_DEFAULT_CAPACITY) != 0) {
+    return -1;
+  }
+
+  // Close-on-exec, so no engine inherits the pipes of the others
+  int stdin_pipe[2]; // Parent writes to [1], child reads from [0]
+  if (pipe2(stdin_pipe, O_CLOEXEC) == -1) {
+    fprintf(stderr, "Failed creating input pipe\n");
+    linebuf_free(&engine->output);
+    return -1;
+  }
+
+  int stdout_pipe[2]; // Child writes to [1], parent reads from [0]
+  if (pipe2(stdout_pipe, O_CLOEXEC) == -1) {
+    fprintf(stderr, "Failed creating output pipe\n");
+    close(stdin_pipe[0]);
+    close(stdin_pipe[1]);
+    linebuf_free(&engine->output);
+    return -1;
+  }
+
+  // The child only gets its ends of the pipes as stdin and stdout; every
+  // other descriptor is close-on-exec. Unlike fork(), posix_spawn() does not
+  // copy the page tables of a server that may have a large cache mapped.
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, stdin_pipe[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], STDOUT_FILENO);
+  if (quiet) {
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+  }
+
+  // The server ignores SIGPIPE; the engine should not inherit that
+  sigset_t mask, defaults;
+  sigemptyset(&mask);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                      POSIX_SPAWN_SETSIGDEF);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+
+  // The child inherits the affinity of the thread spawning it, and every
+  // thread the engine starts inherits it in turn
+  cpu_set_t saved, wanted;
+  bool pinned = false;
+  if (cpus) {
+    CPU_ZERO(&wanted);
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (cpuset_has(cpus, cpu)) {
+        CPU_SET(cpu, &wanted);
+      }
+    }
+    pinned = pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) ==
+                 0 &&
+             pthread_setaffinity_np(pthread_self(), sizeof(wanted),
+                                    &wanted) == 0;
+  }
+
+  pid_t pid;
+  char *stockfish_argv[] = {(char *)path, NULL};
+  int rc = posix_spawn(&pid, path, &actions, &attr, stockfish_argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (pinned) {
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+  }
+  if (rc != 0) {
+    fprintf(stderr, "Failed to start engine %s: %s\n", path, strerror(rc));
+    close(stdin_pipe[0]);
+    close(stdin_pipe[1]);
+    close(stdout_pipe[0]);
+    close(stdout_pipe[1]);
+    linebuf_free(&engine->output);
+    return -1;
+  }
+
+  // Close unused pipe ends
+  close(stdin_pipe[0]);
+  close(stdout_pipe[1]);
+
+  engine->pid = pid;
+  engine->stdin_fd = stdin_pipe[1];
+  engine->stdout_fd = stdout_pipe[0];
+  engine->multipv = 1;
+  engine->hash_mb = 0;
+  engine->queued = NULL;
+  engine->queued_len = 0;
+  engine->queued_cap = 0;
+  engine->uci_sent_us = 0;
+  engine->isready_sent_us = 0;
+  engine->go_sent_us = 0;
+
+  return 0;
+}
+
+/* Appends a command to the ones waiting to be written, so several commands
+   go out in a single write. */
+int engine_queue(Engine *engine, const char *command) {
+  size_t len = strlen(command);
+  if (engine->queued_len + len + 1 > engine->queued_cap) {
+    size_t cap = engine->queued_cap ? engine->queued_cap : 256;
+    while (cap < engine->queued_len + len + 1) {
+      cap *= 2;
+    }
+    char *queued = realloc(engine->queued, cap);
+    if (!queued) {
+      fprintf(stderr, "Failed to queue '%s' for engine %d\n", command,
+              (int)engine->pid);
+      return -1;
+    }
+    engine->queued = queued;
+    engine->queued_cap = cap;
+  }
+  memcpy(engine->queued + engine->queued_len, command, len);
+  engine->queued[engine->queued_len + len] = '\n';
+  engine->queued_len += len + 1;
+
+  // Round trips are timed from here, as commands go out with the next flush
+  if (strcmp(command, "uci") == 0) {
+    engine->uci_sent_us = metrics_now_us();
+  } else if (strcmp(command, "isready") == 0) {
+    engine->isready_sent_us = metrics_now_us();
+  } else if (strncmp(command, "go", 2) == 0 &&
+             (command[2] == ' ' || command[2] == '\0')) {
+    engine->go_sent_us = metrics_now_us();
+  }
+  return 0;
+}
+
+/* Writes the queued commands. On a non-blocking pipe this stops when the
+   pipe is full and returns 1; the rest goes out on a later call. */
+int engine_flush(Engine *engine) {
+  size_t sent = 0;
+  int rc = 0;
+  while (sent < engine->queued_len) {
+    ssize_t n = write(engine->stdin_fd, engine->queued + sent,
+                      engine->queued_len - sent);
+    if (n >= 0) {
+      sent += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      rc = 1;
+      break;
+    } else if (errno != EINTR) {
+      fprintf(stderr, "Failed to write to engine %d: %s\n", (int)engine->pid,
+              strerror(errno));
+      rc = -1;
+      break;
+    }
+  }
+  memmove(engine->queued, engine->queued + sent, engine->queued_len - sent);
+  engine->queued_len -= sent;
+  return rc;
+}
+
+int engine_send(Engine *engine, const char *command) {
+  if (engine_queue(engine, command) != 0 || engine_flush(engine) == -1) {
+    fprintf(stderr, "Failed to send '%s' to engine %d\n", command,
+            (int)engine->pid);
+    return -1;
+  }
+  return 0;
+}
+
+/* Blocks until the engine has produced a complete line. The view points into
+   the engine's line buffer and is only valid until the next read. */
+int engine_read_line(Engine *engine, StrView *line) {
+  while (!linebuf_next(&engine->output, line)) {
+    ssize_t n = linebuf_fill(&engine->output, engine->stdout_fd);
+    if (n == 0) {
+      return -1;
+    }
+    if (n < 0 && errno != EINTR) {
+      fprintf(stderr, "Failed reading from engine %d: %s\n", (int)engine->pid,
+              strerror(errno));
+      return -1;
+    }
+  }
+  engine_observe(engine, *line);
+  return 0;
+}
+
+/* Ends the round trip a reply line answers and records how long it took.
+   Everything that reads engine output passes each line through here. */
+void engine_observe(Engine *engine, StrView line) {
+  uint64_t *sent_us = NULL;
+  MetricHistogram histogram;
+  if (sv_starts_with(line, "uciok")) {
+    sent_us = &engine->uci_sent_us;
+    histogram = METRIC_UCI_HANDSHAKE;
+  } else if (sv_starts_with(line, "readyok")) {
+    sent_us = &engine->isready_sent_us;
+    histogram = METRIC_ISREADY;
+  } else if (sv_starts_with(line, "bestmove")) {
+    sent_us = &engine->go_sent_us;
+    histogram = METRIC_SEARCH;
+    if (engine->search.nps > 0) {
+      metrics_record(METRIC_ENGINE_NPS, engine->search.nps);
+    }
+  }
+  if (sent_us && *sent_us) {
+    metrics_record(histogram, metrics_now_us() - *sent_us);
+    *sent_us = 0;
+  }
+}
+
+int engine_wait_for(Engine *engine, const char *exit_needle) {
+  StrView line;
+  while (engine_read_line(engine, &line) == 0) {
+    if (sv_starts_with(line, exit_needle)) {
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "Engine %d closed its output before sending %s\n",
+          (int)engine->pid, exit_needle);
+  return -1;
+}
+
+/* Queues the commands for a search, leaving it to an event loop to flush
+   them along with whatever else it has for this engine. */
+int engine_queue_search(Engine *engine, const char *position_command,
+                        const char *go_command, uint16_t multipv) {
+  search_collector_reset(&engine->search);
+
+  if (engine->multipv != multipv) {
+    char command[64];
+    snprintf(command, sizeof(command), "setoption name MultiPV value %u",
+             multipv);
+    if (engine_queue(engine, command) != 0) {
+      return -1;
+    }
+    engine->multipv = multipv;
+  }
+
+  if (engine_queue(engine, position_command) != 0 ||
+      engine_queue(engine, go_command) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Sends the position and go commands without waiting for any output. */
+int engine_start_search(Engine *engine, const char *position_command,
+                        const char *go_command, uint16_t multipv) {
+  if (engine_queue_search(engine, position_command, go_command, multipv) !=
+          0 ||
+      engine_flush(engine) == -1) {
+    fprintf(stderr, "Failed to start a search on engine %d\n",
+            (int)engine->pid);
+    return -1;
+  }
+  return 0;
+}
+
+/* Runs a search to completion and packs every info line that was still
+   current when bestmove arrived into a single arena allocation. */
+SearchResult *engine_search(Engine *engine, const char *position_command,
+                            const char *go_command, uint16_t multipv,
+                            Arena *arena) {
+  if (engine_start_search(engine, position_command, go_command, multipv) !=
+      0) {
+    return NULL;
+  }
+
+  StrView line;
+  while (engine_read_line(engine, &line) == 0) {
+    if (search_collector_feed(&engine->search, line)) {
+      return search_collector_finish(&engine->search, arena);
+    }
+  }
+
+  fprintf(stderr, "Engine %d closed its output during a search\n",
+          (int)engine->pid);
+  return NULL;
+}
+
+int engine_queue_option(Engine *engine, const EngineOption *option) {
+  char command[512];
+  snprintf(command, sizeof(command), "setoption name %s value %s",
+           option->name, option->value);
+  if (engine_queue(engine, command) != 0) {
+    return -1;
+  }
+
+  if (strcasecmp(option->name, "MultiPV") == 0) {
+    engine->multipv = (uint16_t)atoi(option->value);
+  } else if (strcasecmp(option->name, "Hash") == 0) {
+    engine->hash_mb = (size_t)atol(option->value);
+  }
+  return 0;
+}
+
+int engine_set_option(Engine *engine, const EngineOption *option) {
+  if (engine_queue_option(engine, option) != 0 || engine_flush(engine) == -1) {
+    fprintf(stderr, "Failed to set option %s on engine %d\n", option->name,
+            (int)engine->pid);
+    return -1;
+  }
+  return 0;
+}
+
+/* Tells the engine to quit and lets go of it without waiting for it to
+   exit. Returns its pid, which the caller has to reap, or 0. */
+pid_t engine_quit(Engine *engine) {
+  pid_t pid = engine->pid;
+  if (pid <= 0) {
+    return 0;
+  }
+
+  engine_send(engine, "quit");
+
+  close(engine->stdin_fd);
+  close(engine->stdout_fd);
+
+  linebuf_free(&engine->output);
+  free(engine->queued);
+  engine->queued = NULL;
+  engine->pid = 0;
+  return pid;
+}
+
+void engine_close(Engine *engine) {
+  pid_t pid = engine_quit(engine);
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "arena.h"
+#include "layout.h"
+#include "linebuf.h"
+#include "uci.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct {
+  pid_t pid;
+  int stdin_fd;  // Parent writes commands to the engine here
+  int stdout_fd; // Parent reads the engine output from here
+  LineBuffer output;
+  char *queued; // Commands not yet written to stdin_fd
+  size_t queued_len;
+  size_t queued_cap;
+  SearchCollector search;
+  uint16_t multipv; // MultiPV value the engine is currently configured with
+  size_t hash_mb;   // Hash value last sent to the engine, 0 if never sent
+  uint64_t uci_sent_us; // When the round trips under way started, 0 if none
+  uint64_t isready_sent_us;
+  uint64_t go_sent_us;
+} Engine;
+
+typedef struct {
+  const char *name;
+  const char *value;
+} EngineOption;
+
+int engine_spawn(Engine *engine, const char *path, const CpuSet *cpus,
+                 bool quiet);
+int engine_queue(Engine *engine, const char *command);
+int engine_flush(Engine *engine);
+int engine_send(Engine *engine, const char *command);
+int engine_read_line(Engine *engine, StrView *line);
+void engine_observe(Engine *engine, StrView line);
+int engine_wait_for(Engine *engine, const char *exit_needle);
+int engine_queue_search(Engine *engine, const char *position_command,
+                        const char *go_command, uint16_t multipv);
+int engine_start_search(Engine *engine, const char *position_command,
+                        const char *go_command, uint16_t multipv);
+SearchResult *engine_search(Engine *engine, const char *position_command,
+                            const char *go_command, uint16_t multipv,
+                            Arena *arena);
+int engine_queue_option(Engine *engine, const EngineOption *option);
+int engine_set_option(Engine *engine, const EngineOption *option);
+pid_t engine_quit(Engine *engine);
+void engine_close(Engine *engine);
+
+#endif
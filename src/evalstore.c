@@ -0,0 +1,259 @@
+#include "evalstore.h"
+#include "analysis.h"
+#include "arena.h"
+#include "uci.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(EvalStoreHeader) == 64, "header must fill one line");
+_Static_assert(sizeof(EvalRecord) == 64, "records must fill one line");
+
+static bool header_valid(const EvalStoreHeader *header, size_t file_size) {
+  if (memcmp(header->magic, EVALSTORE_MAGIC, sizeof(EVALSTORE_MAGIC)) != 0 ||
+      header->version != EVALSTORE_VERSION ||
+      header->record_size != sizeof(EvalRecord) || header->record_count == 0 ||
+      (header->record_count & (header->record_count - 1)) != 0) {
+    return false;
+  }
+  return file_size ==
+         sizeof(EvalStoreHeader) + header->record_count * sizeof(EvalRecord);
+}
+
+/* A writer that dies between taking a record's seqlock and releasing it
+   leaves seq odd, and every reader and writer would skip the record from
+   then on. Dropping the key makes the slot empty again. */
+static void clear_torn_records(EvalStore *store) {
+  uint64_t cleared = 0;
+  for (uint64_t i = 0; i <= store->mask; i++) {
+    EvalRecord *record = &store->records[i];
+    if (record->seq & 1) {
+      record->key = 0;
+      record->seq++;
+      cleared++;
+    }
+  }
+  if (cleared > 0) {
+    printf("Cleared %lu records left half written in the evaluation store\n",
+           (unsigned long)cleared);
+  }
+}
+
+/* Maps the store at path, creating it if it does not exist or was written by
+   an incompatible version. An existing valid store keeps its size, so
+   reopening it costs one mmap regardless of how much it holds, unless the
+   last process to use it did not close it. */
+int evalstore_open(EvalStore *store, const char *path, size_t size_bytes) {
+  memset(store, 0, sizeof(*store));
+  store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (store->fd == -1) {
+    fprintf(stderr, "Failed to open evaluation store %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  // Every process holds a shared lock while it has the store open. One that
+  // gets the lock exclusively is alone with the file, so it may create it or
+  // repair it; the others wait for that to finish.
+  bool alone = flock(store->fd, LOCK_EX | LOCK_NB) == 0;
+  if (!alone) {
+    flock(store->fd, LOCK_SH);
+  }
+
+  struct stat st;
+  EvalStoreHeader header = {0};
+  if (fstat(store->fd, &st) == -1 ||
+      (size_t)st.st_size < sizeof(header) ||
+      pread(store->fd, &header, sizeof(header), 0) != sizeof(header) ||
+      !header_valid(&header, st.st_size)) {
+    if (!alone) {
+      fprintf(stderr,
+              "Evaluation store %s is in use by an incompatible version\n",
+              path);
+      close(store->fd);
+      return -1;
+    }
+    uint64_t count = 1;
+    while (count * 2 * sizeof(EvalRecord) <= size_bytes) {
+      count *= 2;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVALSTORE_MAGIC, sizeof(EVALSTORE_MAGIC));
+    header.version = EVALSTORE_VERSION;
+    header.record_size = sizeof(EvalRecord);
+    header.record_count = count;
+    header.closed = 1; // Nothing to repair in a new file
+
+    // Truncating to zero first drops any stale records
+    size_t file_size = sizeof(header) + count * sizeof(EvalRecord);
+    if (ftruncate(store->fd, 0) == -1 ||
+        ftruncate(store->fd, file_size) == -1 ||
+        pwrite(store->fd, &header, sizeof(header), 0) != sizeof(header)) {
+      fprintf(stderr, "Failed to initialise evaluation store %s: %s\n", path,
+              strerror(errno));
+      close(store->fd);
+      return -1;
+    }
+    printf("Created evaluation store %s with %lu records\n", path,
+           (unsigned long)count);
+  }
+
+  store->map_size = sizeof(header) + header.record_count * sizeof(EvalRecord);
+  void *map = mmap(NULL, store->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   store->fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map evaluation store %s: %s\n", path,
+            strerror(errno));
+    close(store->fd);
+    return -1;
+  }
+
+  store->header = map;
+  store->records = (EvalRecord *)(store->header + 1);
+  store->mask = header.record_count - 1;
+  if (alone) {
+    if (!store->header->closed) {
+      clear_torn_records(store);
+    }
+    store->header->closed = 0;
+    flock(store->fd, LOCK_SH);
+  }
+  return 0;
+}
+
+void evalstore_close(EvalStore *store) {
+  if (store->header) {
+    // The last process out marks the store as closed, so the next one need
+    // not look for torn records
+    if (flock(store->fd, LOCK_EX | LOCK_NB) == 0) {
+      store->header->closed = 1;
+    }
+    munmap(store->header, store->map_size);
+    store->header = NULL;
+  }
+  if (store->fd != -1) {
+    close(store->fd);
+    store->fd = -1;
+  }
+}
+
+/* Copies a record out under its seqlock. Returns false if a writer was busy
+   with it, which callers treat as a miss. */
+static bool read_record(const EvalRecord *record, EvalRecord *copy) {
+  uint32_t before = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+  if (before & 1) {
+    return false;
+  }
+  memcpy(copy, record, sizeof(*copy));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&record->seq, __ATOMIC_RELAXED) == before;
+}
+
+SearchResult *evalstore_lookup(EvalStore *store, uint64_t key,
+                               const AnalysisRequest *request, Arena *arena) {
+  EvalRecord record = {0};
+  for (uint64_t i = 0; i < EVALSTORE_MAX_PROBE; i++) {
+    const EvalRecord *slot = &store->records[(key + i) & store->mask];
+    if (!read_record(slot, &record)) {
+      continue; // Being rewritten, or left half written by a crash
+    }
+    if (record.key == 0) {
+      return NULL;
+    }
+    if (record.key == key) {
+      break;
+    }
+  }
+  if (record.key != key) {
+    return NULL;
+  }
+
+  size_t size = sizeof(SearchResult) + sizeof(PvLine) +
+                record.pv_count * sizeof(uint16_t);
+  SearchResult *result = arena_alloc(arena, size);
+  memset(result, 0, sizeof(SearchResult) + sizeof(PvLine));
+  result->size = (uint32_t)size;
+  result->bestmove = record.bestmove;
+  result->ponder = record.ponder;
+  result->nodes = record.nodes;
+  result->time_ms = record.time_ms;
+  result->nps = record.time_ms ? record.nodes * 1000 / record.time_ms : 0;
+  result->line_count = 1;
+
+  PvLine *line = &result->lines[0];
+  line->depth = record.depth;
+  line->seldepth = record.seldepth;
+  line->score.value = record.score;
+  line->score.kind = record.score_kind;
+  line->score.bound = record.bound;
+  line->pv_count = record.pv_count;
+  memcpy((uint16_t *)search_result_moves(result), record.pv,
+         record.pv_count * sizeof(uint16_t));
+
+  if (!analysis_result_satisfies(result, request)) {
+    return NULL;
+  }
+  return result;
+}
+
+/* Writes a single line result into the table. Within the probe window the
+   slot already holding the key wins, then an empty slot, then the shallowest
+   entry, so deep analysis is what survives when the table fills up. */
+void evalstore_put(EvalStore *store, uint64_t key, const SearchResult *result) {
+  if (key == 0 || result->line_count != 1) {
+    return;
+  }
+  const PvLine *line = &result->lines[0];
+
+  EvalRecord *target = NULL;
+  for (uint64_t i = 0; i < EVALSTORE_MAX_PROBE; i++) {
+    EvalRecord *slot = &store->records[(key + i) & store->mask];
+    uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+    if (slot_key == key || slot_key == 0) {
+      target = slot;
+      break;
+    }
+    if (!target || slot->depth < target->depth) {
+      target = slot;
+    }
+  }
+
+  if (target->key == key && target->depth > line->depth) {
+    return;
+  }
+
+  // Take the record's seqlock; if another writer holds it, drop this update
+  uint32_t seq = __atomic_load_n(&target->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&target->seq, &seq, seq + 1, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  size_t pv_count = line->pv_count < EVALSTORE_PV_LEN ? line->pv_count
+                                                       : EVALSTORE_PV_LEN;
+  target->key = key;
+  target->depth = line->depth;
+  target->seldepth = line->seldepth > UINT8_MAX ? UINT8_MAX : line->seldepth;
+  target->bestmove = result->bestmove;
+  target->ponder = result->ponder;
+  target->nodes = result->nodes;
+  target->time_ms =
+      result->time_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)result->time_ms;
+  target->score = line->score.value;
+  target->score_kind = line->score.kind;
+  target->bound = line->score.bound;
+  target->pv_count = (uint8_t)pv_count;
+  memcpy(target->pv, search_result_moves(result) + line->pv_offset,
+         pv_count * sizeof(uint16_t));
+
+  __atomic_store_n(&target->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,58 @@
+#ifndef EVALSTORE_H
+#define EVALSTORE_H
+
+#include "analysis.h"
+#include "arena.h"
+#include "uci.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVALSTORE_MAGIC "SFEVALS"
+#define EVALSTORE_VERSION 4
+#define EVALSTORE_DEFAULT_SIZE_MB 64
+#define EVALSTORE_PV_LEN 13
+#define EVALSTORE_MAX_PROBE 16
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t record_count; // Power of two
+  uint32_t closed;       // Set by the last process to close the store
+  uint8_t reserved[36];
+} EvalStoreHeader;
+
+/* One fixed size slot of the open addressing table. seq is a per record
+   seqlock: odd while a writer is updating the record, so readers in any
+   process can detect and skip a torn copy. A zero key marks an empty slot. */
+typedef struct {
+  uint32_t seq;
+  uint16_t depth;
+  uint16_t bestmove;
+  uint64_t key;
+  uint64_t nodes;
+  int32_t score;
+  uint32_t time_ms; // Lets movetime requests be answered from the store
+  uint16_t ponder;
+  uint8_t score_kind;
+  uint8_t bound;
+  uint8_t pv_count;
+  uint8_t seldepth;
+  uint16_t pv[EVALSTORE_PV_LEN];
+} EvalRecord;
+
+typedef struct {
+  int fd;
+  EvalStoreHeader *header;
+  EvalRecord *records;
+  uint64_t mask;
+  size_t map_size;
+} EvalStore;
+
+int evalstore_open(EvalStore *store, const char *path, size_t size_bytes);
+void evalstore_close(EvalStore *store);
+SearchResult *evalstore_lookup(EvalStore *store, uint64_t key,
+                               const AnalysisRequest *request, Arena *arena);
+void evalstore_put(EvalStore *store, uint64_t key, const SearchResult *result);
+
+#endif
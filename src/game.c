@@ -0,0 +1,167 @@
+#include "game.h"
+#include "analysis.h"
+#include "arena.h"
+#include "engine.h"
+#include "json.h"
+#include "position.h"
+#include "pgn.h"
+#include "pool.h"
+#include "uci.h"
+#include "utils.h"
+#include <string.h>
+
+/* The side to move's evaluation of a searched position, clamped so that a
+   missed mate does not dwarf every other loss in the game. */
+static int clamped_eval(const SearchResult *result) {
+  if (result->line_count == 0) {
+    return 0;
+  }
+  const UciScore *score = &result->lines[0].score;
+  if (score->kind == SCORE_MATE) {
+    // mate 0 means the side to move is already mated
+    return score->value > 0 ? GAME_EVAL_CLAMP_CP : -GAME_EVAL_CLAMP_CP;
+  }
+  if (score->value > GAME_EVAL_CLAMP_CP) {
+    return GAME_EVAL_CLAMP_CP;
+  }
+  return score->value < -GAME_EVAL_CLAMP_CP ? -GAME_EVAL_CLAMP_CP
+                                            : score->value;
+}
+
+static const char *classify(int loss) {
+  if (loss >= GAME_BLUNDER_CP) {
+    return "blunder";
+  }
+  if (loss >= GAME_MISTAKE_CP) {
+    return "mistake";
+  }
+  return loss >= GAME_INACCURACY_CP ? "inaccuracy" : NULL;
+}
+
+/* Appends the evaluation of a searched position from white's point of view. */
+static void append_white_eval(Arena *arena, StringBuilder *sb,
+                              const SearchResult *result, int side) {
+  if (result->line_count == 0) {
+    sb_appendf(arena, sb, "null");
+    return;
+  }
+  const UciScore *score = &result->lines[0].score;
+  int value = side == WHITE ? score->value : -score->value;
+  sb_appendf(arena, sb, "{\"%s\":%d}",
+             score->kind == SCORE_MATE ? "mate" : "cp", value);
+}
+
+static void append_tag(Arena *arena, StringBuilder *sb, const PgnGame *game,
+                       const char *tag, const char *key) {
+  const char *value = pgn_tag(game, tag);
+  if (value) {
+    sb_appendf(arena, sb, ",\"%s\":", key);
+    json_append_string(arena, sb, value);
+  }
+}
+
+/* Analyzes the position before every move and the final one on a single
+   engine, sending the growing move list each time without ucinewgame in
+   between, so the engine's hash carries over from ply to ply. Appends the
+   per move annotations to sb as fields of an open JSON object. Returns false
+   only if the engine failed. */
+bool game_analyze(EnginePool *pool, Arena *arena, const PgnGame *game,
+                  const AnalysisRequest *limits, StringBuilder *sb) {
+  append_tag(arena, sb, game, "White", "white");
+  append_tag(arena, sb, game, "Black", "black");
+  sb_appendf(arena, sb, ",\"result\":");
+  json_append_string(arena, sb, game->result);
+
+  const char *fen = pgn_tag(game, "FEN");
+  Position pos;
+  if ((fen && !analysis_valid_fen(fen)) ||
+      !position_from_fen(&pos, fen ? fen : STARTPOS_FEN)) {
+    sb_appendf(arena, sb, ",\"error\":\"fen\"");
+    return true;
+  }
+  int first_side = pos.side;
+
+  size_t count = game->move_count;
+  uint16_t *moves = arena_alloc(arena, (count + 1) * sizeof(*moves));
+  for (size_t i = 0; i < count; i++) {
+    if (!position_parse_san(&pos, game->moves[i], &moves[i])) {
+      sb_appendf(arena, sb, ",\"error\":\"move\",\"ply\":%zu,\"san\":", i + 1);
+      char *san = arena_alloc(arena, game->moves[i].len + 1);
+      memcpy(san, game->moves[i].data, game->moves[i].len);
+      san[game->moves[i].len] = '\0';
+      json_append_string(arena, sb, san);
+      return true;
+    }
+    position_make_move(&pos, moves[i]);
+  }
+
+  AnalysisRequest request = *limits;
+  request.multipv = 1;
+  char *go = analysis_go_command(arena, &request);
+  SearchResult **results = arena_alloc(arena, (count + 1) * sizeof(*results));
+
+  StringBuilder position = {0};
+  if (fen) {
+    sb_appendf(arena, &position, "position fen %s moves", fen);
+  } else {
+    sb_appendf(arena, &position, "position startpos moves");
+  }
+
+  Engine *engine = pool_acquire(pool);
+  bool ok = engine_send(engine, "ucinewgame") == 0 &&
+            engine_send(engine, "isready") == 0 &&
+            engine_wait_for(engine, "readyok") == 0;
+  for (size_t ply = 0; ok && ply <= count; ply++) {
+    if (ply > 0) {
+      char move[UCI_MOVE_MAX_LEN];
+      uci_format_move(moves[ply - 1], move);
+      sb_appendf(arena, &position, " %s", move);
+    }
+    arena_sb_append_null(arena, &position);
+    results[ply] = engine_search(engine, position.items, go, 1, arena);
+    position.count--;
+    ok = results[ply] != NULL;
+  }
+  pool_release(pool, engine);
+  if (!ok) {
+    return false;
+  }
+
+  long loss_total[2] = {0, 0};
+  size_t move_total[2] = {0, 0};
+  sb_appendf(arena, sb, ",\"moves\":[");
+  for (size_t i = 0; i < count; i++) {
+    int mover = (first_side + i) % 2;
+    char move[UCI_MOVE_MAX_LEN], best[UCI_MOVE_MAX_LEN];
+    uci_format_move(moves[i], move);
+    uci_format_move(results[i]->bestmove, best);
+
+    int loss = 0;
+    if (moves[i] != results[i]->bestmove) {
+      loss = clamped_eval(results[i]) + clamped_eval(results[i + 1]);
+      loss = loss < 0 ? 0 : loss;
+    }
+    loss_total[mover] += loss;
+    move_total[mover]++;
+
+    sb_appendf(arena, sb, "%s{\"ply\":%zu,\"san\":\"%.*s\",\"move\":\"%s\"",
+               i ? "," : "", i + 1, (int)game->moves[i].len,
+               game->moves[i].data, move);
+    if (results[i]->bestmove != MOVE_NONE) {
+      sb_appendf(arena, sb, ",\"best\":\"%s\"", best);
+    }
+    sb_appendf(arena, sb, ",\"eval\":");
+    append_white_eval(arena, sb, results[i + 1], !mover);
+    sb_appendf(arena, sb, ",\"loss\":%d", loss);
+    const char *annotation = classify(loss);
+    if (annotation) {
+      sb_appendf(arena, sb, ",\"annotation\":\"%s\"", annotation);
+    }
+    sb_appendf(arena, sb, "}");
+  }
+
+  sb_appendf(arena, sb, "],\"acpl\":{\"white\":%ld,\"black\":%ld}",
+             move_total[WHITE] ? loss_total[WHITE] / (long)move_total[WHITE] : 0,
+             move_total[BLACK] ? loss_total[BLACK] / (long)move_total[BLACK] : 0);
+  return true;
+}
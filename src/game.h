@@ -0,0 +1,22 @@
+#ifndef GAME_H
+#define GAME_H
+
+#include "analysis.h"
+#include "arena.h"
+#include "pgn.h"
+#include "pool.h"
+#include "utils.h"
+#include <stdbool.h>
+
+// Centipawns a move gives away compared to the engine's choice
+#define GAME_INACCURACY_CP 50
+#define GAME_MISTAKE_CP 100
+#define GAME_BLUNDER_CP 300
+
+// Evaluations are clamped before comparing them, and mates count as this much
+#define GAME_EVAL_CLAMP_CP 1000
+
+bool game_analyze(EnginePool *pool, Arena *arena, const PgnGame *game,
+                  const AnalysisRequest *limits, StringBuilder *sb);
+
+#endif
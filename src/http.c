@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include "http.h"
+#include "arena.h"
+#include "linebuf.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static bool header_is(StrView name, const char *expected) {
+  return name.len == strlen(expected) &&
+         strncasecmp(name.data, expected, name.len) == 0;
+}
+
+static bool value_has_token(StrView value, const char *token) {
+  size_t n = strlen(token);
+  for (size_t i = 0; i + n <= value.len; i++) {
+    if (strncasecmp(value.data + i, token, n) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static StrView trim(StrView sv) {
+  while (sv.len > 0 && (sv.data[0] == ' ' || sv.data[0] == '\t')) {
+    sv.data++;
+    sv.len--;
+  }
+  while (sv.len > 0 &&
+         (sv.data[sv.len - 1] == ' ' || sv.data[sv.len - 1] == '\t')) {
+    sv.len--;
+  }
+  return sv;
+}
+
+/* Parses one request from the start of buf. Returns HTTP_PARSE_INCOMPLETE
+   until the header and the whole Content-Length body have arrived. Chunked
+   request bodies are not supported. */
+HttpParseStatus http_parse_request(const char *buf, size_t len,
+                                   HttpRequest *request) {
+  const char *header_end = memmem(buf, len, "\r\n\r\n", 4);
+  if (!header_end) {
+    return len > HTTP_MAX_HEADER_SIZE ? HTTP_PARSE_TOO_LARGE
+                                      : HTTP_PARSE_INCOMPLETE;
+  }
+  size_t header_len = header_end - buf + 4;
+
+  const char *line_end = memmem(buf, header_len, "\r\n", 2);
+  StrView rest = {buf, line_end - buf}, version;
+  if (!sv_next_token(&rest, &request->method) ||
+      !sv_next_token(&rest, &request->path) ||
+      !sv_next_token(&rest, &version) || !sv_starts_with(version, "HTTP/1.")) {
+    return HTTP_PARSE_ERROR;
+  }
+
+  request->keep_alive = sv_eq(version, "HTTP/1.1");
+  size_t content_length = 0;
+
+  const char *p = line_end + 2;
+  while (p < header_end) {
+    const char *eol = memmem(p, header_end + 2 - p, "\r\n", 2);
+    const char *colon = memchr(p, ':', eol - p);
+    if (!colon) {
+      return HTTP_PARSE_ERROR;
+    }
+
+    StrView name = {p, colon - p};
+    StrView value = trim((StrView){colon + 1, eol - colon - 1});
+
+    if (header_is(name, "Content-Length")) {
+      char digits[21];
+      if (value.len == 0 || value.len >= sizeof(digits)) {
+        return HTTP_PARSE_ERROR;
+      }
+      memcpy(digits, value.data, value.len);
+      digits[value.len] = '\0';
+      char *end;
+      content_length = strtoul(digits, &end, 10);
+      if (*end != '\0') {
+        return HTTP_PARSE_ERROR;
+      }
+    } else if (header_is(name, "Transfer-Encoding")) {
+      return HTTP_PARSE_ERROR;
+    } else if (header_is(name, "Connection")) {
+      if (value_has_token(value, "close")) {
+        request->keep_alive = false;
+      } else if (value_has_token(value, "keep-alive")) {
+        request->keep_alive = true;
+      }
+    }
+
+    p = eol + 2;
+  }
+
+  if (content_length > HTTP_MAX_BODY_SIZE) {
+    return HTTP_PARSE_TOO_LARGE;
+  }
+  if (len < header_len + content_length) {
+    return HTTP_PARSE_INCOMPLETE;
+  }
+
+  request->body.data = buf + header_len;
+  request->body.len = content_length;
+  request->total_len = header_len + content_length;
+  return HTTP_PARSE_OK;
+}
+
+const char *http_status_text(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 413:
+    return "Payload Too Large";
+  case 500:
+    return "Internal Server Error";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "Unknown";
+  }
+}
+
+void http_format_response(Arena *arena, StringBuilder *out, int status,
+                          const char *content_type, const char *body,
+                          size_t body_len, bool keep_alive) {
+  sb_appendf(arena, out,
+             "HTTP/1.1 %d %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             status, http_status_text(status), content_type, body_len,
+             keep_alive ? "keep-alive" : "close");
+  arena_da_append_many(arena, out, body, body_len);
+}
+
+/* Starts a response whose body follows in chunks of unknown number. */
+void http_format_stream_start(Arena *arena, StringBuilder *out, int status,
+                              const char *content_type, bool keep_alive) {
+  sb_appendf(arena, out,
+             "HTTP/1.1 %d %s\r\n"
+             "Content-Type: %s\r\n"
+             "Transfer-Encoding: chunked\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             status, http_status_text(status), content_type,
+             keep_alive ? "keep-alive" : "close");
+}
+
+/* Appends one chunk of a streamed body; an empty one ends the body. */
+void http_format_chunk(Arena *arena, StringBuilder *out, const char *data,
+                       size_t len) {
+  sb_appendf(arena, out, "%zx\r\n", len);
+  arena_da_append_many(arena, out, data, len);
+  sb_appendf(arena, out, "\r\n");
+}
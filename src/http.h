@@ -0,0 +1,41 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "arena.h"
+#include "linebuf.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HTTP_MAX_HEADER_SIZE (8 * 1024)
+#define HTTP_MAX_BODY_SIZE (64 * 1024)
+
+typedef enum {
+  HTTP_PARSE_INCOMPLETE,
+  HTTP_PARSE_OK,
+  HTTP_PARSE_ERROR,
+  HTTP_PARSE_TOO_LARGE,
+} HttpParseStatus;
+
+/* A request parsed in place: every view points into the connection's input
+   buffer. */
+typedef struct {
+  StrView method;
+  StrView path;
+  StrView body;
+  bool keep_alive;
+  size_t total_len; // Header plus body, i.e. where a pipelined request starts
+} HttpRequest;
+
+HttpParseStatus http_parse_request(const char *buf, size_t len,
+                                   HttpRequest *request);
+void http_format_response(Arena *arena, StringBuilder *out, int status,
+                          const char *content_type, const char *body,
+                          size_t body_len, bool keep_alive);
+void http_format_stream_start(Arena *arena, StringBuilder *out, int status,
+                              const char *content_type, bool keep_alive);
+void http_format_chunk(Arena *arena, StringBuilder *out, const char *data,
+                       size_t len);
+const char *http_status_text(int status);
+
+#endif
@@ -0,0 +1,302 @@
+#include "json.h"
+#include "arena.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_MAX_DEPTH 16
+
+typedef struct {
+  Arena *arena;
+  const char *p;
+  const char *end;
+  int depth;
+} JsonParser;
+
+typedef struct {
+  JsonValue *items;
+  size_t count;
+  size_t capacity;
+} JsonValues;
+
+typedef struct {
+  char **items;
+  size_t count;
+  size_t capacity;
+} JsonKeys;
+
+static bool parse_value(JsonParser *parser, JsonValue *value);
+
+static void skip_whitespace(JsonParser *parser) {
+  while (parser->p < parser->end &&
+         (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n' ||
+          *parser->p == '\r')) {
+    parser->p++;
+  }
+}
+
+static bool consume(JsonParser *parser, char c) {
+  skip_whitespace(parser);
+  if (parser->p < parser->end && *parser->p == c) {
+    parser->p++;
+    return true;
+  }
+  return false;
+}
+
+static bool consume_literal(JsonParser *parser, const char *literal) {
+  size_t n = strlen(literal);
+  if ((size_t)(parser->end - parser->p) < n ||
+      memcmp(parser->p, literal, n) != 0) {
+    return false;
+  }
+  parser->p += n;
+  return true;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Decodes a string literal, including \u escapes (as UTF-8), into the arena.
+   Surrogate pairs are not combined; engines only ever see ASCII. */
+static bool parse_string(JsonParser *parser, char **out) {
+  if (!consume(parser, '"')) {
+    return false;
+  }
+
+  StringBuilder sb = {0};
+  while (parser->p < parser->end && *parser->p != '"') {
+    char c = *parser->p++;
+    if ((unsigned char)c < 0x20) {
+      return false;
+    }
+    if (c != '\\') {
+      arena_da_append(parser->arena, &sb, c);
+      continue;
+    }
+
+    if (parser->p == parser->end) {
+      return false;
+    }
+    char e = *parser->p++;
+    switch (e) {
+    case '"':
+    case '\\':
+    case '/':
+      arena_da_append(parser->arena, &sb, e);
+      break;
+    case 'b':
+      arena_da_append(parser->arena, &sb, '\b');
+      break;
+    case 'f':
+      arena_da_append(parser->arena, &sb, '\f');
+      break;
+    case 'n':
+      arena_da_append(parser->arena, &sb, '\n');
+      break;
+    case 'r':
+      arena_da_append(parser->arena, &sb, '\r');
+      break;
+    case 't':
+      arena_da_append(parser->arena, &sb, '\t');
+      break;
+    case 'u': {
+      if (parser->end - parser->p < 4) {
+        return false;
+      }
+      unsigned cp = 0;
+      for (int i = 0; i < 4; i++) {
+        int d = hex_digit(*parser->p++);
+        if (d < 0) {
+          return false;
+        }
+        cp = cp * 16 + d;
+      }
+      if (cp < 0x80) {
+        arena_da_append(parser->arena, &sb, (char)cp);
+      } else if (cp < 0x800) {
+        arena_da_append(parser->arena, &sb, (char)(0xc0 | (cp >> 6)));
+        arena_da_append(parser->arena, &sb, (char)(0x80 | (cp & 0x3f)));
+      } else {
+        arena_da_append(parser->arena, &sb, (char)(0xe0 | (cp >> 12)));
+        arena_da_append(parser->arena, &sb,
+                        (char)(0x80 | ((cp >> 6) & 0x3f)));
+        arena_da_append(parser->arena, &sb, (char)(0x80 | (cp & 0x3f)));
+      }
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+
+  if (parser->p == parser->end) {
+    return false;
+  }
+  parser->p++; // Closing quote
+
+  arena_sb_append_null(parser->arena, &sb);
+  *out = sb.items;
+  return true;
+}
+
+static bool parse_number(JsonParser *parser, double *out) {
+  const char *start = parser->p;
+  while (parser->p < parser->end &&
+         strchr("+-0123456789.eE", *parser->p) != NULL) {
+    parser->p++;
+  }
+  if (parser->p == start || parser->p - start > 64) {
+    return false;
+  }
+
+  char buf[65];
+  memcpy(buf, start, parser->p - start);
+  buf[parser->p - start] = '\0';
+
+  char *end;
+  *out = strtod(buf, &end);
+  return *end == '\0';
+}
+
+static bool parse_array(JsonParser *parser, JsonValue *value) {
+  JsonValues items = {0};
+
+  if (!consume(parser, ']')) {
+    do {
+      JsonValue item;
+      if (!parse_value(parser, &item)) {
+        return false;
+      }
+      arena_da_append(parser->arena, &items, item);
+    } while (consume(parser, ','));
+
+    if (!consume(parser, ']')) {
+      return false;
+    }
+  }
+
+  value->type = JSON_ARRAY;
+  value->items = items.items;
+  value->count = items.count;
+  return true;
+}
+
+static bool parse_object(JsonParser *parser, JsonValue *value) {
+  JsonValues items = {0};
+  JsonKeys keys = {0};
+
+  if (!consume(parser, '}')) {
+    do {
+      char *key;
+      JsonValue item;
+      skip_whitespace(parser);
+      if (!parse_string(parser, &key) || !consume(parser, ':') ||
+          !parse_value(parser, &item)) {
+        return false;
+      }
+      arena_da_append(parser->arena, &keys, key);
+      arena_da_append(parser->arena, &items, item);
+    } while (consume(parser, ','));
+
+    if (!consume(parser, '}')) {
+      return false;
+    }
+  }
+
+  value->type = JSON_OBJECT;
+  value->keys = keys.items;
+  value->items = items.items;
+  value->count = items.count;
+  return true;
+}
+
+static bool parse_value(JsonParser *parser, JsonValue *value) {
+  memset(value, 0, sizeof(*value));
+  skip_whitespace(parser);
+  if (parser->p == parser->end) {
+    return false;
+  }
+
+  bool ok;
+  switch (*parser->p) {
+  case '{':
+  case '[':
+    if (++parser->depth > JSON_MAX_DEPTH) {
+      return false;
+    }
+    parser->p++;
+    ok = parser->p[-1] == '{' ? parse_object(parser, value)
+                              : parse_array(parser, value);
+    parser->depth--;
+    return ok;
+  case '"':
+    value->type = JSON_STRING;
+    return parse_string(parser, &value->string);
+  case 't':
+    value->type = JSON_BOOL;
+    value->boolean = true;
+    return consume_literal(parser, "true");
+  case 'f':
+    value->type = JSON_BOOL;
+    return consume_literal(parser, "false");
+  case 'n':
+    value->type = JSON_NULL;
+    return consume_literal(parser, "null");
+  default:
+    value->type = JSON_NUMBER;
+    return parse_number(parser, &value->number);
+  }
+}
+
+/* Parses a complete JSON document. Returns NULL if it is malformed or has
+   trailing garbage. */
+JsonValue *json_parse(Arena *arena, const char *text, size_t len) {
+  JsonParser parser = {arena, text, text + len, 0};
+  JsonValue *value = arena_alloc(arena, sizeof(*value));
+
+  if (!parse_value(&parser, value)) {
+    return NULL;
+  }
+  skip_whitespace(&parser);
+  if (parser.p != parser.end) {
+    return NULL;
+  }
+  return value;
+}
+
+const JsonValue *json_get(const JsonValue *object, const char *key) {
+  if (!object || object->type != JSON_OBJECT) {
+    return NULL;
+  }
+  for (size_t i = 0; i < object->count; i++) {
+    if (strcmp(object->keys[i], key) == 0) {
+      return &object->items[i];
+    }
+  }
+  return NULL;
+}
+
+void json_append_string(Arena *arena, StringBuilder *sb, const char *s) {
+  arena_da_append(arena, sb, '"');
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\') {
+      arena_da_append(arena, sb, '\\');
+      arena_da_append(arena, sb, (char)c);
+    } else if (c < 0x20) {
+      sb_appendf(arena, sb, "\\u%04x", c);
+    } else {
+      arena_da_append(arena, sb, (char)c);
+    }
+  }
+  arena_da_append(arena, sb, '"');
+}
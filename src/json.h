@@ -0,0 +1,36 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include "arena.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+  JSON_NULL,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+} JsonType;
+
+typedef struct JsonValue JsonValue;
+
+/* Objects keep their keys in keys[] next to the matching items[]. Every
+   string, key and array lives in the arena passed to json_parse(). */
+struct JsonValue {
+  JsonType type;
+  bool boolean;
+  double number;
+  char *string;
+  char **keys;
+  JsonValue *items;
+  size_t count;
+};
+
+JsonValue *json_parse(Arena *arena, const char *text, size_t len);
+const JsonValue *json_get(const JsonValue *object, const char *key);
+void json_append_string(Arena *arena, StringBuilder *sb, const char *s);
+
+#endif
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include "layout.h"
+#include "constants.h"
+#include "engine.h"
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  size_t node;
+  size_t first_cpu;
+  CpuSet cpus; // The core's hardware threads that this process may use
+} Core;
+
+void cpuset_add(CpuSet *set, size_t cpu) {
+  if (cpu < LAYOUT_MAX_CPUS) {
+    set->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+  }
+}
+
+bool cpuset_has(const CpuSet *set, size_t cpu) {
+  return cpu < LAYOUT_MAX_CPUS && set->bits[cpu / 64] >> (cpu % 64) & 1;
+}
+
+size_t cpuset_count(const CpuSet *set) {
+  size_t count = 0;
+  for (size_t i = 0; i < LAYOUT_MAX_CPUS / 64; i++) {
+    count += (size_t)__builtin_popcountll(set->bits[i]);
+  }
+  return count;
+}
+
+/* Reads a sysfs CPU list such as "0-3,8,10-11". */
+static bool read_cpu_list(const char *path, CpuSet *set) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  char line[4096];
+  bool ok = fgets(line, sizeof(line), file) != NULL;
+  fclose(file);
+  if (!ok) {
+    return false;
+  }
+
+  memset(set, 0, sizeof(*set));
+  char *p = line;
+  while (*p && *p != '\n') {
+    char *end;
+    unsigned long first = strtoul(p, &end, 10);
+    unsigned long last = first;
+    if (end == p) {
+      return false;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtoul(p, &end, 10);
+      if (end == p) {
+        return false;
+      }
+    }
+    for (unsigned long cpu = first; cpu <= last && cpu < LAYOUT_MAX_CPUS;
+         cpu++) {
+      cpuset_add(set, cpu);
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return true;
+}
+
+static int compare_cores(const void *a, const void *b) {
+  const Core *x = a, *y = b;
+  if (x->node != y->node) {
+    return x->node < y->node ? -1 : 1;
+  }
+  return x->first_cpu < y->first_cpu ? -1 : 1;
+}
+
+/* Groups the CPUs this process may run on into physical cores, ordered by
+   NUMA node. Without sysfs every CPU counts as a core on node 0. Returns the
+   number of cores. */
+static size_t read_cores(Core *cores, size_t *node_count) {
+  cpu_set_t affinity;
+  if (sched_getaffinity(0, sizeof(affinity), &affinity) != 0) {
+    CPU_ZERO(&affinity);
+    CPU_SET(0, &affinity);
+  }
+  CpuSet usable = {0};
+  for (size_t cpu = 0; cpu < CPU_SETSIZE && cpu < LAYOUT_MAX_CPUS; cpu++) {
+    if (CPU_ISSET(cpu, &affinity)) {
+      cpuset_add(&usable, cpu);
+    }
+  }
+
+  CpuSet nodes[LAYOUT_MAX_NODES];
+  size_t nodes_found = 0;
+  char path[PATH_MAX];
+  for (size_t node = 0; node < LAYOUT_MAX_NODES; node++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist",
+             node);
+    if (!read_cpu_list(path, &nodes[node])) {
+      memset(&nodes[node], 0, sizeof(nodes[node]));
+    } else {
+      nodes_found = node + 1;
+    }
+  }
+
+  CpuSet assigned = {0};
+  size_t count = 0;
+  *node_count = 0;
+  for (size_t cpu = 0; cpu < LAYOUT_MAX_CPUS; cpu++) {
+    if (!cpuset_has(&usable, cpu) || cpuset_has(&assigned, cpu)) {
+      continue;
+    }
+
+    CpuSet siblings;
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%zu/topology/thread_siblings_list",
+             cpu);
+    if (!read_cpu_list(path, &siblings)) {
+      memset(&siblings, 0, sizeof(siblings));
+      cpuset_add(&siblings, cpu);
+    }
+
+    Core *core = &cores[count++];
+    memset(core, 0, sizeof(*core));
+    core->first_cpu = cpu;
+    for (size_t i = 0; i < LAYOUT_MAX_CPUS / 64; i++) {
+      core->cpus.bits[i] = siblings.bits[i] & usable.bits[i];
+      assigned.bits[i] |= core->cpus.bits[i];
+    }
+    for (size_t node = 0; node < nodes_found; node++) {
+      if (cpuset_has(&nodes[node], cpu)) {
+        core->node = node;
+        break;
+      }
+    }
+    if (core->node + 1 > *node_count) {
+      *node_count = core->node + 1;
+    }
+  }
+
+  qsort(cores, count, sizeof(*cores), compare_cores);
+  return count;
+}
+
+/* Cuts the cores into slots of `threads` cores each, never across a node.
+   Where not even one slot fits on a node, slots may span nodes, and the last
+   resort is a single slot with every core. */
+static int build_slots(EngineLayout *layout, const Core *cores,
+                       size_t core_count, size_t threads) {
+  CpuSet *slots = calloc(core_count ? core_count : 1, sizeof(*slots));
+  if (!slots) {
+    fprintf(stderr, "Failed to allocate the engine layout\n");
+    return -1;
+  }
+
+  size_t slot_count = 0;
+  for (int span_nodes = 0; span_nodes < 2 && slot_count == 0; span_nodes++) {
+    size_t in_slot = 0;
+    for (size_t i = 0; i < core_count; i++) {
+      if (i > 0 && cores[i].node != cores[i - 1].node && !span_nodes) {
+        in_slot = 0;
+      }
+      if (in_slot == 0) {
+        memset(&slots[slot_count], 0, sizeof(slots[slot_count]));
+      }
+      for (size_t j = 0; j < LAYOUT_MAX_CPUS / 64; j++) {
+        slots[slot_count].bits[j] |= cores[i].cpus.bits[j];
+      }
+      if (++in_slot == threads) {
+        slot_count++;
+        in_slot = 0;
+      }
+    }
+  }
+  if (slot_count == 0) {
+    memset(&slots[0], 0, sizeof(slots[0]));
+    for (size_t i = 0; i < core_count; i++) {
+      for (size_t j = 0; j < LAYOUT_MAX_CPUS / 64; j++) {
+        slots[0].bits[j] |= cores[i].cpus.bits[j];
+      }
+    }
+    slot_count = 1;
+  }
+
+  free(layout->slots);
+  layout->slots = slots;
+  layout->slot_count = slot_count;
+  layout->threads = threads;
+  layout->hash_mb = threads * LAYOUT_HASH_PER_THREAD_MB;
+  return 0;
+}
+
+/* Reads the topology and lays out engines of `threads` threads on it. Can be
+   called again to follow a changed CPU affinity. */
+int layout_init(EngineLayout *layout, size_t threads) {
+  Core *cores = calloc(LAYOUT_MAX_CPUS, sizeof(*cores));
+  if (!cores) {
+    fprintf(stderr, "Failed to allocate the CPU topology\n");
+    return -1;
+  }
+  size_t node_count;
+  size_t core_count = read_cores(cores, &node_count);
+  int rc = build_slots(layout, cores, core_count, threads ? threads : 1);
+  free(cores);
+  return rc;
+}
+
+static double seconds_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Runs the same bench on an engine in every slot at once and returns how
+   many benches per second the whole machine got through, or a negative
+   value if an engine failed. */
+static double bench_rate(const EngineLayout *layout, const char *path) {
+  Engine *engines = calloc(layout->slot_count, sizeof(*engines));
+  if (!engines) {
+    return -1;
+  }
+
+  bool ok = true;
+  size_t started = 0;
+  for (; ok && started < layout->slot_count; started++) {
+    ok = engine_spawn(&engines[started], path, &layout->slots[started],
+                      true) == 0;
+    if (!ok) {
+      break;
+    }
+    ok = engine_send(&engines[started], "uci") == 0;
+  }
+  for (size_t i = 0; ok && i < started; i++) {
+    ok = engine_wait_for(&engines[i], "uciok") == 0;
+  }
+
+  char command[64];
+  snprintf(command, sizeof(command), "bench %zu %zu %d default depth",
+           layout->hash_mb, layout->threads, LAYOUT_BENCH_DEPTH);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; ok && i < started; i++) {
+    ok = engine_send(&engines[i], command) == 0 &&
+         engine_send(&engines[i], "isready") == 0;
+  }
+  for (size_t i = 0; ok && i < started; i++) {
+    ok = engine_wait_for(&engines[i], "readyok") == 0;
+  }
+  double elapsed = seconds_since(&start);
+
+  for (size_t i = 0; i < started; i++) {
+    engine_close(&engines[i]);
+  }
+  free(engines);
+
+  if (!ok) {
+    return -1;
+  }
+  return (double)layout->slot_count / (elapsed > 1e-6 ? elapsed : 1e-6);
+}
+
+/* Identifies the engine binary and the cores it was calibrated on. */
+static void calibration_key(const char *path, const Core *cores,
+                            size_t core_count, size_t node_count, char *key,
+                            size_t key_size) {
+  char real[PATH_MAX];
+  if (!realpath(path, real)) {
+    snprintf(real, sizeof(real), "%s", path);
+  }
+  size_t cpus = 0;
+  for (size_t i = 0; i < core_count; i++) {
+    cpus += cpuset_count(&cores[i].cpus);
+  }
+  snprintf(key, key_size, "%s %zu %zu %zu", real, cpus, core_count,
+           node_count);
+}
+
+static size_t load_calibration(const char *key) {
+  FILE *file = fopen(ENGINE_LAYOUT_FILENAME, "r");
+  if (!file) {
+    return 0;
+  }
+  char line[PATH_MAX + 128];
+  size_t threads = 0;
+  if (fgets(line, sizeof(line), file) &&
+      strncmp(line, key, strlen(key)) == 0 && line[strlen(key)] == '\n' &&
+      fscanf(file, "%zu", &threads) != 1) {
+    threads = 0;
+  }
+  fclose(file);
+  return threads;
+}
+
+static void save_calibration(const char *key, size_t threads) {
+  FILE *file = fopen(ENGINE_LAYOUT_FILENAME ".tmp", "w");
+  if (!file) {
+    return;
+  }
+  fprintf(file, "%s\n%zu\n", key, threads);
+  if (fclose(file) != 0 ||
+      rename(ENGINE_LAYOUT_FILENAME ".tmp", ENGINE_LAYOUT_FILENAME) != 0) {
+    fprintf(stderr, "Failed to save the engine layout: %s\n",
+            strerror(errno));
+  }
+}
+
+// Lays out the given cores with the saved or the best benched thread count
+static int calibrate(EngineLayout *layout, const char *engine_path,
+                     const Core *cores, size_t core_count, size_t node_count) {
+  char key[PATH_MAX + 64];
+  calibration_key(engine_path, cores, core_count, node_count, key,
+                  sizeof(key));
+  size_t cached = load_calibration(key);
+  if (cached > 0) {
+    return build_slots(layout, cores, core_count, cached);
+  }
+
+  size_t node_cores = 0, run = 0;
+  for (size_t i = 0; i < core_count; i++) {
+    run = i > 0 && cores[i].node == cores[i - 1].node ? run + 1 : 1;
+    node_cores = run > node_cores ? run : node_cores;
+  }
+
+  printf("Calibrating the engine layout on %zu cores...\n", core_count);
+  double rates[sizeof(size_t) * CHAR_BIT] = {0};
+  double best = 0;
+  size_t tried = 0;
+  for (size_t threads = 1; threads <= node_cores; threads *= 2, tried++) {
+    if (build_slots(layout, cores, core_count, threads) != 0) {
+      return -1;
+    }
+    rates[tried] = bench_rate(layout, engine_path);
+    printf("  %zu engines x %zu threads: %.2f benches/s\n",
+           layout->slot_count, threads, rates[tried]);
+    best = rates[tried] > best ? rates[tried] : best;
+  }
+  if (best <= 0) {
+    fprintf(stderr, "Engine calibration failed, using one thread each\n");
+    return build_slots(layout, cores, core_count, 1);
+  }
+
+  size_t threads = 1;
+  for (size_t i = 0; i < tried; i++) {
+    if (rates[i] >= best * LAYOUT_CALIBRATION_MARGIN) {
+      threads = (size_t)1 << i;
+    }
+  }
+  save_calibration(key, threads);
+  return build_slots(layout, cores, core_count, threads);
+}
+
+/* Picks the number of threads per engine by benching every power of two
+   that fits on a node with engines in all slots at once. The choice is kept
+   in ENGINE_LAYOUT_FILENAME until the engine or the cores change. */
+int layout_calibrate(EngineLayout *layout, const char *engine_path) {
+  Core *cores = calloc(LAYOUT_MAX_CPUS, sizeof(*cores));
+  if (!cores) {
+    fprintf(stderr, "Failed to allocate the CPU topology\n");
+    return -1;
+  }
+  size_t node_count;
+  size_t core_count = read_cores(cores, &node_count);
+  int rc = calibrate(layout, engine_path, cores, core_count, node_count);
+  free(cores);
+  return rc;
+}
+
+void layout_free(EngineLayout *layout) {
+  free(layout->slots);
+  layout->slots = NULL;
+  layout->slot_count = 0;
+}
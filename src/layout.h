@@ -0,0 +1,37 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LAYOUT_MAX_CPUS 1024
+#define LAYOUT_MAX_NODES 64
+#define LAYOUT_HASH_PER_THREAD_MB 16
+#define LAYOUT_BENCH_DEPTH 10
+// Fewer engines with more threads answer each request sooner, so they win
+// as long as they keep this share of the best throughput
+#define LAYOUT_CALIBRATION_MARGIN 0.9
+
+typedef struct {
+  uint64_t bits[LAYOUT_MAX_CPUS / 64];
+} CpuSet;
+
+/* How the usable cores are split between engines: every slot is a group of
+   `threads` physical cores, with their SMT siblings, on a single NUMA node. */
+typedef struct {
+  size_t threads; // Threads option of every engine
+  size_t hash_mb; // Hash option of every engine
+  CpuSet *slots;
+  size_t slot_count;
+} EngineLayout;
+
+void cpuset_add(CpuSet *set, size_t cpu);
+bool cpuset_has(const CpuSet *set, size_t cpu);
+size_t cpuset_count(const CpuSet *set);
+
+int layout_init(EngineLayout *layout, size_t threads);
+int layout_calibrate(EngineLayout *layout, const char *engine_path);
+void layout_free(EngineLayout *layout);
+
+#endif
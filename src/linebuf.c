@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "linebuf.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int linebuf_init(LineBuffer *lb, size_t capacity) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  capacity = (capacity + page - 1) / page * page;
+
+  int fd = memfd_create("linebuf", MFD_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create line buffer storage: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  if (ftruncate(fd, capacity) == -1) {
+    fprintf(stderr, "Failed to size line buffer storage: %s\n",
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  // Reserve twice the capacity, then map the same pages into both halves
+  char *base = mmap(NULL, 2 * capacity, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to reserve line buffer: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  for (int half = 0; half < 2; half++) {
+    void *view = mmap(base + half * capacity, capacity, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, 0);
+    if (view == MAP_FAILED) {
+      fprintf(stderr, "Failed to map line buffer: %s\n", strerror(errno));
+      munmap(base, 2 * capacity);
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+
+  lb->data = base;
+  lb->capacity = capacity;
+  lb->head = 0;
+  lb->scan = 0;
+  lb->tail = 0;
+
+  return 0;
+}
+
+void linebuf_free(LineBuffer *lb) {
+  if (lb->data) {
+    munmap(lb->data, 2 * lb->capacity);
+  }
+  lb->data = NULL;
+  lb->capacity = 0;
+}
+
+/* Reads as much as fits into the free part of the ring with a single read().
+   Returns the number of bytes read, 0 on EOF and -1 on error (errno is left
+   untouched so callers on non-blocking fds can check for EAGAIN). */
+ssize_t linebuf_fill(LineBuffer *lb, int fd) {
+  size_t used = lb->tail - lb->head;
+  size_t space = lb->capacity - used;
+
+  if (space == 0) {
+    // A single line longer than the whole ring; drop it rather than wedge
+    lb->head = lb->tail;
+    lb->scan = lb->tail;
+    space = lb->capacity;
+  }
+
+  ssize_t n = read(fd, lb->data + lb->tail % lb->capacity, space);
+  if (n > 0) {
+    lb->tail += n;
+  }
+  return n;
+}
+
+bool linebuf_next(LineBuffer *lb, StrView *line) {
+  const char *start = lb->data + lb->scan % lb->capacity;
+  const char *nl = memchr(start, '\n', lb->tail - lb->scan);
+  if (!nl) {
+    lb->scan = lb->tail;
+    return false;
+  }
+
+  uint64_t end = lb->scan + (nl - start);
+  line->data = lb->data + lb->head % lb->capacity;
+  line->len = end - lb->head;
+  if (line->len > 0 && line->data[line->len - 1] == '\r') {
+    line->len--;
+  }
+
+  lb->head = end + 1;
+  lb->scan = lb->head;
+  return true;
+}
+
+/* Hands out whatever follows the last newline, for input that ended without
+   one. */
+bool linebuf_rest(LineBuffer *lb, StrView *line) {
+  if (lb->tail == lb->head) {
+    return false;
+  }
+  line->data = lb->data + lb->head % lb->capacity;
+  line->len = lb->tail - lb->head;
+  if (line->data[line->len - 1] == '\r') {
+    line->len--;
+  }
+  lb->head = lb->tail;
+  lb->scan = lb->tail;
+  return true;
+}
+
+bool sv_starts_with(StrView sv, const char *prefix) {
+  size_t n = strlen(prefix);
+  return sv.len >= n && memcmp(sv.data, prefix, n) == 0;
+}
+
+bool sv_eq(StrView sv, const char *cstr) {
+  return sv.len == strlen(cstr) && memcmp(sv.data, cstr, sv.len) == 0;
+}
+
+/* Splits the next space separated token off the front of rest. */
+bool sv_next_token(StrView *rest, StrView *token) {
+  while (rest->len > 0 && (rest->data[0] == ' ' || rest->data[0] == '\t')) {
+    rest->data++;
+    rest->len--;
+  }
+  if (rest->len == 0) {
+    return false;
+  }
+
+  size_t n = 0;
+  while (n < rest->len && rest->data[n] != ' ' && rest->data[n] != '\t') {
+    n++;
+  }
+
+  token->data = rest->data;
+  token->len = n;
+  rest->data += n;
+  rest->len -= n;
+  return true;
+}
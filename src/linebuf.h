@@ -0,0 +1,39 @@
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LINEBUF_DEFAULT_CAPACITY (64 * 1024)
+
+typedef struct {
+  const char *data;
+  size_t len;
+} StrView;
+
+/* Ring buffer that frames newline-terminated lines read from a file
+   descriptor. The storage is mapped twice back to back, so a line that wraps
+   around the end of the ring is still contiguous in memory and can be handed
+   out as a view without copying it. Views stay valid until the next call to
+   linebuf_fill(). */
+typedef struct {
+  char *data;
+  size_t capacity;
+  uint64_t head; // First byte not yet handed out as part of a line
+  uint64_t scan; // Where the search for the next newline resumes
+  uint64_t tail; // One past the last byte read from the fd
+} LineBuffer;
+
+int linebuf_init(LineBuffer *lb, size_t capacity);
+void linebuf_free(LineBuffer *lb);
+ssize_t linebuf_fill(LineBuffer *lb, int fd);
+bool linebuf_next(LineBuffer *lb, StrView *line);
+bool linebuf_rest(LineBuffer *lb, StrView *line);
+
+bool sv_starts_with(StrView sv, const char *prefix);
+bool sv_eq(StrView sv, const char *cstr);
+bool sv_next_token(StrView *rest, StrView *token);
+
+#endif
@@ -1,85 +1,369 @@
+#include "analysis.h"
 #include "arena.h"
+#include "batch.h"
+#include "book.h"
+#include "bootstrap.h"
+#include "budget.h"
+#include "cache.h"
 #include "constants.h"
-#include "download.h"
+#include "engine.h"
+#include "evalstore.h"
+#include "metrics.h"
+#include "perft.h"
+#include "pool.h"
+#include "server.h"
+#include "trace.h"
+#include "utils.h"
 #include <curl/curl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <unistd.h>
+#include <strings.h>
 
-static Arena download_arena = {0};
+#define MAX_ENGINE_OPTIONS 32
 
-void send_command(int stdin_fd, int stdout_fd, const char *command,
-                  const char *exit_needle) {
-  dprintf(stdin_fd, "%s\n", command);
+static Arena download_arena = {0};
+static Arena options_arena = {0};
 
-  char buff[512];
-  ssize_t n;
-  while ((n = read(stdout_fd, buff, sizeof(buff) - 1)) > 0) {
-    buff[n] = '\0';
-    printf("Engine says: %s", buff);
+static void print_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [--port N] [--workers N] [--max-workers N] "
+          "[--cache-size MB] [--store-size MB]\n"
+          "          [--mem-budget SIZE] [--book FILE] "
+          "[--option Name=Value]... [--stats]\n"
+          "          [--trace FILE]\n"
+          "       %s --batch|--pgn FILE [--output FILE] "
+          "[--order input|completion] "
+          "[--inflight N]\n"
+          "          [--depth N] [--movetime MS] [--nodes N] [--multipv N] "
+          "[--workers N] ...\n"
+          "       %s --perft DEPTH\n"
+          "  --port N              Port the HTTP API listens on (default: "
+          "%d)\n"
+          "  --workers N           Number of engine processes (default: one "
+          "per group of cores)\n"
+          "  --max-workers N       Let the server start more engines while "
+          "requests queue up,\n"
+          "                        retiring them again once idle (default: "
+          "--workers)\n"
+          "  --cache-size MB       Memory for cached evaluations, 0 disables "
+          "it (default: %d)\n"
+          "  --mem-budget SIZE     Memory for the engines' Hash and the "
+          "cache together, e.g. 24G\n"
+          "  --store-size MB       Size of the persistent evaluation store "
+          "in " EVAL_STORE_FILENAME ", 0 disables it (default: %d)\n"
+          "  --book FILE           Answer positions in this Polyglot book "
+          "without an engine\n"
+          "  --option Name=Value   UCI option applied to every engine at "
+          "startup\n"
+          "  --stats               Print the metrics served at /metrics on "
+          "exit\n"
+          "  --trace FILE          Where SIGUSR2 writes the recent request "
+          "trace (default: " TRACE_DEFAULT_PATH ")\n"
+          "  --batch FILE          Analyze every FEN/EPD line of FILE and "
+          "write JSONL instead of serving HTTP\n"
+          "  --pgn FILE            Like --batch, annotating every move of "
+          "every game in FILE\n"
+          "  --output FILE         Batch output; an interrupted run resumes "
+          "from FILE" BATCH_CHECKPOINT_SUFFIX " (default: stdout)\n"
+          "  --order ORDER         Write results in input or completion "
+          "order (default: input)\n"
+          "  --inflight N          Positions between reading and writing "
+          "(default: %d per engine)\n"
+          "  --depth, --movetime, --nodes, --multipv\n"
+          "                        Search limits for every batch position "
+          "(default: depth %d)\n"
+          "  --perft DEPTH         Check the move generator against known "
+          "node counts and exit\n",
+          program, program, program, SERVER_DEFAULT_PORT, CACHE_DEFAULT_SIZE_MB,
+          EVALSTORE_DEFAULT_SIZE_MB, BATCH_INFLIGHT_PER_ENGINE,
+          ANALYSIS_DEFAULT_DEPTH);
+}
 
-    if (strstr(buff, exit_needle)) {
-      break;
-    }
+static bool parse_engine_option(const char *arg, EngineOption *option) {
+  const char *eq = strchr(arg, '=');
+  if (!eq || eq == arg) {
+    return false;
   }
+
+  char *name = arena_alloc(&options_arena, eq - arg + 1);
+  memcpy(name, arg, eq - arg);
+  name[eq - arg] = '\0';
+
+  option->name = name;
+  option->value = arena_strdup(&options_arena, eq + 1);
+  return true;
 }
 
-int main(void) {
-  if (get_stockfish(&download_arena) == -1) {
-    fprintf(stderr, "Failed to get stockfish engine\n");
-    return -1;
+/* Parses a size such as 512M or 24G into megabytes; a plain number is taken
+   as megabytes. */
+static bool parse_size_mb(const char *arg, size_t *mb) {
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || arg[0] == '-') {
+    return false;
   }
-
-  int stdin_pipe[2]; // Parent writes to [1], child reads from [0]
-  if (pipe(stdin_pipe) == -1) {
-    fprintf(stderr, "Failed creating input pipe\n");
-    return -1;
+  switch (*end) {
+  case 'T':
+  case 't':
+    n <<= 10;
+    // fall through
+  case 'G':
+  case 'g':
+    n <<= 10;
+    // fall through
+  case 'M':
+  case 'm':
+    end++;
+    break;
+  case '\0':
+    break;
+  default:
+    return false;
   }
+  *mb = (size_t)n;
+  return *end == '\0' && n > 0;
+}
 
-  int stdout_pipe[2]; // Child writes to [1], parent reads from [0]
-  if (pipe(stdout_pipe) == -1) {
-    fprintf(stderr, "Failed creating output pipe\n");
-    return -1;
-  }
+static bool parse_count(const char *arg, unsigned long max,
+                        unsigned long *value) {
+  char *end;
+  errno = 0;
+  *value = strtoul(arg, &end, 10);
+  return errno == 0 && *end == '\0' && *value > 0 && *value <= max &&
+         arg[0] != '-';
+}
 
-  pid_t pid = fork();
+int main(int argc, char **argv) {
+  size_t workers = 0; // Follow the number of cores
+  size_t max_workers = 0;
+  uint16_t port = SERVER_DEFAULT_PORT;
+  long cache_mb = CACHE_DEFAULT_SIZE_MB;
+  long store_mb = EVALSTORE_DEFAULT_SIZE_MB;
+  size_t budget_mb = 0;
+  const char *book_path = NULL;
+  const char *trace_path = TRACE_DEFAULT_PATH;
+  bool stats = false;
+  EngineOption options[MAX_ENGINE_OPTIONS];
+  size_t option_count = 0;
+  BatchOptions batch = {0};
+  batch.limits.multipv = 1;
 
-  if (pid == 0) {
-    printf("Calling from child\n");
-    dup2(stdin_pipe[0], STDIN_FILENO);   // Redirect child's input
-    dup2(stdout_pipe[1], STDOUT_FILENO); // Redirect child's output
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      char *end;
+      long n = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || n <= 0 || n > 65535) {
+        fprintf(stderr, "Invalid port: %s\n", argv[i]);
+        return -1;
+      }
+      port = (uint16_t)n;
+    } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+      char *end;
+      cache_mb = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || cache_mb < 0) {
+        fprintf(stderr, "Invalid cache size: %s\n", argv[i]);
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--store-size") == 0 && i + 1 < argc) {
+      char *end;
+      store_mb = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || store_mb < 0) {
+        fprintf(stderr, "Invalid store size: %s\n", argv[i]);
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) {
+      if (!parse_size_mb(argv[++i], &budget_mb)) {
+        fprintf(stderr, "Invalid memory budget: %s\n", argv[i]);
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--perft") == 0 && i + 1 < argc) {
+      unsigned long depth;
+      if (!parse_count(argv[++i], PERFT_MAX_DEPTH, &depth)) {
+        fprintf(stderr, "Invalid perft depth: %s\n", argv[i]);
+        return -1;
+      }
+      return perft_run_suite((int)depth) == 0 ? 0 : 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--book") == 0 && i + 1 < argc) {
+      book_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if ((strcmp(argv[i], "--workers") == 0 ||
+                strcmp(argv[i], "--max-workers") == 0) &&
+               i + 1 < argc) {
+      const char *flag = argv[i++];
+      unsigned long n;
+      if (!parse_count(argv[i], POOL_MAX_ENGINES, &n)) {
+        fprintf(stderr, "Invalid worker count: %s\n", argv[i]);
+        return -1;
+      }
+      if (strcmp(flag, "--workers") == 0) {
+        workers = n;
+      } else {
+        max_workers = n;
+      }
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch.input_path = argv[++i];
+      batch.format = BATCH_FORMAT_EPD;
+    } else if (strcmp(argv[i], "--pgn") == 0 && i + 1 < argc) {
+      batch.input_path = argv[++i];
+      batch.format = BATCH_FORMAT_PGN;
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      batch.output_path = argv[++i];
+    } else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "input") == 0) {
+        batch.order = BATCH_ORDER_INPUT;
+      } else if (strcmp(argv[i], "completion") == 0) {
+        batch.order = BATCH_ORDER_COMPLETION;
+      } else {
+        fprintf(stderr, "Invalid order: %s\n", argv[i]);
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--inflight") == 0 && i + 1 < argc) {
+      unsigned long n;
+      if (!parse_count(argv[++i], 1 << 20, &n)) {
+        fprintf(stderr, "Invalid in-flight limit: %s\n", argv[i]);
+        return -1;
+      }
+      batch.inflight = n;
+    } else if ((strcmp(argv[i], "--depth") == 0 ||
+                strcmp(argv[i], "--movetime") == 0 ||
+                strcmp(argv[i], "--nodes") == 0 ||
+                strcmp(argv[i], "--multipv") == 0) &&
+               i + 1 < argc) {
+      const char *flag = argv[i++];
+      unsigned long n;
+      bool ok;
+      if (strcmp(flag, "--depth") == 0) {
+        ok = parse_count(argv[i], 255, &n);
+        batch.limits.depth = (uint32_t)n;
+      } else if (strcmp(flag, "--movetime") == 0) {
+        ok = parse_count(argv[i], 3600 * 1000, &n);
+        batch.limits.movetime = (uint32_t)n;
+      } else if (strcmp(flag, "--nodes") == 0) {
+        ok = parse_count(argv[i], ULONG_MAX, &n);
+        batch.limits.nodes = n;
+      } else {
+        ok = parse_count(argv[i], UCI_MAX_MULTIPV, &n);
+        batch.limits.multipv = (uint16_t)n;
+      }
+      if (!ok) {
+        fprintf(stderr, "Invalid value for %s: %s\n", flag, argv[i]);
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--option") == 0 && i + 1 < argc) {
+      if (option_count == MAX_ENGINE_OPTIONS) {
+        fprintf(stderr, "Too many engine options (max %d)\n",
+                MAX_ENGINE_OPTIONS);
+        return -1;
+      }
+      if (!parse_engine_option(argv[++i], &options[option_count])) {
+        fprintf(stderr, "Invalid engine option: %s\n", argv[i]);
+        return -1;
+      }
+      option_count++;
+    } else {
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
 
-    close(stdin_pipe[0]);
-    close(stdin_pipe[1]);
-    close(stdout_pipe[0]);
-    close(stdout_pipe[1]);
+  if (!batch.limits.depth && !batch.limits.movetime && !batch.limits.nodes) {
+    batch.limits.depth = ANALYSIS_DEFAULT_DEPTH;
+  }
 
-    char *stockfish_argv[] = {STOCKFISH_EXEC_PATH, NULL};
-    if (execvp(stockfish_argv[0], stockfish_argv) < 0)
-      exit(0);
-  } else {
-    printf("Calling from parent\n");
+  MemoryBudget budget;
+  if (budget_mb > 0) {
+    for (size_t i = 0; i < option_count; i++) {
+      if (strcasecmp(options[i].name, "Hash") == 0) {
+        fprintf(stderr, "--option Hash cannot be combined with --mem-budget, "
+                        "which sizes Hash itself\n");
+        return -1;
+      }
+    }
+    if ((size_t)cache_mb + BUDGET_ENGINE_OVERHEAD_MB + 1 > budget_mb) {
+      fprintf(stderr, "A memory budget of %zu MB does not fit the cache and "
+                      "an engine\n", budget_mb);
+      return -1;
+    }
+    budget_init(&budget, budget_mb, (size_t)cache_mb);
+  }
 
-    // Close unused pipe ends
-    close(stdin_pipe[0]);
-    close(stdout_pipe[1]);
+  // A dead engine or client must surface as EPIPE, not kill the server
+  signal(SIGPIPE, SIG_IGN);
 
-    send_command(stdin_pipe[1], stdout_pipe[0], "uci", "uciok");
+  // The server comes up while the engine is fetched and started; a batch
+  // waits for it below
+  EnginePool pool;
+  Bootstrap bootstrap;
+  if (bootstrap_start(&bootstrap, &pool, workers, max_workers, options,
+                      option_count, budget_mb > 0 ? &budget : NULL,
+                      &download_arena) != 0) {
+    arena_free(&options_arena);
+    return -1;
+  }
 
-    // Set start position
-    dprintf(stdin_pipe[1], "position startpos\n");
+  EvalCache cache;
+  if (cache_mb > 0 && cache_init(&cache, (size_t)cache_mb << 20) != 0) {
+    bootstrap_destroy(&bootstrap);
+    arena_free(&options_arena);
+    return -1;
+  }
 
-    send_command(stdin_pipe[1], stdout_pipe[0], "isready", "readyok");
+  EvalStore store;
+  if (store_mb > 0 && (ensure_directory_exists(".cache") != 0 ||
+                       evalstore_open(&store, EVAL_STORE_FILENAME,
+                                      (size_t)store_mb << 20) != 0)) {
+    fprintf(stderr, "Continuing without the persistent evaluation store\n");
+    store_mb = 0;
+  }
 
-    close(stdin_pipe[1]);
-    close(stdout_pipe[0]);
+  int rc;
+  if (batch.input_path) {
+    rc = bootstrap_wait(&bootstrap) == BOOTSTRAP_READY
+             ? batch_run(&batch, &pool, store_mb > 0 ? &store : NULL)
+             : -1;
+  } else {
+    Book book;
+    Server server;
+    rc = book_path ? book_open(&book, book_path) : 0;
+    if (rc == 0) {
+      rc = server_init(&server, &bootstrap, cache_mb > 0 ? &cache : NULL,
+                       store_mb > 0 ? &store : NULL,
+                       budget_mb > 0 ? &budget : NULL,
+                       book_path ? &book : NULL, trace_path, port);
+    }
+    if (rc == 0) {
+      rc = server_run(&server);
+      server_destroy(&server);
+    }
+    if (book_path) {
+      book_close(&book);
+    }
+  }
 
-    waitpid(pid, NULL, 0);
+  if (store_mb > 0) {
+    evalstore_close(&store);
+  }
+  if (cache_mb > 0) {
+    cache_destroy(&cache);
+  }
+  bootstrap_destroy(&bootstrap);
+  if (stats) {
+    StringBuilder sb = {0};
+    metrics_format(&options_arena, &sb);
+    fwrite(sb.items, 1, sb.count, stderr);
   }
+  arena_free(&options_arena);
+  arena_pool_drain();
 
-  return 0;
+  return rc;
 }
@@ -0,0 +1,215 @@
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+/* Every thread that records anything gets a shard of its own, which only it
+   writes, so recording is a plain load and store without a lock or a locked
+   instruction. Shards are linked into a list once and never freed; a scrape
+   reads them all and adds them up. */
+typedef struct MetricsShard MetricsShard;
+
+struct MetricsShard {
+  _Atomic uint64_t buckets[METRIC_HISTOGRAMS][METRICS_BUCKETS];
+  _Atomic uint64_t sums[METRIC_HISTOGRAMS];
+  _Atomic uint64_t maxima[METRIC_HISTOGRAMS];
+  _Atomic uint64_t counters[METRIC_COUNTERS];
+  MetricsShard *next;
+};
+
+static _Atomic(MetricsShard *) shards;
+static _Thread_local MetricsShard *own_shard;
+
+static const struct {
+  const char *name;
+  const char *help;
+  double scale; // Turns recorded values into the exported unit
+} histograms[METRIC_HISTOGRAMS] = {
+    [METRIC_UCI_HANDSHAKE] = {"stockfish_uci_handshake_seconds",
+                              "Time from uci to uciok", 1e-6},
+    [METRIC_ISREADY] = {"stockfish_isready_seconds",
+                        "Time from isready to readyok", 1e-6},
+    [METRIC_SEARCH] = {"stockfish_search_seconds",
+                       "Time from go to bestmove", 1e-6},
+    [METRIC_ENGINE_NPS] = {"stockfish_engine_nps",
+                           "Nodes per second of finished searches", 1},
+    [METRIC_QUEUE_WAIT] = {"stockfish_queue_wait_seconds",
+                           "Time requests waited for an engine", 1e-6},
+    [METRIC_REQUEST] = {"stockfish_request_seconds",
+                        "Time from a parsed request to its response", 1e-6},
+    [METRIC_DOWNLOAD] = {"stockfish_download_seconds",
+                         "Time spent fetching the engine", 1e-6},
+    [METRIC_EXTRACT] = {"stockfish_extract_seconds",
+                        "Time spent extracting a downloaded tarball", 1e-6},
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} counters[METRIC_COUNTERS] = {
+    [METRIC_REQUESTS] = {"stockfish_requests_total",
+                         "Analysis requests that passed validation"},
+    [METRIC_CACHE_HITS] = {"stockfish_cache_hits_total",
+                           "Requests answered from the in-process cache"},
+    [METRIC_CACHE_MISSES] = {"stockfish_cache_misses_total",
+                             "Requests the in-process cache could not answer"},
+    [METRIC_STORE_HITS] = {"stockfish_store_hits_total",
+                           "Requests answered from the persistent store"},
+    [METRIC_BOOK_HITS] = {"stockfish_book_hits_total",
+                          "Requests answered from the opening book"},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+uint64_t metrics_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static MetricsShard *shard(void) {
+  if (own_shard) {
+    return own_shard;
+  }
+  own_shard = calloc(1, sizeof(*own_shard));
+  if (!own_shard) {
+    return NULL; // Goes unrecorded, and is tried again next time
+  }
+  MetricsShard *head = atomic_load_explicit(&shards, memory_order_relaxed);
+  do {
+    own_shard->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &shards, &head, own_shard, memory_order_release, memory_order_relaxed));
+  return own_shard;
+}
+
+static size_t bucket_index(uint64_t value) {
+  if (value >= 1ULL << METRICS_MAX_VALUE_BITS) {
+    value = (1ULL << METRICS_MAX_VALUE_BITS) - 1;
+  }
+  if (value < METRICS_SUB_BUCKETS) {
+    return (size_t)value;
+  }
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - METRICS_SUB_BUCKET_BITS;
+  return ((size_t)(shift + 1) << METRICS_SUB_BUCKET_BITS) +
+         (size_t)(value >> shift) - METRICS_SUB_BUCKETS;
+}
+
+// The middle of the values a bucket holds
+static double bucket_value(size_t index) {
+  if (index < METRICS_SUB_BUCKETS) {
+    return (double)index;
+  }
+  int shift = (int)(index >> METRICS_SUB_BUCKET_BITS) - 1;
+  uint64_t sub = (index & (METRICS_SUB_BUCKETS - 1)) + METRICS_SUB_BUCKETS;
+  return (double)(sub << shift) + ((1ULL << shift) - 1) / 2.0;
+}
+
+static void bump(_Atomic uint64_t *value, uint64_t by) {
+  atomic_store_explicit(
+      value, atomic_load_explicit(value, memory_order_relaxed) + by,
+      memory_order_relaxed);
+}
+
+void metrics_record(MetricHistogram histogram, uint64_t value) {
+  MetricsShard *s = shard();
+  if (!s) {
+    return;
+  }
+  bump(&s->buckets[histogram][bucket_index(value)], 1);
+  bump(&s->sums[histogram], value);
+  if (value > atomic_load_explicit(&s->maxima[histogram],
+                                   memory_order_relaxed)) {
+    atomic_store_explicit(&s->maxima[histogram], value, memory_order_relaxed);
+  }
+}
+
+void metrics_count(MetricCounter counter) {
+  MetricsShard *s = shard();
+  if (s) {
+    bump(&s->counters[counter], 1);
+  }
+}
+
+static void format_histogram(Arena *arena, StringBuilder *sb,
+                             MetricHistogram histogram) {
+  uint64_t merged[METRICS_BUCKETS] = {0};
+  uint64_t count = 0, sum = 0, max = 0;
+  for (MetricsShard *s = atomic_load_explicit(&shards, memory_order_acquire);
+       s; s = s->next) {
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+      uint64_t n =
+          atomic_load_explicit(&s->buckets[histogram][i], memory_order_relaxed);
+      merged[i] += n;
+      count += n;
+    }
+    sum += atomic_load_explicit(&s->sums[histogram], memory_order_relaxed);
+    uint64_t shard_max =
+        atomic_load_explicit(&s->maxima[histogram], memory_order_relaxed);
+    max = shard_max > max ? shard_max : max;
+  }
+
+  const char *name = histograms[histogram].name;
+  double scale = histograms[histogram].scale;
+  sb_appendf(arena, sb, "# HELP %s %s\n# TYPE %s summary\n", name,
+             histograms[histogram].help, name);
+  size_t bucket = 0;
+  uint64_t seen = 0;
+  for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+    double value = 0;
+    if (count > 0) {
+      uint64_t rank = (uint64_t)(quantiles[q] * (double)count + 0.5);
+      rank = rank < 1 ? 1 : rank;
+      while (seen + merged[bucket] < rank) {
+        seen += merged[bucket++];
+      }
+      value = bucket_value(bucket);
+      value = value > (double)max ? (double)max : value;
+    }
+    sb_appendf(arena, sb, "%s{quantile=\"%g\"} %g\n", name, quantiles[q],
+               value * scale);
+  }
+  sb_appendf(arena, sb, "%s_sum %g\n%s_count %llu\n", name,
+             (double)sum * scale, name, (unsigned long long)count);
+}
+
+/* Writes every metric in the Prometheus text format. Histograms become
+   summaries, since the quantiles are what the buckets are kept for. */
+void metrics_format(Arena *arena, StringBuilder *sb) {
+  for (int i = 0; i < METRIC_COUNTERS; i++) {
+    uint64_t total = 0;
+    for (MetricsShard *s = atomic_load_explicit(&shards, memory_order_acquire);
+         s; s = s->next) {
+      total += atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+    }
+    sb_appendf(arena, sb, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+               counters[i].name, counters[i].help, counters[i].name,
+               counters[i].name, (unsigned long long)total);
+  }
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+    format_histogram(arena, sb, (MetricHistogram)i);
+  }
+
+  Arena_Stats stats;
+  arena_stats(&stats);
+  sb_appendf(arena, sb,
+             "# HELP stockfish_arena_bytes Memory held by request arenas\n"
+             "# TYPE stockfish_arena_bytes gauge\n"
+             "stockfish_arena_bytes %zu\n"
+             "# HELP stockfish_arena_high_water_bytes Most memory request "
+             "arenas ever held at once\n"
+             "# TYPE stockfish_arena_high_water_bytes gauge\n"
+             "stockfish_arena_high_water_bytes %zu\n"
+             "# HELP stockfish_arena_regions_total Arena regions handed out, "
+             "by where they came from\n"
+             "# TYPE stockfish_arena_regions_total counter\n"
+             "stockfish_arena_regions_total{source=\"pool\"} %zu\n"
+             "stockfish_arena_regions_total{source=\"system\"} %zu\n",
+             stats.in_use, stats.high_water, stats.pool_hits,
+             stats.pool_misses);
+}
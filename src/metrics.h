@@ -0,0 +1,44 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "arena.h"
+#include "utils.h"
+#include <stdint.h>
+
+/* Values are kept in log-linear buckets: exact below 16, then 16 buckets per
+   power of two, so any recorded value is known to within 1/16. Values of
+   METRICS_MAX_VALUE and above land in the last bucket. */
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_MAX_VALUE_BITS 40
+#define METRICS_BUCKETS                                                        \
+  ((METRICS_MAX_VALUE_BITS - METRICS_SUB_BUCKET_BITS + 1)                      \
+   << METRICS_SUB_BUCKET_BITS)
+
+// Durations are recorded in microseconds
+typedef enum {
+  METRIC_UCI_HANDSHAKE, // uci until uciok
+  METRIC_ISREADY,       // isready until readyok
+  METRIC_SEARCH,        // go until bestmove
+  METRIC_ENGINE_NPS,    // Nodes per second of every finished search
+  METRIC_QUEUE_WAIT,    // Request queued until an engine took it
+  METRIC_REQUEST,       // Request parsed until its response was queued
+  METRIC_DOWNLOAD,      // Fetching the engine, with extraction if streamed
+  METRIC_EXTRACT,       // Extracting a completely downloaded tarball
+  METRIC_HISTOGRAMS
+} MetricHistogram;
+
+typedef enum {
+  METRIC_REQUESTS,
+  METRIC_CACHE_HITS,
+  METRIC_CACHE_MISSES,
+  METRIC_STORE_HITS,
+  METRIC_BOOK_HITS,
+  METRIC_COUNTERS
+} MetricCounter;
+
+uint64_t metrics_now_us(void);
+void metrics_record(MetricHistogram histogram, uint64_t value);
+void metrics_count(MetricCounter counter);
+void metrics_format(Arena *arena, StringBuilder *sb);
+
+#endif
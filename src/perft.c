@@ -0,0 +1,85 @@
+#include "perft.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Positions with published node counts that between them reach castling,
+   en passant, promotions and discovered and double checks. */
+static const struct {
+  const char *fen;
+  uint64_t nodes[PERFT_MAX_DEPTH];
+} suite[] = {
+    {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+     {20, 400, 8902, 197281, 4865609, 119060324}},
+    {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+     {48, 2039, 97862, 4085603, 193690690, 8031647685}},
+    {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+     {14, 191, 2812, 43238, 674624, 11030083}},
+    {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+     {6, 264, 9467, 422333, 15833292, 706045033}},
+    {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+     {44, 1486, 62379, 2103487, 89941194, 0}},
+    {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 "
+     "10",
+     {46, 2079, 89890, 3894594, 164075551, 6923051137}},
+};
+
+/* Counts the leaf nodes depth plies down. Along the way every incrementally
+   updated key is checked against one computed from scratch; a mismatch is
+   reported and counted as zero nodes so the totals cannot match either. */
+uint64_t perft(Position *pos, int depth) {
+  uint16_t moves[POSITION_MAX_MOVES];
+  size_t count = position_legal_moves(pos, moves);
+  if (depth == 1) {
+    return count;
+  }
+
+  uint64_t nodes = 0;
+  for (size_t i = 0; i < count; i++) {
+    Position after = *pos;
+    position_make_move(&after, moves[i]);
+    if (after.key != position_compute_key(&after)) {
+      char fen[POSITION_FEN_SIZE];
+      position_to_fen(&after, fen);
+      fprintf(stderr, "Incremental key mismatch after %s\n", fen);
+      return 0;
+    }
+    nodes += perft(&after, depth - 1);
+  }
+  return nodes;
+}
+
+/* Runs every suite position to depth, or as deep as its published counts
+   go, and returns the number of positions that came out wrong. */
+int perft_run_suite(int depth) {
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(suite) / sizeof(suite[0]); i++) {
+    Position pos;
+    int d = depth;
+    while (d > 1 && suite[i].nodes[d - 1] == 0) {
+      d--;
+    }
+    if (!position_from_fen(&pos, suite[i].fen)) {
+      fprintf(stderr, "perft: cannot parse %s\n", suite[i].fen);
+      failures++;
+      continue;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t nodes = perft(&pos, d);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    bool ok = nodes == suite[i].nodes[d - 1];
+    printf("%s depth %d: %llu nodes (%.0f/s) %s\n", suite[i].fen, d,
+           (unsigned long long)nodes, seconds > 0 ? nodes / seconds : 0.0,
+           ok ? "ok" : "FAILED");
+    if (!ok) {
+      printf("  expected %llu\n", (unsigned long long)suite[i].nodes[d - 1]);
+      failures++;
+    }
+  }
+  return failures;
+}
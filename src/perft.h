@@ -0,0 +1,12 @@
+#ifndef PERFT_H
+#define PERFT_H
+
+#include "position.h"
+#include <stdint.h>
+
+#define PERFT_MAX_DEPTH 6
+
+uint64_t perft(Position *pos, int depth);
+int perft_run_suite(int depth);
+
+#endif
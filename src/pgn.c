@@ -0,0 +1,180 @@
+#include "pgn.h"
+#include "arena.h"
+#include "linebuf.h"
+#include <string.h>
+
+static const char *const results[] = {"1-0", "0-1", "1/2-1/2", "*"};
+
+static bool is_result(StrView token) {
+  for (size_t i = 0; i < sizeof(results) / sizeof(results[0]); i++) {
+    if (sv_eq(token, results[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Returns true when line completes a game: either its movetext ends with a
+   termination marker or a blank line follows the movetext. */
+bool pgn_split_line(PgnSplitter *splitter, StrView line) {
+  StrView rest = line, token;
+  if (!sv_next_token(&rest, &token)) {
+    bool done = splitter->in_movetext && splitter->comment_depth == 0;
+    if (done) {
+      splitter->in_movetext = false;
+    }
+    return done;
+  }
+  if (splitter->comment_depth == 0 &&
+      (token.data[0] == '%' ||
+       (token.data[0] == '[' && !splitter->in_movetext))) {
+    return false;
+  }
+
+  splitter->in_movetext = true;
+  bool last_is_result = false;
+  for (size_t i = 0; i < line.len; i++) {
+    char c = line.data[i];
+    if (splitter->comment_depth > 0) {
+      splitter->comment_depth = c != '}';
+      continue;
+    }
+    if (c == '{') {
+      splitter->comment_depth = 1;
+    } else if (c == ';') {
+      break;
+    }
+  }
+
+  // Only a marker outside of comments ends the game
+  if (splitter->comment_depth == 0) {
+    rest = line;
+    while (sv_next_token(&rest, &token)) {
+      last_is_result = is_result(token);
+    }
+  }
+  if (last_is_result) {
+    splitter->in_movetext = false;
+  }
+  return last_is_result;
+}
+
+static const char *parse_tag(Arena *arena, const char **p, const char *end,
+                             PgnTag *tag) {
+  const char *s = *p + 1;
+  const char *name = s;
+  while (s < end && *s != ' ' && *s != '"' && *s != ']') {
+    s++;
+  }
+  size_t name_len = s - name;
+  while (s < end && *s == ' ') {
+    s++;
+  }
+  if (s == end || *s != '"' || name_len == 0) {
+    return NULL;
+  }
+
+  char *value = arena_alloc(arena, end - s);
+  size_t len = 0;
+  for (s++; s < end && *s != '"'; s++) {
+    if (*s == '\\' && s + 1 < end) {
+      s++;
+    }
+    value[len++] = *s;
+  }
+  value[len] = '\0';
+  while (s < end && *s != ']' && *s != '\n') {
+    s++;
+  }
+  *p = s;
+
+  char *copy = arena_alloc(arena, name_len + 1);
+  memcpy(copy, name, name_len);
+  copy[name_len] = '\0';
+  tag->name = copy;
+  tag->value = value;
+  return copy;
+}
+
+/* Parses one game cut out by pgn_split_line(). Moves point into text, which
+   must outlive the game. */
+bool pgn_parse_game(Arena *arena, const char *text, size_t len,
+                    PgnGame *game) {
+  struct {
+    PgnTag *items;
+    size_t count, capacity;
+  } tags = {0};
+  struct {
+    StrView *items;
+    size_t count, capacity;
+  } moves = {0};
+  const char *p = text, *end = text + len;
+  int variation_depth = 0;
+
+  game->result = "*";
+  for (; p < end; p++) {
+    char c = *p;
+    if (c == '{') {
+      const char *close = memchr(p, '}', end - p);
+      p = close ? close : end;
+    } else if (c == ';' || (c == '%' && (p == text || p[-1] == '\n'))) {
+      const char *nl = memchr(p, '\n', end - p);
+      p = nl ? nl : end;
+    } else if (c == '(') {
+      variation_depth++;
+    } else if (c == ')') {
+      variation_depth -= variation_depth > 0;
+    } else if (c == '[' && variation_depth == 0 && moves.count == 0) {
+      PgnTag tag;
+      if (!parse_tag(arena, &p, end, &tag)) {
+        return false;
+      }
+      arena_da_append(arena, &tags, tag);
+    } else if (c != ' ' && c != '\t' && c != '\r' && c != '\n' &&
+               variation_depth == 0) {
+      const char *start = p;
+      while (p + 1 < end && !strchr(" \t\r\n{}();[", p[1])) {
+        p++;
+      }
+      StrView token = {start, p - start + 1};
+
+      if (token.data[0] == '$') {
+        continue; // NAG
+      }
+      if (is_result(token)) {
+        char *result = arena_alloc(arena, token.len + 1);
+        memcpy(result, token.data, token.len);
+        result[token.len] = '\0';
+        game->result = result;
+        break;
+      }
+      // Strip a move number, which may be glued to the move ("12.e4")
+      size_t digits = strspn(token.data, "0123456789");
+      if (digits < token.len && token.data[digits] == '.') {
+        while (digits < token.len && token.data[digits] == '.') {
+          digits++;
+        }
+        token.data += digits;
+        token.len -= digits;
+      }
+      if (token.len > 0) {
+        arena_da_append(arena, &moves, token);
+      }
+    }
+  }
+
+  game->tags = tags.items;
+  game->tag_count = tags.count;
+  game->moves = moves.items;
+  game->move_count = moves.count;
+  return true;
+}
+
+const char *pgn_tag(const PgnGame *game, const char *name) {
+  for (size_t i = 0; i < game->tag_count; i++) {
+    if (strcmp(game->tags[i].name, name) == 0) {
+      return game->tags[i].value;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef PGN_H
+#define PGN_H
+
+#include "arena.h"
+#include "linebuf.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+  const char *name;
+  const char *value;
+} PgnTag;
+
+/* One game with its tags and main line moves in SAN. Comments, variations,
+   NAGs and move numbers are dropped. */
+typedef struct {
+  PgnTag *tags;
+  size_t tag_count;
+  StrView *moves;
+  size_t move_count;
+  const char *result; // Termination marker, "*" if the game had none
+} PgnGame;
+
+/* Finds game boundaries in a PGN file fed one line at a time, so games can
+   be cut out of a stream without parsing them. */
+typedef struct {
+  bool in_movetext;
+  int comment_depth;
+} PgnSplitter;
+
+bool pgn_split_line(PgnSplitter *splitter, StrView line);
+bool pgn_parse_game(Arena *arena, const char *text, size_t len,
+                    PgnGame *game);
+const char *pgn_tag(const PgnGame *game, const char *name);
+
+#endif
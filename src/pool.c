@@ -0,0 +1,298 @@
+#include "pool.h"
+#include "engine.h"
+#include "layout.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/wait.h>
+
+/* Re-reads the CPU topology, which a cpuset or taskset can change while the
+   process runs, and works out min_size and max_size from the configured
+   sizes. By default there is one engine per layout slot, and without a
+   --max-workers the pool stays at its minimum size. */
+void pool_update_limits(EnginePool *pool) {
+  layout_init(&pool->layout, pool->layout.threads);
+
+  size_t min = pool->workers ? pool->workers : pool->layout.slot_count;
+  size_t max = pool->max_workers ? pool->max_workers : min;
+  if (min > POOL_MAX_ENGINES) {
+    min = POOL_MAX_ENGINES;
+  }
+  if (max > POOL_MAX_ENGINES) {
+    max = POOL_MAX_ENGINES;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->min_size = min;
+  pool->max_size = max > min ? max : min;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static bool has_option(const EnginePool *pool, const char *name) {
+  for (size_t i = 0; i < pool->option_count; i++) {
+    if (strcasecmp(pool->options[i].name, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Queues the configured options, then Threads and Hash from the layout
+   unless they were configured as well. */
+static int queue_options(EnginePool *pool, Engine *engine) {
+  for (size_t i = 0; i < pool->option_count; i++) {
+    if (engine_queue_option(engine, &pool->options[i]) != 0) {
+      return -1;
+    }
+  }
+
+  char threads[32], hash[32];
+  snprintf(threads, sizeof(threads), "%zu", pool->layout.threads);
+  snprintf(hash, sizeof(hash), "%zu", pool->hash_mb);
+  EngineOption layout_options[] = {{"Threads", threads}, {"Hash", hash}};
+  for (size_t i = 0; i < 2; i++) {
+    if (!has_option(pool, layout_options[i].name) &&
+        engine_queue_option(engine, &layout_options[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static const CpuSet *slot_cpus(const EnginePool *pool, size_t index) {
+  if (pool->layout.slot_count == 0) {
+    return NULL;
+  }
+  return &pool->layout.slots[index % pool->layout.slot_count];
+}
+
+/* Every engine is spawned first and the handshake is pipelined across all of
+   them, so startup costs one engine initialisation instead of N. */
+int pool_init(EnginePool *pool, size_t workers, size_t max_workers,
+              const char *path, const EngineOption *options,
+              size_t option_count, EngineLayout *layout,
+              const MemoryBudget *budget) {
+  memset(pool, 0, sizeof(*pool));
+  pool->layout = *layout;
+  memset(layout, 0, sizeof(*layout));
+  pool->workers = workers;
+  pool->max_workers = max_workers;
+  pool->options = options;
+  pool->option_count = option_count;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->available, NULL);
+  pool_update_limits(pool);
+  pool->hash_mb = budget ? budget_engine_hash(budget, pool->min_size)
+                         : pool->layout.hash_mb;
+
+  pool->engines = calloc(POOL_MAX_ENGINES, sizeof(*pool->engines));
+  pool->idle = calloc(POOL_MAX_ENGINES, sizeof(*pool->idle));
+  pool->path = strdup(path);
+  if (!pool->engines || !pool->idle || !pool->path) {
+    fprintf(stderr, "Failed to allocate a pool of %zu engines\n",
+            pool->max_size);
+    pool_destroy(pool);
+    return -1;
+  }
+
+  size_t size = pool->min_size;
+  for (size_t i = 0; i < size; i++) {
+    if (engine_spawn(&pool->engines[i], path, slot_cpus(pool, i), false) !=
+        0) {
+      pool_destroy(pool);
+      return -1;
+    }
+    pool->size++;
+
+    if (engine_send(&pool->engines[i], "uci") != 0) {
+      pool_destroy(pool);
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    Engine *engine = &pool->engines[i];
+    if (engine_wait_for(engine, "uciok") != 0) {
+      pool_destroy(pool);
+      return -1;
+    }
+
+    if (queue_options(pool, engine) != 0 ||
+        engine_send(engine, "isready") != 0) {
+      pool_destroy(pool);
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    if (engine_wait_for(&pool->engines[i], "readyok") != 0) {
+      pool_destroy(pool);
+      return -1;
+    }
+    pool->idle[pool->idle_count++] = i;
+  }
+
+  return 0;
+}
+
+Engine *pool_acquire(EnginePool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->idle_count == 0) {
+    pthread_cond_wait(&pool->available, &pool->lock);
+  }
+  Engine *engine = &pool->engines[pool->idle[--pool->idle_count]];
+  pthread_mutex_unlock(&pool->lock);
+
+  return engine;
+}
+
+Engine *pool_try_acquire(EnginePool *pool) {
+  Engine *engine = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->idle_count > 0) {
+    engine = &pool->engines[pool->idle[--pool->idle_count]];
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return engine;
+}
+
+/* Takes a specific engine off the idle stack. Returns false if it is leased
+   out. */
+bool pool_take(EnginePool *pool, Engine *engine) {
+  size_t index = (size_t)(engine - pool->engines);
+  bool taken = false;
+
+  pthread_mutex_lock(&pool->lock);
+  for (size_t i = 0; i < pool->idle_count; i++) {
+    if (pool->idle[i] == index) {
+      pool->idle[i] = pool->idle[--pool->idle_count];
+      taken = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return taken;
+}
+
+void pool_release(EnginePool *pool, Engine *engine) {
+  pthread_mutex_lock(&pool->lock);
+  pool->idle[pool->idle_count++] = (size_t)(engine - pool->engines);
+  pthread_cond_signal(&pool->available);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Starts one more engine in a free entry and queues its handshake without
+   waiting for it. The engine is leased to the caller, who flushes the
+   handshake and releases the engine once readyok arrives. */
+Engine *pool_spawn(EnginePool *pool) {
+  Engine *engine = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  for (size_t i = 0; i < POOL_MAX_ENGINES && pool->size < pool->max_size;
+       i++) {
+    if (pool->engines[i].pid == 0) {
+      engine = &pool->engines[i];
+      break;
+    }
+  }
+  if (engine && engine_spawn(engine, pool->path,
+                             slot_cpus(pool, (size_t)(engine - pool->engines)),
+                             false) == 0) {
+    pool->size++;
+  } else {
+    engine = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!engine) {
+    return NULL;
+  }
+
+  if (engine_queue(engine, "uci") != 0 || queue_options(pool, engine) != 0 ||
+      engine_queue(engine, "isready") != 0) {
+    pool_retire(pool, engine);
+    return NULL;
+  }
+  return engine;
+}
+
+/* Shuts down an engine that is leased to the caller and frees its entry.
+   Its process is left to pool_reap, so the caller never waits on it. */
+void pool_retire(EnginePool *pool, Engine *engine) {
+  pid_t pid = engine_quit(engine);
+  memset(engine, 0, sizeof(*engine));
+
+  pthread_mutex_lock(&pool->lock);
+  pool->size--;
+  if (pid > 0 && pool->exiting_count < POOL_MAX_ENGINES) {
+    pool->exiting[pool->exiting_count++] = (ExitingEngine){pid, 0};
+    pid = 0;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (pid > 0) {
+    // No room to wait for it in the background
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+/* Reaps retired engines that have exited, without blocking. One that is
+   still running POOL_EXIT_TIMEOUT_MS after it was first seen here is
+   killed. Returns how many are left. */
+size_t pool_reap(EnginePool *pool, uint64_t now_ms) {
+  pthread_mutex_lock(&pool->lock);
+  size_t i = 0;
+  while (i < pool->exiting_count) {
+    ExitingEngine *exiting = &pool->exiting[i];
+    pid_t rc = waitpid(exiting->pid, NULL, WNOHANG);
+    if (rc == exiting->pid || (rc == -1 && errno == ECHILD)) {
+      *exiting = pool->exiting[--pool->exiting_count];
+      continue;
+    }
+    if (!exiting->kill_at_ms) {
+      exiting->kill_at_ms = now_ms + POOL_EXIT_TIMEOUT_MS;
+    } else if (now_ms >= exiting->kill_at_ms) {
+      fprintf(stderr, "Engine %d did not quit; killing it\n",
+              (int)exiting->pid);
+      kill(exiting->pid, SIGKILL);
+    }
+    i++;
+  }
+  size_t left = pool->exiting_count;
+  pthread_mutex_unlock(&pool->lock);
+  return left;
+}
+
+void pool_destroy(EnginePool *pool) {
+  for (size_t i = 0; pool->engines && i < POOL_MAX_ENGINES; i++) {
+    engine_close(&pool->engines[i]);
+  }
+  // Retired engines have had their chance to quit by now
+  for (size_t i = 0; i < pool->exiting_count; i++) {
+    pid_t pid = pool->exiting[i].pid;
+    if (waitpid(pid, NULL, WNOHANG) == 0) {
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+    }
+  }
+  pool->exiting_count = 0;
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->available);
+
+  free(pool->engines);
+  free(pool->idle);
+  free(pool->path);
+  layout_free(&pool->layout);
+  pool->engines = NULL;
+  pool->idle = NULL;
+  pool->path = NULL;
+  pool->size = 0;
+  pool->idle_count = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "budget.h"
+#include "engine.h"
+#include "layout.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_MAX_ENGINES 256
+#define POOL_EXIT_TIMEOUT_MS 2000 // Time a retired engine has to quit
+
+/* A retired engine's process, which is reaped once it exits. */
+typedef struct {
+  pid_t pid;
+  uint64_t kill_at_ms; // 0 until pool_reap first sees it
+} ExitingEngine;
+
+typedef struct {
+  Engine *engines; // POOL_MAX_ENGINES entries; a pid of 0 marks a free one
+  size_t size;     // Running engines, including ones still starting up
+  size_t min_size; // The pool may grow from min_size up to max_size
+  size_t max_size;
+  size_t workers; // Configured sizes; 0 follows the layout
+  size_t max_workers;
+  size_t *idle; // Stack of indices into engines that are not leased out
+  size_t idle_count;
+  char *path;
+  EngineLayout layout; // Where each engine runs and its Threads
+  size_t hash_mb;      // Hash for engines started from now on
+  const EngineOption *options;
+  size_t option_count;
+  ExitingEngine exiting[POOL_MAX_ENGINES];
+  size_t exiting_count;
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+} EnginePool;
+
+void pool_update_limits(EnginePool *pool);
+int pool_init(EnginePool *pool, size_t workers, size_t max_workers,
+              const char *path, const EngineOption *options,
+              size_t option_count, EngineLayout *layout,
+              const MemoryBudget *budget);
+Engine *pool_acquire(EnginePool *pool);
+Engine *pool_try_acquire(EnginePool *pool);
+bool pool_take(EnginePool *pool, Engine *engine);
+void pool_release(EnginePool *pool, Engine *engine);
+Engine *pool_spawn(EnginePool *pool);
+void pool_retire(EnginePool *pool, Engine *engine);
+size_t pool_reap(EnginePool *pool, uint64_t now_ms);
+void pool_destroy(EnginePool *pool);
+
+#endif
@@ -0,0 +1,644 @@
+#include "position.h"
+#include "linebuf.h"
+#include "uci.h"
+#include "zobrist.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_OF(sq) ((sq) & 7)
+#define RANK_OF(sq) ((sq) >> 3)
+#define BIT(sq) (1ULL << (sq))
+#define RANK_1 0x00000000000000ffULL
+#define RANK_8 0xff00000000000000ULL
+
+/* Ray directions; the first four run towards higher squares, so the nearest
+   blocker on them is the lowest set bit. */
+enum { NORTH, NORTH_EAST, EAST, NORTH_WEST, SOUTH, SOUTH_WEST, WEST,
+       SOUTH_EAST };
+static const int directions[8][2] = {{0, 1},  {1, 1},   {1, 0},  {-1, 1},
+                                     {0, -1}, {-1, -1}, {-1, 0}, {1, -1}};
+static const int rook_directions[4] = {NORTH, EAST, SOUTH, WEST};
+static const int bishop_directions[4] = {NORTH_EAST, NORTH_WEST, SOUTH_WEST,
+                                         SOUTH_EAST};
+
+static uint64_t rays[8][64];
+static uint64_t knight_attacks[64];
+static uint64_t king_attacks[64];
+static uint64_t pawn_attacks[2][64]; // Squares a pawn of a color on sq takes
+static uint8_t castling_kept[64];    // Rights left after a move touching sq
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static int offset(int sq, int df, int dr) {
+  int file = FILE_OF(sq) + df, rank = RANK_OF(sq) + dr;
+  if (file < 0 || file > 7 || rank < 0 || rank > 7) {
+    return -1;
+  }
+  return rank * 8 + file;
+}
+
+static void init_tables(void) {
+  static const int knight_steps[8][2] = {{1, 2},   {2, 1},   {2, -1},
+                                         {1, -2},  {-1, -2}, {-2, -1},
+                                         {-2, 1},  {-1, 2}};
+  for (int sq = 0; sq < 64; sq++) {
+    for (int i = 0; i < 8; i++) {
+      int to = sq;
+      while ((to = offset(to, directions[i][0], directions[i][1])) >= 0) {
+        rays[i][sq] |= BIT(to);
+      }
+      if ((to = offset(sq, directions[i][0], directions[i][1])) >= 0) {
+        king_attacks[sq] |= BIT(to);
+      }
+      if ((to = offset(sq, knight_steps[i][0], knight_steps[i][1])) >= 0) {
+        knight_attacks[sq] |= BIT(to);
+      }
+    }
+    for (int df = -1; df <= 1; df += 2) {
+      int to;
+      if ((to = offset(sq, df, 1)) >= 0) {
+        pawn_attacks[WHITE][sq] |= BIT(to);
+      }
+      if ((to = offset(sq, df, -1)) >= 0) {
+        pawn_attacks[BLACK][sq] |= BIT(to);
+      }
+    }
+    castling_kept[sq] = CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN |
+                        CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN;
+  }
+  castling_kept[0] &= ~CASTLE_WHITE_QUEEN;
+  castling_kept[7] &= ~CASTLE_WHITE_KING;
+  castling_kept[4] &= ~(CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN);
+  castling_kept[56] &= ~CASTLE_BLACK_QUEEN;
+  castling_kept[63] &= ~CASTLE_BLACK_KING;
+  castling_kept[60] &= ~(CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN);
+}
+
+static int lowest(uint64_t bb) { return __builtin_ctzll(bb); }
+
+static int pop_lowest(uint64_t *bb) {
+  int sq = lowest(*bb);
+  *bb &= *bb - 1;
+  return sq;
+}
+
+static uint64_t ray_attacks(int dir, int sq, uint64_t occupied) {
+  uint64_t ray = rays[dir][sq];
+  uint64_t blockers = ray & occupied;
+  if (blockers) {
+    int blocker = dir < SOUTH ? lowest(blockers) : 63 - __builtin_clzll(blockers);
+    ray ^= rays[dir][blocker];
+  }
+  return ray;
+}
+
+static uint64_t slider_attacks(const int dirs[4], int sq, uint64_t occupied) {
+  uint64_t attacks = 0;
+  for (int i = 0; i < 4; i++) {
+    attacks |= ray_attacks(dirs[i], sq, occupied);
+  }
+  return attacks;
+}
+
+static uint64_t pieces_of(const Position *pos, int color, int type) {
+  return pos->by_color[color] & pos->by_type[type];
+}
+
+static bool attacked(const Position *pos, int sq, int by) {
+  uint64_t occupied = pos->by_type[PIECE_NONE];
+  uint64_t queens = pieces_of(pos, by, QUEEN);
+  return (pawn_attacks[!by][sq] & pieces_of(pos, by, PAWN)) ||
+         (knight_attacks[sq] & pieces_of(pos, by, KNIGHT)) ||
+         (king_attacks[sq] & pieces_of(pos, by, KING)) ||
+         (slider_attacks(bishop_directions, sq, occupied) &
+          (pieces_of(pos, by, BISHOP) | queens)) ||
+         (slider_attacks(rook_directions, sq, occupied) &
+          (pieces_of(pos, by, ROOK) | queens));
+}
+
+static int piece_index(uint8_t piece) {
+  return PIECE_COLOR(piece) * 6 + PIECE_TYPE(piece) - PAWN;
+}
+
+static uint64_t castling_key(const ZobristKeys *keys, uint8_t castling) {
+  uint64_t key = 0;
+  for (int i = 0; i < 4; i++) {
+    if (castling & (1 << i)) {
+      key ^= keys->castling[i];
+    }
+  }
+  return key;
+}
+
+static void put_piece(Position *pos, int sq, uint8_t piece) {
+  pos->squares[sq] = piece;
+  pos->by_type[PIECE_NONE] |= BIT(sq);
+  pos->by_type[PIECE_TYPE(piece)] |= BIT(sq);
+  pos->by_color[PIECE_COLOR(piece)] |= BIT(sq);
+  pos->key ^= zobrist_keys()->pieces[piece_index(piece)][sq];
+}
+
+static void remove_piece(Position *pos, int sq) {
+  uint8_t piece = pos->squares[sq];
+  pos->squares[sq] = PIECE_NONE;
+  pos->by_type[PIECE_NONE] &= ~BIT(sq);
+  pos->by_type[PIECE_TYPE(piece)] &= ~BIT(sq);
+  pos->by_color[PIECE_COLOR(piece)] &= ~BIT(sq);
+  pos->key ^= zobrist_keys()->pieces[piece_index(piece)][sq];
+}
+
+/* Whether a pawn of the side to move could take en passant on sq, which the
+   opponent's pawn just skipped. Otherwise the square is not recorded, so it
+   cannot split otherwise equal positions. */
+static bool can_take_en_passant(const Position *pos, int sq) {
+  return pawn_attacks[!pos->side][sq] & pieces_of(pos, pos->side, PAWN);
+}
+
+uint64_t position_compute_key(const Position *pos) {
+  const ZobristKeys *keys = zobrist_keys();
+  uint64_t key = castling_key(keys, pos->castling);
+  for (int sq = 0; sq < 64; sq++) {
+    if (pos->squares[sq] != PIECE_NONE) {
+      key ^= keys->pieces[piece_index(pos->squares[sq])][sq];
+    }
+  }
+  if (pos->ep_square != SQUARE_NONE) {
+    key ^= keys->en_passant[FILE_OF(pos->ep_square)];
+  }
+  if (pos->side == WHITE) {
+    key ^= keys->side;
+  }
+  return key;
+}
+
+/* Rights are only kept while the king and the rook still stand where they
+   started. */
+static uint8_t possible_castling(const Position *pos) {
+  static const struct {
+    uint8_t right;
+    uint8_t color;
+    uint8_t king;
+    uint8_t rook;
+  } homes[4] = {{CASTLE_WHITE_KING, WHITE, 4, 7},
+                {CASTLE_WHITE_QUEEN, WHITE, 4, 0},
+                {CASTLE_BLACK_KING, BLACK, 60, 63},
+                {CASTLE_BLACK_QUEEN, BLACK, 60, 56}};
+  uint8_t castling = 0;
+  for (int i = 0; i < 4; i++) {
+    if ((pos->castling & homes[i].right) &&
+        pos->squares[homes[i].king] == PIECE_MAKE(homes[i].color, KING) &&
+        pos->squares[homes[i].rook] == PIECE_MAKE(homes[i].color, ROOK)) {
+      castling |= homes[i].right;
+    }
+  }
+  return castling;
+}
+
+static bool parse_counter(const char **p, uint16_t *value) {
+  if (**p != ' ') {
+    return true; // Left out
+  }
+  char *end;
+  const char *digits = *p + 1;
+  unsigned long n = strtoul(digits, &end, 10);
+  if (end == digits || *digits < '0' || *digits > '9' || n > UINT16_MAX) {
+    return false;
+  }
+  *value = (uint16_t)n;
+  *p = end;
+  return true;
+}
+
+/* Parses and checks a FEN: one king per side, at most 16 pieces and 8 pawns
+   a side, no pawns on the first or last rank and no capture of the king
+   possible. Castling rights and en passant squares that could not be used
+   are dropped rather than rejected, so every position has a single form. */
+bool position_from_fen(Position *pos, const char *fen) {
+  static const char pieces[] = " pnbrqk";
+  static const char rights[] = "KQkq";
+  pthread_once(&tables_once, init_tables);
+  memset(pos, 0, sizeof(*pos));
+  pos->ep_square = SQUARE_NONE;
+  pos->fullmove = 1;
+
+  const char *p = fen;
+  int rank = 7, file = 0;
+  for (; *p && *p != ' '; p++) {
+    if (*p == '/') {
+      if (file != 8 || rank == 0) {
+        return false;
+      }
+      rank--;
+      file = 0;
+    } else if (*p >= '1' && *p <= '8') {
+      file += *p - '0';
+    } else {
+      const char *type = *p ? strchr(pieces + 1, *p | 0x20) : NULL;
+      if (!type || file > 7) {
+        return false;
+      }
+      put_piece(pos, rank * 8 + file++,
+                PIECE_MAKE(*p >= 'a' ? BLACK : WHITE, type - pieces));
+    }
+    if (file > 8) {
+      return false;
+    }
+  }
+  if (rank != 0 || file != 8 || *p++ != ' ') {
+    return false;
+  }
+
+  if ((*p != 'w' && *p != 'b') || p[1] != ' ') {
+    return false;
+  }
+  pos->side = *p == 'w' ? WHITE : BLACK;
+  p += 2;
+
+  if (*p == '-') {
+    p++;
+  } else {
+    if (!*p || *p == ' ') {
+      return false;
+    }
+    for (; *p && *p != ' '; p++) {
+      const char *right = strchr(rights, *p);
+      if (!right || (pos->castling & 1 << (right - rights))) {
+        return false;
+      }
+      pos->castling |= 1 << (right - rights);
+    }
+  }
+  if (*p++ != ' ') {
+    return false;
+  }
+
+  int ep_square = SQUARE_NONE;
+  if (p[0] >= 'a' && p[0] <= 'h' && p[1] == (pos->side == WHITE ? '6' : '3')) {
+    ep_square = (p[1] - '1') * 8 + (p[0] - 'a');
+    p += 2;
+  } else if (*p == '-') {
+    p++;
+  } else {
+    return false;
+  }
+
+  if (!parse_counter(&p, &pos->halfmove) ||
+      !parse_counter(&p, &pos->fullmove) || *p != '\0' ||
+      pos->fullmove == 0) {
+    return false;
+  }
+
+  for (int color = WHITE; color <= BLACK; color++) {
+    if (__builtin_popcountll(pieces_of(pos, color, KING)) != 1 ||
+        __builtin_popcountll(pos->by_color[color]) > 16 ||
+        __builtin_popcountll(pieces_of(pos, color, PAWN)) > 8) {
+      return false;
+    }
+  }
+  if ((pos->by_type[PAWN] & (RANK_1 | RANK_8)) ||
+      attacked(pos, lowest(pieces_of(pos, !pos->side, KING)), pos->side)) {
+    return false;
+  }
+
+  pos->castling = possible_castling(pos);
+  // The pawn that skipped the square must be right in front of it
+  if (ep_square != SQUARE_NONE) {
+    int pushed = pos->side == WHITE ? ep_square - 8 : ep_square + 8;
+    int origin = pos->side == WHITE ? ep_square + 8 : ep_square - 8;
+    if (pos->squares[pushed] == PIECE_MAKE(!pos->side, PAWN) &&
+        pos->squares[ep_square] == PIECE_NONE &&
+        pos->squares[origin] == PIECE_NONE &&
+        can_take_en_passant(pos, ep_square)) {
+      pos->ep_square = (uint8_t)ep_square;
+    }
+  }
+  pos->key = position_compute_key(pos);
+  return true;
+}
+
+void position_to_fen(const Position *pos, char *fen) {
+  static const char pieces[] = " pnbrqk";
+  char *p = fen;
+  for (int rank = 7; rank >= 0; rank--) {
+    int empty = 0;
+    for (int file = 0; file < 8; file++) {
+      uint8_t piece = pos->squares[rank * 8 + file];
+      if (piece == PIECE_NONE) {
+        empty++;
+        continue;
+      }
+      if (empty) {
+        *p++ = (char)('0' + empty);
+        empty = 0;
+      }
+      char c = pieces[PIECE_TYPE(piece)];
+      *p++ = PIECE_COLOR(piece) == WHITE ? (char)(c - 0x20) : c;
+    }
+    if (empty) {
+      *p++ = (char)('0' + empty);
+    }
+    if (rank > 0) {
+      *p++ = '/';
+    }
+  }
+
+  *p++ = ' ';
+  *p++ = pos->side == WHITE ? 'w' : 'b';
+  *p++ = ' ';
+  if (!pos->castling) {
+    *p++ = '-';
+  }
+  for (int i = 0; i < 4; i++) {
+    if (pos->castling & (1 << i)) {
+      *p++ = "KQkq"[i];
+    }
+  }
+  *p++ = ' ';
+  if (pos->ep_square == SQUARE_NONE) {
+    *p++ = '-';
+  } else {
+    *p++ = (char)('a' + FILE_OF(pos->ep_square));
+    *p++ = (char)('1' + RANK_OF(pos->ep_square));
+  }
+  snprintf(p, POSITION_FEN_SIZE - (p - fen), " %u %u", pos->halfmove,
+           pos->fullmove);
+}
+
+bool position_in_check(const Position *pos) {
+  return attacked(pos, lowest(pieces_of(pos, pos->side, KING)), !pos->side);
+}
+
+static size_t add_moves(uint16_t *moves, size_t count, int from,
+                        uint64_t targets) {
+  while (targets) {
+    moves[count++] = MOVE_MAKE(from, pop_lowest(&targets), PROMOTE_NONE);
+  }
+  return count;
+}
+
+static size_t add_pawn_moves(uint16_t *moves, size_t count, int from, int to) {
+  if (RANK_OF(to) == 0 || RANK_OF(to) == 7) {
+    for (int promo = PROMOTE_QUEEN; promo >= PROMOTE_KNIGHT; promo--) {
+      moves[count++] = MOVE_MAKE(from, to, promo);
+    }
+  } else {
+    moves[count++] = MOVE_MAKE(from, to, PROMOTE_NONE);
+  }
+  return count;
+}
+
+/* The king may not castle out of, through or into check; the last is left
+   to the legality test every move goes through. */
+static size_t add_castling(const Position *pos, uint16_t *moves,
+                           size_t count) {
+  int us = pos->side;
+  int king = us == WHITE ? 4 : 60;
+  uint64_t occupied = pos->by_type[PIECE_NONE];
+  uint8_t king_side = us == WHITE ? CASTLE_WHITE_KING : CASTLE_BLACK_KING;
+  uint8_t queen_side = us == WHITE ? CASTLE_WHITE_QUEEN : CASTLE_BLACK_QUEEN;
+
+  if (!(pos->castling & (king_side | queen_side)) ||
+      attacked(pos, king, !us)) {
+    return count;
+  }
+  if ((pos->castling & king_side) &&
+      !(occupied & (BIT(king + 1) | BIT(king + 2))) &&
+      !attacked(pos, king + 1, !us)) {
+    moves[count++] = MOVE_MAKE(king, king + 2, PROMOTE_NONE);
+  }
+  if ((pos->castling & queen_side) &&
+      !(occupied & (BIT(king - 1) | BIT(king - 2) | BIT(king - 3))) &&
+      !attacked(pos, king - 1, !us)) {
+    moves[count++] = MOVE_MAKE(king, king - 2, PROMOTE_NONE);
+  }
+  return count;
+}
+
+/* Every move that obeys how the pieces move, whether or not it leaves the
+   king in check. */
+static size_t pseudo_legal_moves(const Position *pos, uint16_t *moves) {
+  int us = pos->side;
+  uint64_t own = pos->by_color[us], enemy = pos->by_color[!us];
+  uint64_t occupied = pos->by_type[PIECE_NONE];
+  size_t count = 0;
+
+  uint64_t pawns = pieces_of(pos, us, PAWN);
+  int forward = us == WHITE ? 8 : -8;
+  int start_rank = us == WHITE ? 1 : 6;
+  while (pawns) {
+    int from = pop_lowest(&pawns);
+    int to = from + forward;
+    if (!(occupied & BIT(to))) {
+      count = add_pawn_moves(moves, count, from, to);
+      if (RANK_OF(from) == start_rank && !(occupied & BIT(to + forward))) {
+        moves[count++] = MOVE_MAKE(from, to + forward, PROMOTE_NONE);
+      }
+    }
+    uint64_t captures = pawn_attacks[us][from] & enemy;
+    while (captures) {
+      count = add_pawn_moves(moves, count, from, pop_lowest(&captures));
+    }
+    if (pos->ep_square != SQUARE_NONE &&
+        (pawn_attacks[us][from] & BIT(pos->ep_square))) {
+      moves[count++] = MOVE_MAKE(from, pos->ep_square, PROMOTE_NONE);
+    }
+  }
+
+  for (int type = KNIGHT; type <= KING; type++) {
+    uint64_t pieces = pieces_of(pos, us, type);
+    while (pieces) {
+      int from = pop_lowest(&pieces);
+      uint64_t targets;
+      switch (type) {
+      case KNIGHT:
+        targets = knight_attacks[from];
+        break;
+      case BISHOP:
+        targets = slider_attacks(bishop_directions, from, occupied);
+        break;
+      case ROOK:
+        targets = slider_attacks(rook_directions, from, occupied);
+        break;
+      case QUEEN:
+        targets = slider_attacks(bishop_directions, from, occupied) |
+                  slider_attacks(rook_directions, from, occupied);
+        break;
+      default:
+        targets = king_attacks[from];
+        break;
+      }
+      count = add_moves(moves, count, from, targets & ~own);
+    }
+  }
+
+  return add_castling(pos, moves, count);
+}
+
+/* Fills moves, which must hold POSITION_MAX_MOVES entries, with every legal
+   move and returns their number. */
+size_t position_legal_moves(const Position *pos, uint16_t *moves) {
+  size_t count = pseudo_legal_moves(pos, moves), legal = 0;
+  for (size_t i = 0; i < count; i++) {
+    Position after = *pos;
+    position_make_move(&after, moves[i]);
+    if (!attacked(&after, lowest(pieces_of(&after, pos->side, KING)),
+                  after.side)) {
+      moves[legal++] = moves[i];
+    }
+  }
+  return legal;
+}
+
+/* Parses a UCI move and checks that it is legal in the position. */
+bool position_parse_move(const Position *pos, StrView token, uint16_t *move) {
+  uint16_t moves[POSITION_MAX_MOVES];
+  if (!uci_parse_move(token, move)) {
+    return false;
+  }
+  size_t count = position_legal_moves(pos, moves);
+  for (size_t i = 0; i < count; i++) {
+    if (moves[i] == *move) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Resolves a SAN move such as "Nbd7", "exd6", "e8=Q+" or "O-O" against the
+   position. Fails unless exactly one legal move matches. */
+bool position_parse_san(const Position *pos, StrView san, uint16_t *move) {
+  static const char pieces[] = "NBRQK";
+  // Drop check marks and annotation glyphs
+  while (san.len > 0 && strchr("+#!?", san.data[san.len - 1])) {
+    san.len--;
+  }
+
+  uint16_t moves[POSITION_MAX_MOVES];
+  size_t count = position_legal_moves(pos, moves);
+  uint16_t found = MOVE_NONE;
+
+  if (sv_eq(san, "O-O") || sv_eq(san, "0-0") || sv_eq(san, "O-O-O") ||
+      sv_eq(san, "0-0-0")) {
+    int king = lowest(pieces_of(pos, pos->side, KING));
+    int to = san.len >= 5 ? king - 2 : king + 2;
+    for (size_t i = 0; i < count; i++) {
+      if (MOVE_FROM(moves[i]) == king && MOVE_TO(moves[i]) == to) {
+        found = moves[i];
+      }
+    }
+    *move = found;
+    return found != MOVE_NONE;
+  }
+
+  const char *s = san.data, *end = san.data + san.len;
+  int type = PAWN;
+  const char *piece = s < end && *s ? strchr(pieces, *s) : NULL;
+  if (piece) {
+    type = KNIGHT + (int)(piece - pieces);
+    s++;
+  }
+
+  // pieces starts with the four promotion pieces in PROMOTE_* order
+  int promo = PROMOTE_NONE;
+  piece = end - s > 2 ? memchr(pieces, end[-1], 4) : NULL;
+  if (piece) {
+    promo = PROMOTE_KNIGHT + (int)(piece - pieces);
+    end -= end[-2] == '=' ? 2 : 1;
+  }
+
+  if (end - s < 2 || end[-2] < 'a' || end[-2] > 'h' || end[-1] < '1' ||
+      end[-1] > '8') {
+    return false;
+  }
+  int to = (end[-1] - '1') * 8 + (end[-2] - 'a');
+  end -= 2;
+
+  int from_file = -1, from_rank = -1;
+  bool capture = false;
+  for (; s < end; s++) {
+    if (*s >= 'a' && *s <= 'h') {
+      from_file = *s - 'a';
+    } else if (*s >= '1' && *s <= '8') {
+      from_rank = *s - '1';
+    } else if (*s == 'x' || *s == ':') {
+      capture = true;
+    } else if (*s != '-') {
+      return false;
+    }
+  }
+  // A pawn names its file only when it captures
+  if (type == PAWN && from_file < 0) {
+    from_file = FILE_OF(to);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    int from = MOVE_FROM(moves[i]);
+    if (MOVE_TO(moves[i]) != to || MOVE_PROMOTION(moves[i]) != promo ||
+        PIECE_TYPE(pos->squares[from]) != type ||
+        (from_file >= 0 && FILE_OF(from) != from_file) ||
+        (from_rank >= 0 && RANK_OF(from) != from_rank) ||
+        (capture && type == PAWN && FILE_OF(from) == FILE_OF(to))) {
+      continue;
+    }
+    if (found != MOVE_NONE) {
+      return false; // Ambiguous
+    }
+    found = moves[i];
+  }
+
+  *move = found;
+  return found != MOVE_NONE;
+}
+
+/* Plays a move that obeys how the pieces move, castling given as the king's
+   two square step, and updates the key along with the board. */
+void position_make_move(Position *pos, uint16_t move) {
+  const ZobristKeys *keys = zobrist_keys();
+  int from = MOVE_FROM(move), to = MOVE_TO(move);
+  int us = pos->side;
+  uint8_t piece = pos->squares[from];
+
+  pos->key ^= castling_key(keys, pos->castling);
+  if (pos->ep_square != SQUARE_NONE) {
+    pos->key ^= keys->en_passant[FILE_OF(pos->ep_square)];
+  }
+  int ep_square = pos->ep_square;
+  pos->ep_square = SQUARE_NONE;
+  pos->halfmove++;
+
+  if (pos->squares[to] != PIECE_NONE) {
+    remove_piece(pos, to);
+    pos->halfmove = 0;
+  }
+  remove_piece(pos, from);
+
+  if (PIECE_TYPE(piece) == PAWN) {
+    pos->halfmove = 0;
+    if (to == ep_square) {
+      remove_piece(pos, RANK_OF(from) * 8 + FILE_OF(to));
+    }
+    if (MOVE_PROMOTION(move) != PROMOTE_NONE) {
+      piece = PIECE_MAKE(us, KNIGHT + MOVE_PROMOTION(move) - 1);
+    }
+  } else if (PIECE_TYPE(piece) == KING && abs(to - from) == 2) {
+    int rook_from = to > from ? from + 3 : from - 4;
+    remove_piece(pos, rook_from);
+    put_piece(pos, to > from ? from + 1 : from - 1, PIECE_MAKE(us, ROOK));
+  }
+  put_piece(pos, to, piece);
+
+  pos->castling &= castling_kept[from] & castling_kept[to];
+  pos->key ^= castling_key(keys, pos->castling);
+  pos->side = !us;
+  pos->key ^= keys->side;
+  if (us == BLACK) {
+    pos->fullmove++;
+  }
+
+  if (PIECE_TYPE(piece) == PAWN && abs(to - from) == 16 &&
+      can_take_en_passant(pos, (from + to) / 2)) {
+    pos->ep_square = (uint8_t)((from + to) / 2);
+    pos->key ^= keys->en_passant[FILE_OF(pos->ep_square)];
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef POSITION_H
+#define POSITION_H
+
+#include "linebuf.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STARTPOS_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+/* Squares use the same numbering as moves in uci.h, a1 = 0 up to h8 = 63.
+   A piece is its type in the low three bits plus its color in bit 3. */
+enum { PIECE_NONE, PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING };
+enum { WHITE, BLACK };
+
+#define PIECE_TYPE(p) ((p) & 7)
+#define PIECE_COLOR(p) ((p) >> 3)
+#define PIECE_MAKE(color, type) ((uint8_t)((color) << 3 | (type)))
+
+enum {
+  CASTLE_WHITE_KING = 1,
+  CASTLE_WHITE_QUEEN = 2,
+  CASTLE_BLACK_KING = 4,
+  CASTLE_BLACK_QUEEN = 8,
+};
+
+#define SQUARE_NONE 64
+#define POSITION_MAX_MOVES 256
+#define POSITION_FEN_SIZE 96 // Longest FEN position_to_fen() writes, plus NUL
+
+/* Bitboard position that requests are checked against before they reach an
+   engine. Bit n of a bitboard is square n, numbered as in uci.h, and pieces
+   are encoded as above; squares[] mirrors the bitboards. key is the Zobrist
+   key from zobrist.h, which is also the position's Polyglot book key, and is
+   kept up to date by position_make_move(). */
+typedef struct {
+  uint64_t by_type[7]; // By piece type, where [PIECE_NONE] is every piece
+  uint64_t by_color[2];
+  uint8_t squares[64];
+  uint8_t side;
+  uint8_t castling;
+  uint8_t ep_square; // SQUARE_NONE unless a pawn can capture en passant
+  uint16_t halfmove;
+  uint16_t fullmove;
+  uint64_t key;
+} Position;
+
+bool position_from_fen(Position *pos, const char *fen);
+void position_to_fen(const Position *pos, char *fen);
+uint64_t position_compute_key(const Position *pos);
+bool position_in_check(const Position *pos);
+size_t position_legal_moves(const Position *pos, uint16_t *moves);
+bool position_parse_move(const Position *pos, StrView token, uint16_t *move);
+bool position_parse_san(const Position *pos, StrView san, uint16_t *move);
+void position_make_move(Position *pos, uint16_t move);
+
+#endif
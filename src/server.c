@@ -0,0 +1,1669 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "analysis.h"
+#include "arena.h"
+#include "book.h"
+#include "cache.h"
+#include "engine.h"
+#include "evalstore.h"
+#include "http.h"
+#include "json.h"
+#include "metrics.h"
+#include "pool.h"
+#include "trace.h"
+#include "utils.h"
+#include "zobrist.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONNECTION_MAX_INPUT (HTTP_MAX_HEADER_SIZE + HTTP_MAX_BODY_SIZE)
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t resize_requested = 0;
+static volatile sig_atomic_t trace_requested = 0;
+
+static void handle_stop_signal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static void handle_resize_signal(int sig) {
+  (void)sig;
+  resize_requested = 1;
+}
+
+static void handle_trace_signal(int sig) {
+  (void)sig;
+  trace_requested = 1;
+}
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Writes as much of the pending output as the socket takes. Returns 1 once
+   all of it is out, 0 if the socket is full and -1 on errors. */
+static int send_output(Connection *conn) {
+  while (conn->out_sent < conn->out.count) {
+    ssize_t n = send(conn->fd, conn->out.items + conn->out_sent,
+                     conn->out.count - conn->out_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    conn->out_sent += n;
+  }
+  return 1;
+}
+
+static void close_connection(Server *server, Connection *conn);
+static void service_connection(Server *server, Connection *conn);
+static void grow_pool(Server *server);
+
+/* Adds the spans recorded for the request to its result object, as a
+   trace-event document of its own. */
+static void append_trace(Connection *conn, StringBuilder *body) {
+  body->count--; // The closing brace
+  sb_appendf(&conn->arena, body, ",\"trace\":");
+  trace_format(&conn->arena, body, conn->trace_id);
+  sb_appendf(&conn->arena, body, "}");
+}
+
+/* Queues a complete response; service_connection() writes it out. A
+   streamed response gets the body as its last line instead, whatever the
+   status. The request span ends here, before a requested trace is added to
+   a result, so the trace holds every span of the request. */
+static void write_response(Connection *conn, int status, const char *body,
+                           size_t body_len) {
+  if (conn->trace_id) {
+    trace_span(conn->trace_id, "request", conn->trace_start_ns,
+               trace_now_ns());
+    if (status == 200 && conn->request.trace) {
+      StringBuilder traced = {0};
+      arena_da_append_many(&conn->arena, &traced, body, body_len);
+      append_trace(conn, &traced);
+      body = traced.items;
+      body_len = traced.count;
+    }
+    conn->trace_id = 0;
+  }
+  if (conn->streaming) {
+    StringBuilder line = {0};
+    arena_da_append_many(&conn->arena, &line, body, body_len);
+    arena_da_append(&conn->arena, &line, '\n');
+    http_format_chunk(&conn->arena, &conn->out, line.items, line.count);
+    http_format_chunk(&conn->arena, &conn->out, "", 0);
+    conn->streaming = false;
+  } else {
+    http_format_response(&conn->arena, &conn->out, status, "application/json",
+                         body, body_len, conn->keep_alive);
+  }
+  conn->busy = false;
+  if (conn->received_us) {
+    metrics_record(METRIC_REQUEST, metrics_now_us() - conn->received_us);
+    conn->received_us = 0;
+  }
+}
+
+static Connection **flight_bucket(Server *server, uint64_t key) {
+  return &server->flights[key & (SERVER_FLIGHT_BUCKETS - 1)];
+}
+
+static Connection **flight_link(Server *server, Connection *leader) {
+  Connection **link = flight_bucket(server, leader->flight_key);
+  while (*link != leader) {
+    link = &(*link)->next_flight;
+  }
+  return link;
+}
+
+static void end_flight(Server *server, Connection *leader) {
+  *flight_link(server, leader) = leader->next_flight;
+  leader->leading = false;
+}
+
+static void detach_follower(Server *server, Connection *conn) {
+  Connection **link = &conn->leader->followers;
+  while (*link != conn) {
+    link = &(*link)->next_follower;
+  }
+  *link = conn->next_follower;
+  conn->leader = NULL;
+  server->follower_count--;
+}
+
+/* Records a span for a request and every request following its search. */
+static void trace_flight(const Connection *leader, const char *name,
+                         uint64_t start_ns, uint64_t end_ns) {
+  for (const Connection *conn = leader; conn;
+       conn = conn == leader ? leader->followers : conn->next_follower) {
+    if (conn->trace_id) {
+      trace_span(conn->trace_id, name, start_ns, end_ns);
+    }
+  }
+}
+
+/* Records a span of the slot's search for each request it answers, or under
+   the request that started it once they are all gone. */
+static void trace_search(const EngineSlot *slot, const char *name,
+                         uint64_t start_ns, uint64_t end_ns) {
+  if (slot->client) {
+    trace_flight(slot->client, name, start_ns, end_ns);
+  } else {
+    trace_span(slot->trace_id, name, start_ns, end_ns);
+  }
+}
+
+/* Answers a request, and every request following its search. */
+static void respond(Server *server, Connection *conn, int status,
+                    const char *body, size_t body_len) {
+  write_response(conn, status, body, body_len);
+  if (!conn->leading) {
+    return;
+  }
+
+  end_flight(server, conn);
+  while (conn->followers) {
+    Connection *follower = conn->followers;
+    detach_follower(server, follower);
+    write_response(follower, status, body, body_len);
+    service_connection(server, follower);
+  }
+}
+
+static void respond_error(Server *server, Connection *conn, int status,
+                          const char *message) {
+  StringBuilder body = {0};
+  sb_appendf(&conn->arena, &body, "{\"error\":");
+  json_append_string(&conn->arena, &body, message);
+  sb_appendf(&conn->arena, &body, "}");
+  respond(server, conn, status, body.items, body.count);
+}
+
+static EngineSlot *slot_for(Server *server, Engine *engine) {
+  return &server->slots[engine - server->pool->engines];
+}
+
+/* Commands are only queued while events are handled; flush_engines() writes
+   each engine's batch once the pass is over. */
+static void mark_queued(Server *server, EngineSlot *slot) {
+  if (!slot->queued) {
+    slot->queued = true;
+    server->flush[server->flush_count++] = slot;
+  }
+}
+
+static int queue_command(Server *server, EngineSlot *slot,
+                         const char *command) {
+  if (engine_queue(slot->engine, command) != 0) {
+    return -1;
+  }
+  mark_queued(server, slot);
+  return 0;
+}
+
+/* The search's commands are all in the pipe: its engine time starts. */
+static void search_written(EngineSlot *slot) {
+  if (!slot->queued_ns || slot->go_ns) {
+    return;
+  }
+  slot->go_ns = trace_now_ns();
+  trace_search(slot, "engine write", slot->queued_ns, slot->go_ns);
+}
+
+static void flush_engines(Server *server) {
+  for (size_t i = 0; i < server->flush_count; i++) {
+    EngineSlot *slot = server->flush[i];
+    slot->queued = false;
+    // On a full pipe the rest is written once SOURCE_ENGINE_INPUT fires
+    int rc = slot->dead ? -1 : engine_flush(slot->engine);
+    if (rc == 0) {
+      search_written(slot);
+    } else if (rc == -1 && !slot->dead) {
+      fprintf(stderr, "Engine %d stopped taking commands\n",
+              (int)slot->engine->pid);
+    }
+  }
+  server->flush_count = 0;
+}
+
+static void finish_search(Server *server, EngineSlot *slot);
+static void stream_progress(Server *server, EngineSlot *slot);
+
+static void search_on_line(Server *server, EngineSlot *slot, StrView line) {
+  if (search_collector_feed(&slot->engine->search, line)) {
+    if (slot->go_ns) {
+      trace_search(slot, "bestmove", slot->go_ns, trace_now_ns());
+    }
+    slot->cont = NULL;
+    finish_search(server, slot);
+  } else if (sv_starts_with(line, "info")) {
+    if (!slot->info_ns && slot->go_ns) {
+      slot->info_ns = trace_now_ns();
+      trace_search(slot, "first info", slot->go_ns, slot->info_ns);
+    }
+    stream_progress(server, slot);
+  }
+}
+
+static void search_on_failure(Server *server, EngineSlot *slot) {
+  Connection *conn = slot->client;
+  slot->cont = NULL;
+  if (slot->preempted) {
+    server->preempting--;
+  }
+  slot->stopping = slot->preempted = false;
+  if (conn) {
+    conn->slot = NULL;
+    slot->client = NULL;
+    respond_error(server, conn, 500, "engine crashed");
+    service_connection(server, conn);
+  }
+}
+
+static const EngineContinuation search_continuation = {
+    .on_line = search_on_line,
+    .on_failure = search_on_failure,
+};
+
+static int start_search(Server *server, EngineSlot *slot, Connection *conn) {
+  const char *position =
+      analysis_position_command(&conn->arena, &conn->request);
+  const char *go = analysis_go_command(&conn->arena, &conn->request);
+
+  if (engine_queue_search(slot->engine, position, go,
+                          conn->request.multipv) != 0) {
+    return -1;
+  }
+  mark_queued(server, slot);
+  uint64_t now_ns = trace_now_ns();
+  metrics_record(METRIC_QUEUE_WAIT,
+                 conn->queued_ns ? (now_ns - conn->queued_ns) / 1000 : 0);
+  if (conn->queued_ns) {
+    trace_span(conn->trace_id, "queue wait", conn->queued_ns, now_ns);
+  }
+  conn->queued_ns = 0;
+  slot->trace_id = conn->trace_id;
+  slot->queued_ns = now_ns;
+  slot->go_ns = 0;
+  slot->info_ns = 0;
+
+  slot->cont = &search_continuation;
+  slot->client = conn;
+  slot->started_ms = now_ms();
+  conn->slot = slot;
+  return 0;
+}
+
+/* Whether a should be served before b: interactive before batch, then the
+   earlier deadline, where no deadline comes last. */
+static bool runs_before(const Connection *a, const Connection *b) {
+  if (a->request.priority != b->request.priority) {
+    return a->request.priority < b->request.priority;
+  }
+  if (a->deadline_at_ms && b->deadline_at_ms) {
+    return a->deadline_at_ms < b->deadline_at_ms;
+  }
+  return a->deadline_at_ms != 0 && b->deadline_at_ms == 0;
+}
+
+/* Queues a request behind every one that runs before it or ties with it, so
+   equal requests keep their order. */
+static void enqueue(Server *server, Connection *conn) {
+  conn->queued_ns = trace_now_ns();
+  Connection **link = &server->pending_head;
+  while (*link && !runs_before(conn, *link)) {
+    link = &(*link)->next_pending;
+  }
+  conn->next_pending = *link;
+  *link = conn;
+  if (!conn->next_pending) {
+    server->pending_tail = conn;
+  }
+  server->pending_count++;
+}
+
+/* Starts the search right away if an engine is idle, otherwise queues the
+   connection until finish_search() or the end of the bootstrap hands it
+   one. */
+static void dispatch(Server *server, Connection *conn) {
+  if ((server->bootstrapped && !server->ready) ||
+      (server->ready && server->pool->size == 0)) {
+    respond_error(server, conn, 503, "engine unavailable");
+    return;
+  }
+  Engine *engine = server->ready ? pool_try_acquire(server->pool) : NULL;
+  if (!engine) {
+    enqueue(server, conn);
+    grow_pool(server);
+    return;
+  }
+
+  if (start_search(server, slot_for(server, engine), conn) != 0) {
+    pool_release(server->pool, engine);
+    respond_error(server, conn, 500, "engine unavailable");
+  }
+}
+
+static void unlink_pending(Server *server, Connection *conn) {
+  Connection **link = &server->pending_head;
+  Connection *prev = NULL;
+  while (*link && *link != conn) {
+    prev = *link;
+    link = &(*link)->next_pending;
+  }
+  if (*link) {
+    *link = conn->next_pending;
+    if (server->pending_tail == conn) {
+      server->pending_tail = prev;
+    }
+    server->pending_count--;
+  }
+}
+
+static SearchResult *deeper(SearchResult *a, SearchResult *b) {
+  if (!a || a->line_count == 0) {
+    return b;
+  }
+  if (b->line_count == 0 || a->lines[0].depth > b->lines[0].depth) {
+    return a;
+  }
+  return b;
+}
+
+static void respond_result(Server *server, Connection *conn,
+                           const SearchResult *result, const char *source,
+                           bool partial) {
+  uint64_t start_ns = trace_now_ns();
+  StringBuilder body = {0};
+  analysis_result_to_json(&conn->arena, &body, result, source, partial);
+  trace_flight(conn, "serialize", start_ns, trace_now_ns());
+  respond(server, conn, 200, body.items, body.count);
+}
+
+/* What a flight's search found so far, allocated in arena: the deeper of the
+   running search and those cut short before it, or NULL if there is
+   nothing yet. */
+static SearchResult *flight_progress(Connection *leader, Arena *arena) {
+  SearchResult *result = leader->partial;
+  if (leader->slot) {
+    SearchResult *current =
+        search_collector_finish(&leader->slot->engine->search, arena);
+    if (current->line_count > 0) {
+      // Until bestmove arrives, the first line's PV stands in for it
+      const uint16_t *moves = search_result_moves(current);
+      if (current->lines[0].pv_count > 0) {
+        current->bestmove = moves[0];
+      }
+      if (current->lines[0].pv_count > 1) {
+        current->ponder = moves[1];
+      }
+      result = deeper(result, current);
+    }
+  }
+  return result && result->line_count > 0 ? result : NULL;
+}
+
+/* Appends one line to a streamed response and writes out what the socket
+   takes; the rest follows on EPOLLOUT. Errors are left for the socket's
+   next event, so the flight the connection is in stays intact. */
+static void stream_line(Connection *conn, const char *line, size_t len) {
+  if (!conn->streaming) {
+    http_format_stream_start(&conn->arena, &conn->out, 200,
+                             "application/x-ndjson", conn->keep_alive);
+    conn->streaming = true;
+  }
+  http_format_chunk(&conn->arena, &conn->out, line, len);
+  if (send_output(conn) == 1) {
+    conn->out.count = 0;
+    conn->out_sent = 0;
+  }
+}
+
+static void append_update(Arena *arena, StringBuilder *sb,
+                          const SearchResult *result) {
+  analysis_result_to_json(arena, sb, result, "engine", true);
+  arena_da_append(arena, sb, '\n');
+}
+
+/* Sends the search so far to every streaming request in the slot's flight
+   once all of its lines reached a new depth. The update is built once. */
+static void stream_progress(Server *server, EngineSlot *slot) {
+  Connection *leader = slot->client;
+  SearchCollector *search = &slot->engine->search;
+  if (!leader || search->line_count < leader->request.multipv ||
+      search->lines[leader->request.multipv - 1].depth <=
+          leader->streamed_depth) {
+    return;
+  }
+  leader->streamed_depth = search->lines[leader->request.multipv - 1].depth;
+
+  StringBuilder update = {0};
+  for (Connection *conn = leader; conn;
+       conn = conn == leader ? leader->followers : conn->next_follower) {
+    if (!conn->request.stream) {
+      continue;
+    }
+    if (update.count == 0) {
+      append_update(&server->scratch, &update,
+                    flight_progress(leader, &server->scratch));
+    }
+    stream_line(conn, update.items, update.count);
+  }
+  arena_reset(&server->scratch);
+}
+
+/* Requests share a search when they ask for the same position, number of
+   lines and limits. */
+static uint64_t flight_key(const Connection *conn) {
+  const AnalysisRequest *request = &conn->request;
+  uint64_t key = zobrist_mix(conn->cache_key, request->multipv);
+  key = zobrist_mix(key, request->depth);
+  key = zobrist_mix(key, request->movetime);
+  return zobrist_mix(key, request->nodes);
+}
+
+static bool same_search(const AnalysisRequest *a, const AnalysisRequest *b) {
+  return a->depth == b->depth && a->movetime == b->movetime &&
+         a->nodes == b->nodes && a->multipv == b->multipv &&
+         a->priority == b->priority && strcmp(a->moves, b->moves) == 0 &&
+         (a->fen && b->fen ? strcmp(a->fen, b->fen) == 0 : a->fen == b->fen);
+}
+
+/* Attaches a request to a queued or running search for the same thing, if
+   there is one. Searches being stopped at their deadline are passed over,
+   since they end with a partial result. */
+static bool join_flight(Server *server, Connection *conn) {
+  conn->flight_key = flight_key(conn);
+  Connection *leader = *flight_bucket(server, conn->flight_key);
+  while (leader && (leader->flight_key != conn->flight_key ||
+                    !same_search(&leader->request, &conn->request) ||
+                    (leader->slot && leader->slot->stopping &&
+                     !leader->slot->preempted))) {
+    leader = leader->next_flight;
+  }
+  if (!leader) {
+    return false;
+  }
+
+  conn->leader = leader;
+  conn->next_follower = leader->followers;
+  leader->followers = conn;
+  server->follower_count++;
+
+  // The request shares the spans its search recorded before it joined
+  EngineSlot *slot = leader->slot;
+  if (slot && slot->go_ns) {
+    trace_span(conn->trace_id, "engine write", slot->queued_ns, slot->go_ns);
+    if (slot->info_ns) {
+      trace_span(conn->trace_id, "first info", slot->go_ns, slot->info_ns);
+    }
+  }
+
+  SearchResult *progress;
+  if (conn->request.stream &&
+      (progress = flight_progress(leader, &conn->arena))) {
+    StringBuilder update = {0};
+    append_update(&conn->arena, &update, progress);
+    stream_line(conn, update.items, update.count);
+  }
+  return true;
+}
+
+static void lead_flight(Server *server, Connection *conn) {
+  Connection **bucket = flight_bucket(server, conn->flight_key);
+  conn->next_flight = *bucket;
+  *bucket = conn;
+  conn->leading = true;
+  conn->followers = NULL;
+}
+
+/* Hands a flight over to its first follower when the leader leaves it
+   early, so the search carries on for the others. */
+static void promote(Server *server, Connection *old) {
+  Connection *next = old->followers;
+  detach_follower(server, next);
+  next->followers = old->followers;
+  old->followers = NULL;
+  for (Connection *f = next->followers; f; f = f->next_follower) {
+    f->leader = next;
+  }
+
+  *flight_link(server, old) = next;
+  next->next_flight = old->next_flight;
+  next->leading = true;
+  old->leading = false;
+
+  next->streamed_depth = old->streamed_depth;
+  if (old->partial) {
+    next->partial = arena_memdup(&next->arena, old->partial,
+                                 old->partial->size);
+  }
+  if (old->slot) {
+    next->slot = old->slot;
+    next->slot->client = next;
+    old->slot = NULL;
+  } else {
+    unlink_pending(server, old);
+    enqueue(server, next);
+  }
+}
+
+/* Answers a single line request for a book position with one of the book's
+   moves. The result has no lines, as the book holds no evaluations. */
+static SearchResult *lookup_book(Server *server, Connection *conn) {
+  const AnalysisRequest *request = &conn->request;
+  if (!server->book || !request->use_book || request->multipv != 1) {
+    return NULL;
+  }
+
+  Position pos;
+  analysis_final_position(request, &pos);
+  uint16_t move = book_probe(server->book, &pos);
+  if (move == MOVE_NONE) {
+    return NULL;
+  }
+  SearchResult *result = arena_alloc(&conn->arena, sizeof(*result));
+  memset(result, 0, sizeof(*result));
+  result->size = sizeof(*result);
+  result->bestmove = move;
+  return result;
+}
+
+/* Looks the request up in the in-memory cache, then in the persistent store.
+   Store hits are promoted into the cache. */
+static SearchResult *lookup_stored(Server *server, Connection *conn,
+                                   const char **source) {
+  SearchResult *result = NULL;
+  conn->cache_key = cache_key(&conn->request);
+
+  if (server->cache) {
+    result = cache_lookup(server->cache, conn->cache_key, &conn->request,
+                          &conn->arena);
+    *source = "cache";
+    metrics_count(result ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES);
+  }
+  if (!result && server->store) {
+    result = evalstore_lookup(server->store, conn->cache_key, &conn->request,
+                              &conn->arena);
+    *source = "store";
+    if (result) {
+      metrics_count(METRIC_STORE_HITS);
+    }
+    if (result && server->cache) {
+      cache_store(server->cache, conn->cache_key, result);
+    }
+  }
+  return result;
+}
+
+/* Serves the metrics in the Prometheus text format, along with the state of
+   the pool and the queue as it is right now. */
+static void respond_metrics(Server *server, Connection *conn) {
+  StringBuilder body = {0};
+  metrics_format(&conn->arena, &body);
+
+  size_t engines = 0, idle = 0;
+  if (server->ready) {
+    pthread_mutex_lock(&server->pool->lock);
+    engines = server->pool->size;
+    idle = server->pool->idle_count;
+    pthread_mutex_unlock(&server->pool->lock);
+  }
+  sb_appendf(&conn->arena, &body,
+             "# HELP stockfish_engines Engine processes in the pool\n"
+             "# TYPE stockfish_engines gauge\n"
+             "stockfish_engines{state=\"busy\"} %zu\n"
+             "stockfish_engines{state=\"idle\"} %zu\n"
+             "# HELP stockfish_queued_requests Requests waiting for an engine\n"
+             "# TYPE stockfish_queued_requests gauge\n"
+             "stockfish_queued_requests %zu\n"
+             "# HELP stockfish_following_requests Requests sharing another "
+             "request's search\n"
+             "# TYPE stockfish_following_requests gauge\n"
+             "stockfish_following_requests %zu\n",
+             engines - idle, idle, server->pending_count,
+             server->follower_count);
+
+  http_format_response(&conn->arena, &conn->out, 200,
+                       "text/plain; version=0.0.4", body.items, body.count,
+                       conn->keep_alive);
+}
+
+static void handle_request(Server *server, Connection *conn,
+                           const HttpRequest *request) {
+  if (sv_eq(request->path, "/metrics")) {
+    if (sv_eq(request->method, "GET")) {
+      respond_metrics(server, conn);
+    } else {
+      respond_error(server, conn, 405, "method not allowed");
+    }
+    return;
+  }
+  if (!sv_eq(request->path, "/analyze")) {
+    respond_error(server, conn, 404, "not found");
+    return;
+  }
+  if (!sv_eq(request->method, "POST")) {
+    respond_error(server, conn, 405, "method not allowed");
+    return;
+  }
+
+  const char *error = NULL;
+  conn->trace_id = trace_next_id();
+  JsonValue *json =
+      json_parse(&conn->arena, request->body.data, request->body.len);
+  uint64_t parsed_ns = trace_now_ns();
+  trace_span(conn->trace_id, "parse", conn->trace_start_ns, parsed_ns);
+  if (!json) {
+    respond_error(server, conn, 400, "invalid JSON");
+    return;
+  }
+  if (!analysis_request_from_json(&conn->arena, json, &conn->request,
+                                  &error)) {
+    respond_error(server, conn, 400,
+                  arena_sprintf(&conn->arena, "invalid %s", error));
+    return;
+  }
+  metrics_count(METRIC_REQUESTS);
+  conn->received_us = metrics_now_us();
+  uint64_t validated_ns = trace_now_ns();
+  trace_span(conn->trace_id, "validate", parsed_ns, validated_ns);
+
+  const char *source = "book";
+  SearchResult *stored = lookup_book(server, conn);
+  if (stored) {
+    metrics_count(METRIC_BOOK_HITS);
+  } else {
+    stored = lookup_stored(server, conn, &source);
+  }
+  trace_span(conn->trace_id, "cache lookup", validated_ns, trace_now_ns());
+  if (stored) {
+    respond_result(server, conn, stored, source, false);
+    return;
+  }
+
+  conn->deadline_at_ms =
+      conn->request.deadline_ms ? now_ms() + conn->request.deadline_ms : 0;
+  conn->partial = NULL;
+  conn->streamed_depth = 0;
+  conn->busy = true;
+  if (join_flight(server, conn)) {
+    return;
+  }
+  lead_flight(server, conn);
+  dispatch(server, conn);
+}
+
+/* Parses and handles one buffered request. Returns false if no complete
+   request is buffered yet. */
+static bool process_input(Server *server, Connection *conn) {
+  HttpRequest request;
+  conn->trace_start_ns = trace_now_ns();
+  HttpParseStatus status = http_parse_request(conn->in, conn->in_len, &request);
+  if (status == HTTP_PARSE_INCOMPLETE) {
+    return false;
+  }
+  if (status != HTTP_PARSE_OK) {
+    conn->keep_alive = false;
+    conn->in_len = 0;
+    respond_error(server, conn,
+                  status == HTTP_PARSE_TOO_LARGE ? 413 : 400,
+                  "malformed request");
+    return true;
+  }
+
+  conn->keep_alive = request.keep_alive;
+  handle_request(server, conn, &request);
+
+  // Everything the handler needs has been copied into the arena by now
+  memmove(conn->in, conn->in + request.total_len,
+          conn->in_len - request.total_len);
+  conn->in_len -= request.total_len;
+  return true;
+}
+
+/* Reads until the socket would block, the input buffer is full or the
+   client has shut down its side. Returns true if new bytes arrived. */
+static bool read_input(Server *server, Connection *conn) {
+  bool received = false;
+
+  for (;;) {
+    if (conn->in_len == conn->in_cap) {
+      if (conn->in_cap == CONNECTION_MAX_INPUT) {
+        return received; // Resumed once the requests ahead are answered
+      }
+      size_t cap = conn->in_cap ? conn->in_cap * 2 : 4096;
+      if (cap > CONNECTION_MAX_INPUT) {
+        cap = CONNECTION_MAX_INPUT;
+      }
+      char *in = realloc(conn->in, cap);
+      if (!in) {
+        close_connection(server, conn);
+        return false;
+      }
+      conn->in = in;
+      conn->in_cap = cap;
+    }
+
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                     conn->in_cap - conn->in_len, 0);
+    if (n > 0) {
+      conn->in_len += n;
+      received = true;
+    } else if (n == 0) {
+      // Requests sent before the shutdown are still answered
+      conn->read_closed = true;
+      return received;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return received;
+    } else {
+      close_connection(server, conn);
+      return false;
+    }
+  }
+}
+
+static bool flush_output(Server *server, Connection *conn) {
+  int rc = send_output(conn);
+  if (rc == -1) {
+    close_connection(server, conn);
+  }
+  return rc == 1;
+}
+
+/* Drives a connection as far as it can go without blocking: flush the
+   pending response, then parse and handle pipelined requests one at a time
+   until one has to wait for an engine or the socket runs dry. */
+static void service_connection(Server *server, Connection *conn) {
+  while (conn->fd >= 0) {
+    if (conn->out.count > 0) {
+      if (!flush_output(server, conn)) {
+        return;
+      }
+      if (conn->busy) {
+        // Updates of a streamed response; the rest follows with the search
+        conn->out.count = 0;
+        conn->out_sent = 0;
+        return;
+      }
+      if (!conn->keep_alive) {
+        close_connection(server, conn);
+        return;
+      }
+      // The regions go back to the shared pool rather than sitting with an
+      // idle keep-alive connection
+      arena_free(&conn->arena);
+      conn->out = (StringBuilder){0};
+      conn->out_sent = 0;
+    }
+
+    if (conn->busy) {
+      return;
+    }
+    if (!process_input(server, conn) && !read_input(server, conn)) {
+      if (conn->fd >= 0 && conn->read_closed) {
+        close_connection(server, conn); // No complete request is left
+      }
+      return;
+    }
+  }
+}
+
+static void close_connection(Server *server, Connection *conn) {
+  if (conn->leading && conn->followers) {
+    promote(server, conn);
+  } else if (conn->leading) {
+    end_flight(server, conn);
+  }
+
+  if (conn->leader) {
+    detach_follower(server, conn);
+  } else if (conn->slot) {
+    // Let the engine wind down; its bestmove will be discarded
+    queue_command(server, conn->slot, "stop");
+    conn->slot->stopping = true;
+    conn->slot->client = NULL;
+    conn->slot = NULL;
+  } else if (conn->busy) {
+    unlink_pending(server, conn);
+  }
+
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  conn->fd = -1;
+
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    server->connections = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+
+  // Events for it may still be queued in this epoll batch; free it after
+  conn->next = server->closed;
+  server->closed = conn;
+}
+
+static void free_closed_connections(Server *server) {
+  while (server->closed) {
+    Connection *conn = server->closed;
+    server->closed = conn->next;
+
+    arena_free(&conn->arena);
+    free(conn->in);
+    free(conn);
+  }
+}
+
+static void accept_clients(Server *server) {
+  for (;;) {
+    int fd = accept4(server->listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    Connection *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+      close(fd);
+      continue;
+    }
+    conn->source = SOURCE_CLIENT;
+    conn->fd = fd;
+
+    // Edge triggered, so EPOLLOUT only fires when a blocked write can resume
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close(fd);
+      free(conn);
+      continue;
+    }
+
+    conn->next = server->connections;
+    if (server->connections) {
+      server->connections->prev = conn;
+    }
+    server->connections = conn;
+  }
+}
+
+/* Engines the pool is about to have: the running ones plus those grow_pool()
+   will start for the requests waiting. */
+static size_t planned_engines(Server *server) {
+  EnginePool *pool = server->pool;
+  size_t planned = pool->size;
+  if (server->pending_count > server->starting) {
+    planned += server->pending_count - server->starting;
+  }
+  return planned < pool->max_size ? planned : pool->max_size;
+}
+
+static size_t free_memory_mb(Server *server) {
+  EnginePool *pool = server->pool;
+  size_t hash_mb = 0;
+  for (size_t i = 0; i < POOL_MAX_ENGINES; i++) {
+    if (pool->engines[i].pid != 0) {
+      hash_mb += pool->engines[i].hash_mb;
+    }
+  }
+  return budget_free_mb(server->budget, pool->size, hash_mb);
+}
+
+/* Moves an engine that is between searches to its share of the memory
+   budget. Shrinking happens right away; growing only takes memory that is
+   free, i.e. that other engines or the cache already gave back. */
+static void resize_hash(Server *server, EngineSlot *slot) {
+  if (!server->budget) {
+    return;
+  }
+
+  Engine *engine = slot->engine;
+  size_t target = budget_engine_hash(server->budget, planned_engines(server));
+  size_t hash = target;
+  if (target > engine->hash_mb) {
+    size_t free_mb = free_memory_mb(server);
+    hash = engine->hash_mb + free_mb < target ? engine->hash_mb + free_mb
+                                               : target;
+  }
+  if (hash == engine->hash_mb) {
+    return;
+  }
+
+  char value[32];
+  snprintf(value, sizeof(value), "%zu", hash);
+  EngineOption option = {"Hash", value};
+  if (engine_queue_option(engine, &option) == 0) {
+    mark_queued(server, slot);
+  }
+}
+
+/* Brings idle engines and the cache in line with the budget after the pool
+   size or the cache's share changed. */
+static void rebalance_memory(Server *server) {
+  MemoryBudget *budget = server->budget;
+  if (!budget) {
+    return;
+  }
+  if (server->cache) {
+    budget_review_cache(budget, server->cache, now_ms());
+  }
+
+  // Shrink first, so the growing ones below find the memory free
+  EnginePool *pool = server->pool;
+  size_t target = budget_engine_hash(budget, planned_engines(server));
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < POOL_MAX_ENGINES; i++) {
+      EngineSlot *slot = &server->slots[i];
+      Engine *engine = &pool->engines[i];
+      if (engine->pid != 0 && !slot->cont &&
+          (pass == 0) == (engine->hash_mb > target)) {
+        resize_hash(server, slot);
+      }
+    }
+  }
+
+  if (server->cache && budget->cache_capacity_mb < budget->cache_share_mb) {
+    size_t free_mb = free_memory_mb(server);
+    size_t wanted = budget->cache_share_mb - budget->cache_capacity_mb;
+    budget->cache_capacity_mb += free_mb < wanted ? free_mb : wanted;
+    cache_resize(server->cache, budget->cache_capacity_mb << 20);
+  }
+}
+
+/* Stops watching an engine and tells it to quit; the tick reaps it. The slot
+   stays allocated, so events already fetched for it in this pass are
+   harmless. */
+static void retire_engine(Server *server, EngineSlot *slot) {
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, slot->engine->stdout_fd, NULL);
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, slot->engine->stdin_fd, NULL);
+  slot->dead = true;
+  pool_retire(server->pool, slot->engine);
+}
+
+/* Gives an engine that finished its work to the oldest waiting request, or
+   back to the pool. Engines beyond the pool's maximum size, e.g. after it
+   was lowered by SIGHUP, quit here instead. */
+static void hand_off(Server *server, EngineSlot *slot) {
+  resize_hash(server, slot);
+  while (server->pending_head) {
+    Connection *next = server->pending_head;
+    server->pending_head = next->next_pending;
+    if (!server->pending_head) {
+      server->pending_tail = NULL;
+    }
+    server->pending_count--;
+
+    if (start_search(server, slot, next) == 0) {
+      return;
+    }
+    respond_error(server, next, 500, "engine unavailable");
+    service_connection(server, next);
+  }
+
+  if (server->pool->size > server->pool->max_size) {
+    retire_engine(server, slot);
+    return;
+  }
+  slot->idle_since_ms = now_ms();
+  pool_release(server->pool, slot->engine);
+}
+
+/* A preempted request goes back in the queue with what its search found so
+   far; a search stopped at its deadline answers with it. */
+static void finish_search(Server *server, EngineSlot *slot) {
+  Connection *conn = slot->client;
+  bool stopped = slot->stopping, preempted = slot->preempted;
+  if (preempted) {
+    server->preempting--;
+  }
+  slot->stopping = slot->preempted = false;
+  if (!stopped) {
+    uint64_t elapsed = now_ms() - slot->started_ms;
+    server->search_ms =
+        server->search_ms ? (server->search_ms * 7 + elapsed) / 8 : elapsed;
+  }
+
+  if (conn) {
+    conn->slot = NULL;
+    slot->client = NULL;
+
+    SearchResult *result =
+        search_collector_finish(&slot->engine->search, &conn->arena);
+    // The search may have ended on its own before the stop arrived. One cut
+    // short stays with its request, since its last line can be from an
+    // unfinished iteration
+    bool complete =
+        !stopped || analysis_result_satisfies(result, &conn->request);
+    if (complete && server->cache) {
+      cache_store(server->cache, conn->cache_key, result);
+    }
+    if (complete && server->store) {
+      evalstore_put(server->store, conn->cache_key, result);
+    }
+
+    if (!complete) {
+      conn->partial = deeper(conn->partial, result);
+      if (preempted) {
+        enqueue(server, conn);
+      } else {
+        respond_result(server, conn, conn->partial, "engine", true);
+        service_connection(server, conn);
+      }
+    } else {
+      respond_result(server, conn, deeper(conn->partial, result), "engine",
+                     false);
+      service_connection(server, conn);
+    }
+  }
+
+  hand_off(server, slot);
+}
+
+/* Stops the batch search that started last, which loses the least work,
+   to free its engine for an interactive request. */
+static bool preempt_batch_search(Server *server) {
+  EngineSlot *victim = NULL;
+  for (size_t i = 0; i < POOL_MAX_ENGINES; i++) {
+    EngineSlot *slot = &server->slots[i];
+    if (slot->engine && slot->engine->pid != 0 && slot->client &&
+        !slot->stopping &&
+        slot->client->request.priority == PRIORITY_BATCH &&
+        (!victim || slot->started_ms > victim->started_ms)) {
+      victim = slot;
+    }
+  }
+  if (!victim || queue_command(server, victim, "stop") != 0) {
+    return false;
+  }
+  victim->stopping = victim->preempted = true;
+  server->preempting++;
+  return true;
+}
+
+static void answer_expired(Server *server, Connection *conn,
+                           const SearchResult *progress) {
+  if (progress) {
+    respond_result(server, conn, progress, "engine", true);
+  } else {
+    respond_error(server, conn, 504, "deadline exceeded");
+  }
+  service_connection(server, conn);
+}
+
+/* Answers followers past their deadline with what their flight found so
+   far. A leader past its deadline hands the search on to its followers
+   rather than stopping it. */
+static void expire_followers(Server *server, uint64_t now, uint64_t *next) {
+  for (size_t i = 0; i < SERVER_FLIGHT_BUCKETS && server->follower_count;
+       i++) {
+    Connection **link = &server->flights[i];
+    while (*link) {
+      Connection *leader = *link;
+      Connection *follower = leader->followers;
+      while (follower) {
+        Connection *after = follower->next_follower;
+        if (follower->deadline_at_ms && follower->deadline_at_ms <= now) {
+          detach_follower(server, follower);
+          answer_expired(server, follower,
+                         flight_progress(leader, &follower->arena));
+        } else if (follower->deadline_at_ms &&
+                   follower->deadline_at_ms < *next) {
+          *next = follower->deadline_at_ms;
+        }
+        follower = after;
+      }
+
+      if (leader->followers && leader->deadline_at_ms &&
+          leader->deadline_at_ms <= now) {
+        SearchResult *progress = flight_progress(leader, &leader->arena);
+        promote(server, leader);
+        answer_expired(server, leader, progress);
+        continue; // The bucket now links the new leader in its place
+      }
+      link = &leader->next_flight;
+    }
+  }
+}
+
+/* Enforces deadlines: waiting requests past theirs are answered with what
+   they have, running searches past theirs are stopped, and batch searches
+   are preempted for interactive requests that would not get an engine in
+   time otherwise. Returns the milliseconds until this next has work. */
+static int schedule(Server *server) {
+  uint64_t now = now_ms();
+  uint64_t next = now + SERVER_TICK_MS;
+  uint64_t search_ms =
+      server->search_ms ? server->search_ms : SERVER_DEFAULT_SEARCH_MS;
+
+  expire_followers(server, now, &next);
+
+  size_t urgent = 0;
+  Connection **link = &server->pending_head, *prev = NULL;
+  while (*link) {
+    Connection *conn = *link;
+    if (!conn->deadline_at_ms) {
+      prev = conn;
+      link = &conn->next_pending;
+      continue;
+    }
+
+    if (conn->deadline_at_ms <= now) {
+      *link = conn->next_pending;
+      if (server->pending_tail == conn) {
+        server->pending_tail = prev;
+      }
+      server->pending_count--;
+      answer_expired(server, conn, conn->partial);
+      continue;
+    }
+
+    uint64_t needed = conn->request.movetime ? conn->request.movetime
+                                             : search_ms;
+    uint64_t latest_start =
+        conn->deadline_at_ms > needed ? conn->deadline_at_ms - needed : 0;
+    if (conn->request.priority == PRIORITY_INTERACTIVE) {
+      if (latest_start <= now) {
+        if (++urgent > server->preempting && !preempt_batch_search(server)) {
+          urgent--; // Nothing left to preempt
+        }
+      } else if (latest_start < next) {
+        next = latest_start;
+      }
+    }
+    if (conn->deadline_at_ms < next) {
+      next = conn->deadline_at_ms;
+    }
+    prev = conn;
+    link = &conn->next_pending;
+  }
+
+  for (size_t i = 0; server->slots && i < POOL_MAX_ENGINES; i++) {
+    EngineSlot *slot = &server->slots[i];
+    Connection *conn = slot->client;
+    if (!conn || !conn->deadline_at_ms || slot->stopping) {
+      continue;
+    }
+    if (conn->deadline_at_ms <= now) {
+      if (queue_command(server, slot, "stop") == 0) {
+        slot->stopping = true;
+      }
+    } else if (conn->deadline_at_ms < next) {
+      next = conn->deadline_at_ms;
+    }
+  }
+
+  return (int)(next - now);
+}
+
+/* Fails every waiting request once no engine is left to run it. */
+static void fail_pending(Server *server) {
+  while (server->pending_head) {
+    Connection *conn = server->pending_head;
+    server->pending_head = conn->next_pending;
+    respond_error(server, conn, 503, "engine unavailable");
+    service_connection(server, conn);
+  }
+  server->pending_tail = NULL;
+  server->pending_count = 0;
+}
+
+/* Drains an engine's output, handing each line to whatever request the
+   engine is working on. */
+static void read_engine(Server *server, EngineSlot *slot) {
+  Engine *engine = slot->engine;
+
+  for (;;) {
+    StrView line;
+    while (linebuf_next(&engine->output, &line)) {
+      engine_observe(engine, line);
+      if (slot->cont) {
+        slot->cont->on_line(server, slot, line);
+      }
+      if (slot->dead) {
+        return; // Retired by the continuation
+      }
+    }
+
+    ssize_t n = linebuf_fill(&engine->output, engine->stdout_fd);
+    if (n > 0) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    fprintf(stderr, "Engine %d stopped responding\n", (int)engine->pid);
+    if (slot->cont) {
+      slot->cont->on_failure(server, slot);
+    } else {
+      pool_take(server->pool, engine);
+    }
+    retire_engine(server, slot);
+    if (server->pool->size == 0) {
+      fail_pending(server);
+    }
+    grow_pool(server);
+    return;
+  }
+}
+
+static int watch_engine(Server *server, EngineSlot *slot, Engine *engine) {
+  slot->source = SOURCE_ENGINE;
+  slot->input_source = SOURCE_ENGINE_INPUT;
+  slot->engine = engine;
+  slot->cont = NULL;
+  slot->client = NULL;
+  slot->dead = false;
+  slot->idle_since_ms = now_ms();
+
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN;
+  ev.data.ptr = slot;
+  struct epoll_event input_ev = {0};
+  input_ev.events = EPOLLOUT | EPOLLET;
+  input_ev.data.ptr = &slot->input_source;
+  if (set_nonblocking(engine->stdout_fd) == -1 ||
+      set_nonblocking(engine->stdin_fd) == -1 ||
+      epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, engine->stdout_fd, &ev) ==
+          -1 ||
+      epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, engine->stdin_fd,
+                &input_ev) == -1) {
+    fprintf(stderr, "Failed to watch engine %d: %s\n", (int)engine->pid,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* Starts watching the engines the bootstrap started. Slots are allocated for
+   the largest pool, so the pool can grow without moving them. */
+static int attach_engines(Server *server) {
+  EnginePool *pool = server->pool;
+  server->slots = calloc(POOL_MAX_ENGINES, sizeof(*server->slots));
+  server->flush = calloc(POOL_MAX_ENGINES, sizeof(*server->flush));
+  if (!server->slots || !server->flush) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < POOL_MAX_ENGINES; i++) {
+    if (pool->engines[i].pid != 0 &&
+        watch_engine(server, &server->slots[i], &pool->engines[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void handshake_on_line(Server *server, EngineSlot *slot,
+                              StrView line) {
+  if (sv_starts_with(line, "readyok")) {
+    slot->cont = NULL;
+    server->starting--;
+    printf("Engine %d started, %zu running\n", (int)slot->engine->pid,
+           server->pool->size);
+    hand_off(server, slot);
+  }
+}
+
+static void handshake_on_failure(Server *server, EngineSlot *slot) {
+  (void)slot;
+  server->starting--;
+  // The next one would most likely fail the same way
+  server->grow_blocked = true;
+}
+
+static const EngineContinuation handshake_continuation = {
+    .on_line = handshake_on_line,
+    .on_failure = handshake_on_failure,
+};
+
+/* Starts another engine; it takes requests once its handshake is through. */
+static int spawn_engine(Server *server) {
+  Engine *engine = pool_spawn(server->pool);
+  if (!engine) {
+    return -1;
+  }
+
+  EngineSlot *slot = slot_for(server, engine);
+  if (watch_engine(server, slot, engine) != 0) {
+    retire_engine(server, slot);
+    return -1;
+  }
+  slot->cont = &handshake_continuation;
+  mark_queued(server, slot);
+  server->starting++;
+  return 0;
+}
+
+/* Checks that the memory budget has room for one more engine and picks its
+   Hash from what is free. */
+static bool budget_allows_engine(Server *server) {
+  if (!server->budget) {
+    return true;
+  }
+  rebalance_memory(server);
+
+  size_t free_mb = free_memory_mb(server);
+  if (free_mb < BUDGET_ENGINE_OVERHEAD_MB + 1) {
+    return false;
+  }
+  free_mb -= BUDGET_ENGINE_OVERHEAD_MB;
+  size_t target = budget_engine_hash(server->budget, planned_engines(server));
+  server->pool->hash_mb = free_mb < target ? free_mb : target;
+  return true;
+}
+
+/* Starts engines while requests wait for one that is not already on its way,
+   and to get back to the minimum size after an engine died. */
+static void grow_pool(Server *server) {
+  EnginePool *pool = server->pool;
+  while (server->ready && !server->grow_blocked &&
+         pool->size < pool->max_size &&
+         (pool->size < pool->min_size ||
+          server->starting < server->pending_count) &&
+         budget_allows_engine(server)) {
+    if (spawn_engine(server) != 0) {
+      server->grow_blocked = true;
+    }
+  }
+}
+
+/* Retires engines above the minimum size that have been idle for a while,
+   or right away while the pool is above its maximum size. Busy engines are
+   left alone and retire when they finish. */
+static void shrink_pool(Server *server) {
+  EnginePool *pool = server->pool;
+  uint64_t now = now_ms();
+
+  for (size_t i = 0; i < POOL_MAX_ENGINES && pool->size > pool->min_size;
+       i++) {
+    EngineSlot *slot = &server->slots[i];
+    Engine *engine = &pool->engines[i];
+    if (engine->pid != 0 &&
+        (pool->size > pool->max_size ||
+         now - slot->idle_since_ms >= SERVER_ENGINE_IDLE_MS) &&
+        pool_take(pool, engine)) {
+      printf("Retiring idle engine %d\n", (int)engine->pid);
+      retire_engine(server, slot);
+    }
+  }
+}
+
+/* SIGHUP: the topology is read again, e.g. after the process was moved to
+   another cpuset, sizes that follow it are worked out again and a blocked
+   pool may try to grow again. */
+static void resize_pool(Server *server) {
+  resize_requested = 0;
+  if (!server->ready) {
+    return;
+  }
+
+  EnginePool *pool = server->pool;
+  pool_update_limits(pool);
+  printf("Resizing the engine pool to %zu-%zu engines\n", pool->min_size,
+         pool->max_size);
+  server->grow_blocked = false;
+  shrink_pool(server);
+  grow_pool(server);
+}
+
+/* Called once the bootstrap is over. Requests queued meanwhile are started
+   on the new engines, or failed if there are none. */
+static void finish_bootstrap(Server *server) {
+  uint64_t count;
+  if (read(server->bootstrap->event_fd, &count, sizeof(count)) == -1 ||
+      server->bootstrapped) {
+    return;
+  }
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->bootstrap->event_fd,
+            NULL);
+
+  // Without engines only stored results can be served from now on
+  server->bootstrapped = true;
+  server->ready = bootstrap_state(server->bootstrap) == BOOTSTRAP_READY &&
+                  attach_engines(server) == 0;
+
+  Connection *pending = server->pending_head;
+  server->pending_head = server->pending_tail = NULL;
+  server->pending_count = 0;
+  while (pending) {
+    Connection *conn = pending;
+    pending = conn->next_pending;
+    dispatch(server, conn);
+    if (!conn->busy) {
+      service_connection(server, conn);
+    }
+  }
+}
+
+static int open_listener(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Failed to bind port %u: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if (listen(fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "Failed to listen on port %u: %s\n", port,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int server_init(Server *server, Bootstrap *bootstrap, EvalCache *cache,
+                EvalStore *store, MemoryBudget *budget, Book *book,
+                const char *trace_path, uint16_t port) {
+  memset(server, 0, sizeof(*server));
+  server->source = SOURCE_LISTENER;
+  server->bootstrap_source = SOURCE_BOOTSTRAP;
+  server->bootstrap = bootstrap;
+  server->pool = bootstrap->pool;
+  server->cache = cache;
+  server->store = store;
+  server->budget = budget;
+  server->book = book;
+  server->trace_path = trace_path;
+  server->listen_fd = -1;
+
+  server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server->epoll_fd == -1) {
+    fprintf(stderr, "Failed to create epoll instance: %s\n", strerror(errno));
+    return -1;
+  }
+
+  server->listen_fd = open_listener(port);
+  if (server->listen_fd == -1) {
+    server_destroy(server);
+    return -1;
+  }
+
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN;
+  ev.data.ptr = server;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev) ==
+      -1) {
+    fprintf(stderr, "Failed to watch listening socket: %s\n", strerror(errno));
+    server_destroy(server);
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &server->bootstrap_source;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, bootstrap->event_fd, &ev) ==
+      -1) {
+    fprintf(stderr, "Failed to watch the engine setup: %s\n",
+            strerror(errno));
+    server_destroy(server);
+    return -1;
+  }
+
+  printf("Listening on port %u\n", port);
+  return 0;
+}
+
+int server_run(Server *server) {
+  struct sigaction sa = {0};
+  sa.sa_handler = handle_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = handle_resize_signal;
+  sigaction(SIGHUP, &sa, NULL);
+  sa.sa_handler = handle_trace_signal;
+  sigaction(SIGUSR2, &sa, NULL);
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  while (!stop_requested) {
+    if (resize_requested) {
+      resize_pool(server);
+      flush_engines(server);
+    }
+    if (trace_requested) {
+      trace_requested = 0;
+      trace_dump(server->trace_path);
+    }
+
+    int timeout = schedule(server);
+    flush_engines(server);
+    free_closed_connections(server);
+
+    int n = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+      return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      EventSource *source = events[i].data.ptr;
+
+      switch (*source) {
+      case SOURCE_LISTENER:
+        accept_clients(server);
+        break;
+      case SOURCE_ENGINE:
+        read_engine(server, (EngineSlot *)source);
+        break;
+      case SOURCE_ENGINE_INPUT: {
+        EngineSlot *slot = (EngineSlot *)((char *)source -
+                                          offsetof(EngineSlot, input_source));
+        if (!slot->dead && !slot->queued && engine_flush(slot->engine) == 0) {
+          search_written(slot);
+        }
+        break;
+      }
+      case SOURCE_BOOTSTRAP:
+        finish_bootstrap(server);
+        break;
+      case SOURCE_CLIENT: {
+        Connection *conn = (Connection *)source;
+        if (conn->fd < 0) {
+          break; // Closed earlier in this batch
+        }
+        // EPOLLRDHUP only ends the input, which read_input() finds out
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          close_connection(server, conn);
+        } else {
+          service_connection(server, conn);
+        }
+        break;
+      }
+      }
+    }
+
+    uint64_t now = now_ms();
+    if (server->ready && now - server->last_tick_ms >= SERVER_TICK_MS) {
+      server->last_tick_ms = now;
+      pool_reap(server->pool, now);
+      shrink_pool(server);
+      rebalance_memory(server);
+      grow_pool(server);
+    }
+
+    flush_engines(server);
+    free_closed_connections(server);
+  }
+
+  printf("Shutting down\n");
+  return 0;
+}
+
+void server_destroy(Server *server) {
+  while (server->connections) {
+    close_connection(server, server->connections);
+  }
+  free_closed_connections(server);
+  arena_free(&server->scratch);
+
+  free(server->slots);
+  free(server->flush);
+  server->slots = NULL;
+  server->flush = NULL;
+
+  if (server->listen_fd != -1) {
+    close(server->listen_fd);
+    server->listen_fd = -1;
+  }
+  if (server->epoll_fd != -1) {
+    close(server->epoll_fd);
+    server->epoll_fd = -1;
+  }
+}
@@ -0,0 +1,138 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "analysis.h"
+#include "arena.h"
+#include "book.h"
+#include "bootstrap.h"
+#include "budget.h"
+#include "cache.h"
+#include "engine.h"
+#include "evalstore.h"
+#include "pool.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SERVER_DEFAULT_PORT 8080
+#define SERVER_MAX_EVENTS 64
+#define SERVER_TICK_MS 1000
+#define SERVER_ENGINE_IDLE_MS 30000 // Idle time before a spare engine quits
+// Expected search time for deadlines until some searches have been timed
+#define SERVER_DEFAULT_SEARCH_MS 1000
+#define SERVER_FLIGHT_BUCKETS 1024 // Power of two
+
+/* Every fd registered with epoll carries a pointer to one of these tags as
+   the first member of its owning struct, which tells the loop what woke up. */
+typedef enum {
+  SOURCE_LISTENER,
+  SOURCE_CLIENT,
+  SOURCE_ENGINE,       // An engine's output can be read
+  SOURCE_ENGINE_INPUT, // An engine's input can take more commands
+  SOURCE_BOOTSTRAP,
+} EventSource;
+
+typedef struct Connection Connection;
+typedef struct EngineSlot EngineSlot;
+typedef struct Server Server;
+
+/* What an engine's output means while it works on a request. The loop hands
+   every line to the slot's continuation, which takes the engine off the
+   request once it is done with it. */
+typedef struct {
+  void (*on_line)(Server *server, EngineSlot *slot, StrView line);
+  void (*on_failure)(Server *server, EngineSlot *slot); // The engine died
+} EngineContinuation;
+
+struct EngineSlot {
+  EventSource source;
+  EventSource input_source;
+  Engine *engine;
+  const EngineContinuation *cont; // NULL while idle
+  Connection *client; // NULL when idle or after the client went away
+  bool queued;        // Has commands waiting for the end of the loop pass
+  bool dead;          // Retired; the entry is reused by the next engine
+  bool stopping;      // Sent stop; the bestmove ends a search cut short
+  bool preempted;     // Stopped for another request; requeue the client
+  uint64_t idle_since_ms;
+  uint64_t started_ms; // Start of the current search
+  uint64_t trace_id;   // Request the current search is traced under
+  uint64_t queued_ns;  // Search commands queued
+  uint64_t go_ns;      // Search commands written, 0 before
+  uint64_t info_ns;    // First info line of the search, 0 before
+};
+
+struct Connection {
+  EventSource source;
+  int fd;
+  Arena arena; // Everything belonging to the request being served
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+  StringBuilder out;
+  size_t out_sent;
+  bool keep_alive;
+  bool read_closed; // The client shut down its side; nothing more will come
+  bool busy; // A request is waiting for or running on an engine
+  AnalysisRequest request;
+  uint64_t cache_key;
+  uint64_t deadline_at_ms; // 0 without a deadline
+  uint64_t received_us;    // When the request was parsed, for metrics
+  uint64_t queued_ns;      // When it last had to wait for an engine
+  uint64_t trace_id;       // 0 until the request is known to be an analysis
+  uint64_t trace_start_ns; // When parsing the request began
+  SearchResult *partial;   // Deepest result of searches that were cut short
+  EngineSlot *slot;
+  bool streaming;          // The chunked response has started
+  uint16_t streamed_depth; // Deepest update sent to the flight's streams
+  // Identical requests share one search: the first one leads the flight and
+  // owns the engine or queue position, the others follow it
+  uint64_t flight_key;
+  bool leading;
+  Connection *leader;
+  Connection *followers;
+  Connection *next_follower;
+  Connection *next_flight; // Chains the leaders in a flight table bucket
+  Connection *next_pending;
+  Connection *prev, *next; // All open connections
+};
+
+struct Server {
+  EventSource source;
+  int epoll_fd;
+  int listen_fd;
+  EventSource bootstrap_source; // Tags the bootstrap's eventfd
+  Bootstrap *bootstrap;
+  EnginePool *pool; // Usable once ready is set
+  bool bootstrapped;
+  bool ready;
+  EvalCache *cache; // NULL when caching is disabled
+  EvalStore *store; // NULL when the persistent store is disabled
+  MemoryBudget *budget; // NULL without --mem-budget
+  Book *book;           // NULL without --book
+  const char *trace_path; // Where SIGUSR2 writes the trace
+  EngineSlot *slots;
+  EngineSlot **flush; // Slots with queued commands
+  size_t flush_count;
+  Connection *connections;
+  Connection *closed; // Freed once the current batch of events is handled
+  Connection *pending_head, *pending_tail; // By priority, then deadline
+  Connection *flights[SERVER_FLIGHT_BUCKETS];
+  size_t follower_count;
+  Arena scratch; // Stream updates, built once for the whole flight
+  size_t pending_count;
+  size_t preempting;  // Searches stopped to make room that have not ended
+  uint64_t search_ms; // Moving average of the time searches take
+  size_t starting;   // Engines spawned but not through their handshake yet
+  bool grow_blocked; // A new engine failed; wait for SIGHUP to try again
+  uint64_t last_tick_ms;
+};
+
+int server_init(Server *server, Bootstrap *bootstrap, EvalCache *cache,
+                EvalStore *store, MemoryBudget *budget, Book *book,
+                const char *trace_path, uint16_t port);
+int server_run(Server *server);
+void server_destroy(Server *server);
+
+#endif
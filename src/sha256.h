@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length; // Bytes hashed so far
+  uint8_t block[64];
+  size_t block_fill;
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, char hex[SHA256_HEX_SIZE]);
+int sha256_file(const char *path, char hex[SHA256_HEX_SIZE]);
+
+#endif
@@ -1,180 +1,325 @@
+#define _GNU_SOURCE
 #include "tar.h"
 #include "arena.h"
 #include "utils.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <linux/limits.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-bool extract_tar_item(Arena *arena, struct posix_header *hdr, FILE *tar_file,
-                      const char *rootdir, const char *regex_pattern) {
-  char *output_path = arena_sprintf(arena, "%s%s", rootdir, hdr->name);
+int tar_stream_init(TarStream *ts, Arena *arena, const char *rootdir,
+                    const char *regex_pattern) {
+  assert(rootdir[strlen(rootdir) - 1] == '/');
+  memset(ts, 0, sizeof(*ts));
+  ts->state = TAR_STATE_HEADER;
+  ts->out_fd = -1;
+  ts->arena = arena;
+  ts->rootdir = rootdir;
+
+  printf("Extracting into rootdir: %s\n", rootdir);
+  if (ensure_directory_exists(rootdir) != 0) {
+    fprintf(stderr, "Failed to access the root directory: %s\n", rootdir);
+    return -1;
+  }
+
+  /* Compiled once for the whole archive rather than once per member */
+  if (strlen(regex_pattern) > 0) {
+    if (regcomp(&ts->regex, regex_pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+      fprintf(stderr, "Could not compile regex pattern\n");
+      return -1;
+    }
+    ts->has_regex = true;
+  }
+  return 0;
+}
+
+static bool is_regular(const struct posix_header *hdr) {
+  return hdr->typeflag == REGTYPE || hdr->typeflag == AREGTYPE ||
+         hdr->typeflag == CONTTYPE;
+}
 
-  ulong file_size;
-  bool valid_file_size = parse_octal(hdr->size, 12, &file_size);
+/* Creates a link, removing whatever is at the path first so re-extracting
+   overwrites it. */
+static bool replace_with_link(const char *target, const char *path,
+                              bool symbolic) {
+  if (check_file_accessible(path) && remove(path) != 0) {
+    fprintf(stderr, "Failed to overwrite output file\n");
+    return false;
+  }
+  if ((symbolic ? symlink(target, path) : link(target, path)) != 0) {
+    fprintf(stderr, "Failed to extract %s link\n", symbolic ? "soft" : "hard");
+    return false;
+  }
+  return true;
+}
+
+static bool finish_member(TarStream *ts) {
+  if (ts->out_fd == -1) {
+    return true;
+  }
+  int rc = fchmod(ts->out_fd, ts->mode);
+  rc |= close(ts->out_fd);
+  ts->out_fd = -1;
+  if (rc != 0 || rename(ts->part_path, ts->out_path) != 0) {
+    fprintf(stderr, "Failed to finish extracting %s: %s\n", ts->out_path,
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
 
-  if (!valid_file_size) {
+/* Handles a complete header: decides whether the member is wanted and sets
+   up the state for the data blocks that follow it. */
+static bool begin_member(TarStream *ts) {
+  struct posix_header *hdr = &ts->header;
+  ulong file_size, mode;
+  if (!parse_octal(hdr->size, 12, &file_size)) {
     fprintf(stderr, "Failed to read the file size of one of the files inside "
                     "the tar ball\n");
     return false;
   }
+  // Permission bits only; set-id bits are not restored, as with tar(1)
+  ts->mode = parse_octal(hdr->mode, 8, &mode) ? mode & 0777 : 0644;
 
-  /* Filter by regex pattern if provided (directories are always extracted) */
-  if (strlen(regex_pattern) > 0 && hdr->typeflag != DIRTYPE) {
-    regex_t regex;
-    int reti = regcomp(&regex, regex_pattern, REG_EXTENDED);
-    if (reti) {
-      fprintf(stderr, "Could not compile regex pattern\n");
-      return false;
-    }
+  arena_reset(ts->arena);
+  char *name = arena_sprintf(ts->arena, "%.*s%s%.*s",
+                             (int)strnlen(hdr->prefix, sizeof(hdr->prefix)),
+                             hdr->prefix, hdr->prefix[0] ? "/" : "",
+                             (int)strnlen(hdr->name, sizeof(hdr->name)),
+                             hdr->name);
+  char *output_path = arena_sprintf(ts->arena, "%s%s", ts->rootdir, name);
 
-    reti = regexec(&regex, hdr->name, 0, NULL, 0);
-    regfree(&regex);
+  /* Only regular files carry data; the rest of the entry types have none */
+  ts->remaining = is_regular(hdr) ? file_size : 0;
+  ts->padding = (TAR_BLOCK_SIZE - ts->remaining % TAR_BLOCK_SIZE) %
+                TAR_BLOCK_SIZE;
+  ts->state = ts->remaining ? TAR_STATE_DATA : TAR_STATE_HEADER;
 
-    if (reti == REG_NOMATCH) {
-      /* Skip this file's data blocks if it's a regular file */
-      if (hdr->typeflag == REGTYPE || hdr->typeflag == AREGTYPE) {
-        size_t blocks = (file_size + 511) / 512;
-        fseek(tar_file, blocks * TAR_BLOCK_SIZE, SEEK_CUR);
-      }
-      return true;
-    } else if (reti) {
-      fprintf(stderr, "Regex match failed\n");
-      return false;
-    }
+  /* Filter by regex pattern if provided (directories are always extracted) */
+  if (ts->has_regex && hdr->typeflag != DIRTYPE &&
+      regexec(&ts->regex, name, 0, NULL, 0) == REG_NOMATCH) {
+    return true;
   }
 
-  /* Switch for type flag matching */
-  if (hdr->typeflag == REGTYPE || hdr->typeflag == AREGTYPE) {
-    printf("Extracting file: %s...\n", hdr->name);
-    FILE *output_file;
-    output_file = fopen(output_path, "ab");
-    if (!output_file) {
+  if (is_regular(hdr)) {
+    printf("Extracting file: %s...\n", name);
+    ts->out_path = output_path;
+    ts->part_path = arena_sprintf(ts->arena, "%s.part", output_path);
+    ts->out_fd = open(ts->part_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0600);
+    if (ts->out_fd == -1) {
       fprintf(stderr, "Failed to open or create file at path %s\n",
-              output_path);
+              ts->part_path);
       return false;
     }
-
-    size_t blocks = (file_size + 511) / 512;
-    for (size_t i = 0; i < blocks; i++) {
-      char buf[TAR_BLOCK_SIZE];
-      if (fread(buf, TAR_BLOCK_SIZE, 1, tar_file) != 1) {
-        fprintf(stderr, "Unexpected EOF reading file data\n");
-        fclose(output_file);
-        return false;
-      }
-
-      // TODO: Write buffer to output file or create a directory
-      if (fwrite(buf, sizeof(buf), 1, output_file) != 1) {
-        fprintf(stderr, "Failed to write extracted data into file\n");
-        fclose(output_file);
-        return false;
-      }
+    // An empty file has no data blocks to finish it
+    if (ts->remaining == 0) {
+      return finish_member(ts);
     }
-
-    fclose(output_file);
   } else if (hdr->typeflag == LNKTYPE) {
-    printf("Extracting hard link: %s link to %s...\n", hdr->name,
-           hdr->linkname);
+    printf("Extracting hard link: %s link to %s...\n", name, hdr->linkname);
     char *original_file_path =
-        arena_sprintf(arena, "%s%s", rootdir, hdr->linkname);
-
-    // TODO: Schedule the creation of the hard link
+        arena_sprintf(ts->arena, "%s%s", ts->rootdir, hdr->linkname);
     if (ensure_file_exists(original_file_path) != 0) {
       fprintf(
           stderr,
           "Failed to create a temporary original file %s for hard link %s\n",
-          hdr->linkname, hdr->name);
-      return false;
-    }
-
-    // The hard link file needs to be removed in order for link() to overwrite
-    if (check_file_accessible(output_path)) {
-      if (remove(output_path) != 0) {
-        fprintf(stderr, "Failed to overwrite output file\n");
-        return false;
-      }
-    }
-
-    if (link(original_file_path, output_path) != 0) {
-      fprintf(stderr, "Failed to extract hard link\n");
+          hdr->linkname, name);
       return false;
     }
+    return replace_with_link(original_file_path, output_path, false);
   } else if (hdr->typeflag == SYMTYPE) {
-    printf("Extracting soft link: %s -> %s...\n", hdr->name, hdr->linkname);
-    // The symbolic link file needs to be removed in order for symlink() to
-    // overwrite
-    if (check_file_accessible(output_path)) {
-      if (remove(output_path) != 0) {
-        fprintf(stderr, "Failed to overwrite output file\n");
-        return false;
-      }
-    }
-    if (symlink(hdr->linkname, output_path) != 0) {
-      fprintf(stderr, "Failed to extract soft link\n");
-      return false;
-    }
-  } else if (hdr->typeflag == CHRTYPE || hdr->typeflag == BLKTYPE) {
-    printf("Extracting special file: %s...\n", hdr->name);
+    printf("Extracting soft link: %s -> %s...\n", name, hdr->linkname);
+    return replace_with_link(hdr->linkname, output_path, true);
   } else if (hdr->typeflag == DIRTYPE) {
-    printf("Extracting directory: %s...\n", hdr->name);
-    // TODO: Get mode from tar header
-    if (ensure_directory_exists(output_path) != 0) {
-      fprintf(stderr, "Failed to extract directory\n");
+    printf("Extracting directory: %s...\n", name);
+    // Keep it writable for us, or its own members could not be extracted
+    if (mkdir(output_path, ts->mode | S_IRWXU) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Failed to extract directory %s: %s\n", output_path,
+              strerror(errno));
       return false;
     }
-    return true;
-  } else if (hdr->typeflag == FIFOTYPE) {
-    printf("Extracting FIFO special file: %s...\n", hdr->name);
-  } else if (hdr->typeflag == CONTTYPE) {
-    printf("Extracting contiguous file: %s...\n", hdr->name);
+  } else {
+    printf("Skipping special file: %s...\n", name);
   }
-
   return true;
 }
 
-int extract_tar(Arena *arena, const char *path, const char *rootdir,
-                const char *regex_pattern) {
-  assert(rootdir[strlen(rootdir) - 1] == '/');
+/* Consumes the next piece of the archive. Returns false on a malformed
+   archive or a write error; feeding after that keeps failing. */
+bool tar_stream_feed(TarStream *ts, const char *data, size_t len) {
+  while (len > 0 && ts->state != TAR_STATE_ERROR) {
+    size_t n;
+    switch (ts->state) {
+    case TAR_STATE_HEADER:
+      n = TAR_BLOCK_SIZE - ts->header_fill;
+      n = n < len ? n : len;
+      memcpy((char *)&ts->header + ts->header_fill, data, n);
+      ts->header_fill += n;
+      if (ts->header_fill == TAR_BLOCK_SIZE) {
+        ts->header_fill = 0;
+        if (ts->header.name[0] == '\0') {
+          ts->state = TAR_STATE_END;
+        } else if (!begin_member(ts)) {
+          fprintf(stderr, "Failed to extract %.100s\n", ts->header.name);
+          ts->state = TAR_STATE_ERROR;
+        }
+      }
+      break;
 
-  printf("Extracting into rootdir: %s\n", rootdir);
+    case TAR_STATE_DATA:
+      n = ts->remaining < len ? ts->remaining : len;
+      if (ts->out_fd != -1 && write_all(ts->out_fd, data, n) != 0) {
+        fprintf(stderr, "Failed to write extracted data into file\n");
+        ts->state = TAR_STATE_ERROR;
+        break;
+      }
+      ts->remaining -= n;
+      if (ts->remaining == 0) {
+        if (!finish_member(ts)) {
+          ts->state = TAR_STATE_ERROR;
+        } else {
+          ts->state = ts->padding ? TAR_STATE_PADDING : TAR_STATE_HEADER;
+        }
+      }
+      break;
 
-  if (ensure_directory_exists(rootdir) != 0) {
-    fprintf(stderr, "Failed to access the root directory: %s\n", rootdir);
+    case TAR_STATE_PADDING:
+      n = ts->padding < len ? ts->padding : len;
+      ts->padding -= n;
+      if (ts->padding == 0) {
+        ts->state = TAR_STATE_HEADER;
+      }
+      break;
+
+    case TAR_STATE_END:
+      return true; // Trailing zero blocks and whatever follows them
+    default:
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return ts->state != TAR_STATE_ERROR;
+}
+
+/* Releases the stream, returning 0 only if the archive ended cleanly. A
+   half written member is removed. */
+int tar_stream_finish(TarStream *ts) {
+  bool complete = ts->state == TAR_STATE_END ||
+                  (ts->state == TAR_STATE_HEADER && ts->header_fill == 0);
+  if (ts->out_fd != -1) {
+    close(ts->out_fd);
+    ts->out_fd = -1;
+    unlink(ts->part_path);
+  }
+  if (ts->has_regex) {
+    regfree(&ts->regex);
+    ts->has_regex = false;
+  }
+  if (!complete) {
+    fprintf(stderr, "Tar ball ended in the middle of a member\n");
     return -1;
   }
+  return 0;
+}
 
-  if (!check_file_accessible(path)) {
+/* Writes the current member's data straight from the archive file, letting
+   the kernel copy it when it can. */
+static bool copy_member(TarStream *ts, int tar_fd, const char *map,
+                        uint64_t offset) {
+  loff_t in_offset = offset;
+  while (ts->remaining > 0) {
+    ssize_t n = copy_file_range(tar_fd, &in_offset, ts->out_fd, NULL,
+                                ts->remaining, 0);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      // Not supported between these files; write from the mapping instead
+      break;
+    }
+    ts->remaining -= n;
+  }
+  if (ts->remaining > 0 &&
+      write_all(ts->out_fd, map + in_offset, ts->remaining) != 0) {
+    fprintf(stderr, "Failed to write extracted data into file\n");
+    return false;
+  }
+  ts->remaining = 0;
+  return finish_member(ts);
+}
+
+/* Extracts a tarball already on disk. The archive is mapped once; headers
+   are read from the mapping and member data is copied in one go per member
+   rather than block by block. */
+int extract_tar(Arena *arena, const char *path, const char *rootdir,
+                const char *regex_pattern) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
     fprintf(stderr, "Failed to find tar ball at %s\n", path);
+    if (fd != -1) {
+      close(fd);
+    }
     return -1;
   }
 
-  FILE *f;
-  f = fopen(path, "rb");
-  if (!f) {
-    fprintf(stderr, "Something went wrong while trying to read at %s\n", path);
+  size_t size = st.st_size;
+  const char *map = NULL;
+  if (size > 0) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "Failed to map tar ball at %s: %s\n", path,
+              strerror(errno));
+      close(fd);
+      return -1;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+  }
+
+  TarStream ts;
+  if (tar_stream_init(&ts, arena, rootdir, regex_pattern) != 0) {
+    if (map) {
+      munmap((void *)map, size);
+    }
+    close(fd);
     return -1;
   }
 
-  struct posix_header hdr;
-  while (fread(&hdr, TAR_BLOCK_SIZE, 1, f)) {
-    arena_reset(arena);
-    if (hdr.name[0] == '\0') {
-      break;
+  bool ok = true;
+  uint64_t offset = 0;
+  while (ok && offset + TAR_BLOCK_SIZE <= size && ts.state != TAR_STATE_END) {
+    ok = tar_stream_feed(&ts, map + offset, TAR_BLOCK_SIZE);
+    offset += TAR_BLOCK_SIZE;
+    if (!ok || ts.state != TAR_STATE_DATA) {
+      continue;
     }
 
-    if (!extract_tar_item(arena, &hdr, f, rootdir, regex_pattern)) {
-      fprintf(stderr, "Failed to extract %s\n", hdr.name);
-      fclose(f);
-      return -1;
+    uint64_t blocks = (ts.remaining + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+    if (ts.remaining > size - offset) {
+      break; // Truncated; tar_stream_finish() reports it
+    }
+    if (ts.out_fd != -1) {
+      ok = copy_member(&ts, fd, map, offset);
     }
+    ts.remaining = 0;
+    ts.padding = 0;
+    ts.state = TAR_STATE_HEADER;
+    offset += blocks * TAR_BLOCK_SIZE;
   }
 
-  fclose(f);
-
-  return 0;
+  int rc = tar_stream_finish(&ts);
+  if (map) {
+    munmap((void *)map, size);
+  }
+  close(fd);
+  return ok ? rc : -1;
 }
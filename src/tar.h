@@ -2,8 +2,11 @@
 #define TAR_H
 
 #include "arena.h"
+#include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 /* tar Header Block, from POSIX 1003.1-1990.  */
 
@@ -42,8 +45,39 @@ struct posix_header { /* byte offset */
 
 #define TAR_BLOCK_SIZE 512
 
-bool extract_tar_item(Arena *arena, struct posix_header *hdr, FILE *tar_file,
-                      const char *rootdir, const char *regex_pattern);
+typedef enum {
+  TAR_STATE_HEADER,
+  TAR_STATE_DATA,
+  TAR_STATE_PADDING,
+  TAR_STATE_END,
+  TAR_STATE_ERROR,
+} TarState;
+
+/* Push based tar reader: bytes are fed in whatever pieces they arrive in
+   (e.g. straight from a curl write callback) and members matching the
+   pattern are written out as their data goes by. A regular file is written
+   under a temporary name and renamed once complete, so an interrupted
+   extraction never leaves a truncated file at the final path. */
+typedef struct {
+  TarState state;
+  struct posix_header header;
+  size_t header_fill;
+  uint64_t remaining; // Data bytes left in the current member
+  uint64_t padding;   // Bytes up to the next block boundary
+  int out_fd;         // -1 while skipping the current member's data
+  mode_t mode;        // Permission bits from the current header
+  char *out_path;
+  char *part_path;
+  Arena *arena;
+  const char *rootdir;
+  regex_t regex;
+  bool has_regex;
+} TarStream;
+
+int tar_stream_init(TarStream *ts, Arena *arena, const char *rootdir,
+                    const char *regex_pattern);
+bool tar_stream_feed(TarStream *ts, const char *data, size_t len);
+int tar_stream_finish(TarStream *ts);
 int extract_tar(Arena *arena, const char *path, const char *rootdir,
                 const char *regex_pattern);
 
@@ -0,0 +1,105 @@
+#include "trace.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Spans go into a fixed ring that any thread can write to without a lock:
+   a writer claims the next slot with one fetch_add and publishes it through
+   the slot's sequence number, which is 0 while the slot is being written.
+   A reader copies a slot and only keeps the copy if the sequence number was
+   the same non-zero value before and after. */
+typedef struct {
+  _Atomic uint64_t seq; // Claimed index + 1 of the span in the slot
+  uint64_t id;          // Request the span belongs to
+  const char *name;     // Static string
+  uint64_t start_ns;
+  uint64_t end_ns;
+} TraceSpan;
+
+static TraceSpan ring[TRACE_EVENTS];
+static atomic_uint_fast64_t head;
+static atomic_uint_fast64_t last_id;
+
+uint64_t trace_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t trace_next_id(void) {
+  return atomic_fetch_add_explicit(&last_id, 1, memory_order_relaxed) + 1;
+}
+
+void trace_span(uint64_t id, const char *name, uint64_t start_ns,
+                uint64_t end_ns) {
+  uint64_t index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+  TraceSpan *span = &ring[index & (TRACE_EVENTS - 1)];
+  atomic_store_explicit(&span->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  span->id = id;
+  span->name = name;
+  span->start_ns = start_ns;
+  span->end_ns = end_ns;
+  atomic_store_explicit(&span->seq, index + 1, memory_order_release);
+}
+
+static bool read_span(const TraceSpan *slot, TraceSpan *copy) {
+  uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if (seq == 0) {
+    return false;
+  }
+  copy->id = slot->id;
+  copy->name = slot->name;
+  copy->start_ns = slot->start_ns;
+  copy->end_ns = slot->end_ns;
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+}
+
+/* Writes the spans of request id, or of every request for an id of 0, as a
+   Chrome trace-event object that chrome://tracing and Perfetto load. Each
+   request gets a row of its own. */
+void trace_format(Arena *arena, StringBuilder *sb, uint64_t id) {
+  int pid = (int)getpid();
+  bool first = true;
+  sb_appendf(arena, sb, "{\"traceEvents\":[");
+  uint64_t end = atomic_load_explicit(&head, memory_order_acquire);
+  uint64_t start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+  for (uint64_t i = start; i < end; i++) {
+    TraceSpan span;
+    if (!read_span(&ring[i & (TRACE_EVENTS - 1)], &span) ||
+        (id && span.id != id)) {
+      continue;
+    }
+    sb_appendf(arena, sb,
+               "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+               "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%llu}",
+               first ? "" : ",", span.name, span.start_ns / 1000.0,
+               (span.end_ns - span.start_ns) / 1000.0, pid,
+               (unsigned long long)span.id);
+    first = false;
+  }
+  sb_appendf(arena, sb, "],\"displayTimeUnit\":\"ms\"}");
+}
+
+int trace_dump(const char *path) {
+  Arena arena = {0};
+  StringBuilder sb = {0};
+  trace_format(&arena, &sb, 0);
+
+  FILE *file = fopen(path, "w");
+  bool ok = file && fwrite(sb.items, 1, sb.count, file) == sb.count;
+  if (file && fclose(file) != 0) {
+    ok = false;
+  }
+  arena_free(&arena);
+  if (!ok) {
+    fprintf(stderr, "Failed to write the trace to %s\n", path);
+    return -1;
+  }
+  printf("Wrote the trace to %s\n", path);
+  return 0;
+}
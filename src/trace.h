@@ -0,0 +1,18 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "arena.h"
+#include "utils.h"
+#include <stdint.h>
+
+#define TRACE_EVENTS (1 << 14) // Spans kept, the oldest are overwritten
+#define TRACE_DEFAULT_PATH "trace.json"
+
+uint64_t trace_now_ns(void);
+uint64_t trace_next_id(void);
+void trace_span(uint64_t id, const char *name, uint64_t start_ns,
+                uint64_t end_ns);
+void trace_format(Arena *arena, StringBuilder *sb, uint64_t id);
+int trace_dump(const char *path);
+
+#endif
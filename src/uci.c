@@ -0,0 +1,275 @@
+#include "uci.h"
+#include "arena.h"
+#include "linebuf.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+static bool parse_u64(StrView token, uint64_t *value) {
+  if (token.len == 0) {
+    return false;
+  }
+
+  *value = 0;
+  for (size_t i = 0; i < token.len; i++) {
+    char c = token.data[i];
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    *value = *value * 10 + (c - '0');
+  }
+  return true;
+}
+
+static bool parse_i32(StrView token, int32_t *value) {
+  bool negative = token.len > 0 && token.data[0] == '-';
+  if (negative) {
+    token.data++;
+    token.len--;
+  }
+
+  uint64_t magnitude;
+  if (!parse_u64(token, &magnitude) || magnitude > INT32_MAX) {
+    return false;
+  }
+
+  *value = negative ? -(int32_t)magnitude : (int32_t)magnitude;
+  return true;
+}
+
+static bool parse_u16(StrView token, uint16_t *value) {
+  uint64_t v;
+  if (!parse_u64(token, &v) || v > UINT16_MAX) {
+    return false;
+  }
+  *value = (uint16_t)v;
+  return true;
+}
+
+static bool parse_square(const char *s, unsigned *square) {
+  if (s[0] < 'a' || s[0] > 'h' || s[1] < '1' || s[1] > '8') {
+    return false;
+  }
+  *square = (unsigned)(s[1] - '1') * 8 + (unsigned)(s[0] - 'a');
+  return true;
+}
+
+bool uci_parse_move(StrView token, uint16_t *move) {
+  if (token.len != 4 && token.len != 5) {
+    return false;
+  }
+
+  unsigned from, to, promo = PROMOTE_NONE;
+  if (!parse_square(token.data, &from) || !parse_square(token.data + 2, &to)) {
+    return false;
+  }
+
+  if (token.len == 5) {
+    switch (token.data[4]) {
+    case 'n':
+      promo = PROMOTE_KNIGHT;
+      break;
+    case 'b':
+      promo = PROMOTE_BISHOP;
+      break;
+    case 'r':
+      promo = PROMOTE_ROOK;
+      break;
+    case 'q':
+      promo = PROMOTE_QUEEN;
+      break;
+    default:
+      return false;
+    }
+  }
+
+  *move = MOVE_MAKE(from, to, promo);
+  return *move != MOVE_NONE;
+}
+
+void uci_format_move(uint16_t move, char out[UCI_MOVE_MAX_LEN]) {
+  if (move == MOVE_NONE) {
+    strcpy(out, "0000");
+    return;
+  }
+
+  unsigned from = MOVE_FROM(move), to = MOVE_TO(move);
+  out[0] = 'a' + from % 8;
+  out[1] = '1' + from / 8;
+  out[2] = 'a' + to % 8;
+  out[3] = '1' + to / 8;
+  out[4] = " nbrq"[MOVE_PROMOTION(move)];
+  out[MOVE_PROMOTION(move) ? 5 : 4] = '\0';
+}
+
+/* Parses an "info ..." line. Returns false for lines that carry no score
+   (currmove updates, "info string", ...), which callers simply skip. */
+bool uci_parse_info(StrView line, UciInfo *info, uint16_t *pv_storage,
+                    size_t pv_capacity) {
+  StrView rest = line, token;
+  if (!sv_next_token(&rest, &token) || !sv_eq(token, "info")) {
+    return false;
+  }
+
+  memset(info, 0, sizeof(*info));
+  info->multipv = 1;
+  info->pv = pv_storage;
+
+  while (sv_next_token(&rest, &token)) {
+    StrView value;
+    if (sv_eq(token, "string")) {
+      return false;
+    } else if (sv_eq(token, "pv")) {
+      uint16_t move;
+      while (sv_next_token(&rest, &value) && info->pv_count < pv_capacity &&
+             uci_parse_move(value, &move)) {
+        pv_storage[info->pv_count++] = move;
+      }
+      break;
+    } else if (sv_eq(token, "score")) {
+      if (!sv_next_token(&rest, &token) || !sv_next_token(&rest, &value)) {
+        return false;
+      }
+      if (sv_eq(token, "cp")) {
+        info->score.kind = SCORE_CP;
+      } else if (sv_eq(token, "mate")) {
+        info->score.kind = SCORE_MATE;
+      } else {
+        return false;
+      }
+      if (!parse_i32(value, &info->score.value)) {
+        return false;
+      }
+      info->has_score = true;
+    } else if (sv_eq(token, "lowerbound")) {
+      info->score.bound = BOUND_LOWER;
+    } else if (sv_eq(token, "upperbound")) {
+      info->score.bound = BOUND_UPPER;
+    } else if (!sv_next_token(&rest, &value)) {
+      break;
+    } else if (sv_eq(token, "depth")) {
+      parse_u16(value, &info->depth);
+    } else if (sv_eq(token, "seldepth")) {
+      parse_u16(value, &info->seldepth);
+    } else if (sv_eq(token, "multipv")) {
+      parse_u16(value, &info->multipv);
+    } else if (sv_eq(token, "nodes")) {
+      parse_u64(value, &info->nodes);
+    } else if (sv_eq(token, "nps")) {
+      parse_u64(value, &info->nps);
+    } else if (sv_eq(token, "time")) {
+      parse_u64(value, &info->time_ms);
+    }
+  }
+
+  return info->has_score;
+}
+
+bool uci_parse_bestmove(StrView line, uint16_t *bestmove, uint16_t *ponder) {
+  StrView rest = line, token;
+  if (!sv_next_token(&rest, &token) || !sv_eq(token, "bestmove")) {
+    return false;
+  }
+
+  *bestmove = MOVE_NONE;
+  *ponder = MOVE_NONE;
+
+  // "bestmove (none)" is sent when the side to move has no legal moves
+  if (sv_next_token(&rest, &token)) {
+    uci_parse_move(token, bestmove);
+  }
+  if (sv_next_token(&rest, &token) && sv_eq(token, "ponder") &&
+      sv_next_token(&rest, &token)) {
+    uci_parse_move(token, ponder);
+  }
+  return true;
+}
+
+void search_collector_reset(SearchCollector *collector) {
+  memset(collector->lines, 0, sizeof(collector->lines));
+  collector->line_count = 0;
+  collector->nodes = 0;
+  collector->nps = 0;
+  collector->time_ms = 0;
+  collector->bestmove = MOVE_NONE;
+  collector->ponder = MOVE_NONE;
+  collector->done = false;
+}
+
+/* Feeds one line of engine output. Returns true once bestmove was seen. */
+bool search_collector_feed(SearchCollector *collector, StrView line) {
+  if (sv_starts_with(line, "bestmove")) {
+    collector->done =
+        uci_parse_bestmove(line, &collector->bestmove, &collector->ponder);
+    return collector->done;
+  }
+
+  UciInfo info;
+  uint16_t pv[UCI_MAX_PV];
+  if (!uci_parse_info(line, &info, pv, UCI_MAX_PV) || info.multipv == 0 ||
+      info.multipv > UCI_MAX_MULTIPV) {
+    return false;
+  }
+
+  size_t slot = info.multipv - 1;
+  memcpy(collector->pv[slot], pv, info.pv_count * sizeof(*pv));
+  info.pv = collector->pv[slot];
+  collector->lines[slot] = info;
+  if (slot >= collector->line_count) {
+    collector->line_count = slot + 1;
+  }
+
+  if (info.nodes > collector->nodes) {
+    collector->nodes = info.nodes;
+  }
+  if (info.nps) {
+    collector->nps = info.nps;
+  }
+  if (info.time_ms > collector->time_ms) {
+    collector->time_ms = info.time_ms;
+  }
+  return false;
+}
+
+SearchResult *search_collector_finish(SearchCollector *collector,
+                                      Arena *arena) {
+  size_t move_count = 0;
+  for (size_t i = 0; i < collector->line_count; i++) {
+    move_count += collector->lines[i].pv_count;
+  }
+
+  size_t size = sizeof(SearchResult) +
+                collector->line_count * sizeof(PvLine) +
+                move_count * sizeof(uint16_t);
+  SearchResult *result = arena_alloc(arena, size);
+
+  result->size = (uint32_t)size;
+  result->bestmove = collector->bestmove;
+  result->ponder = collector->ponder;
+  result->nodes = collector->nodes;
+  result->nps = collector->nps;
+  result->time_ms = collector->time_ms;
+  result->line_count = (uint16_t)collector->line_count;
+
+  uint16_t *moves = (uint16_t *)&result->lines[result->line_count];
+  uint32_t offset = 0;
+  for (size_t i = 0; i < collector->line_count; i++) {
+    const UciInfo *info = &collector->lines[i];
+    PvLine *line = &result->lines[i];
+
+    line->depth = info->depth;
+    line->seldepth = info->seldepth;
+    line->score = info->score;
+    line->pv_offset = offset;
+    line->pv_count = info->pv_count;
+
+    memcpy(moves + offset, info->pv, info->pv_count * sizeof(uint16_t));
+    offset += info->pv_count;
+  }
+
+  return result;
+}
+
+const uint16_t *search_result_moves(const SearchResult *result) {
+  return (const uint16_t *)&result->lines[result->line_count];
+}
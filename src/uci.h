@@ -0,0 +1,96 @@
+#ifndef UCI_H
+#define UCI_H
+
+#include "arena.h"
+#include "linebuf.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Moves are packed into 16 bits: from square in bits 0-5, to square in bits
+   6-11 and the promotion piece in bits 12-14. Squares are numbered a1 = 0 up
+   to h8 = 63. A zero move means "no move". */
+#define MOVE_NONE 0
+#define MOVE_FROM(m) ((m) & 0x3f)
+#define MOVE_TO(m) (((m) >> 6) & 0x3f)
+#define MOVE_PROMOTION(m) (((m) >> 12) & 0x7)
+#define MOVE_MAKE(from, to, promo)                                             \
+  ((uint16_t)((from) | ((to) << 6) | ((promo) << 12)))
+
+enum { PROMOTE_NONE, PROMOTE_KNIGHT, PROMOTE_BISHOP, PROMOTE_ROOK, PROMOTE_QUEEN };
+
+#define UCI_MOVE_MAX_LEN 6 // "e7e8q" plus the terminator
+#define UCI_MAX_MULTIPV 16
+#define UCI_MAX_PV 128
+
+typedef enum { SCORE_CP, SCORE_MATE } ScoreKind;
+typedef enum { BOUND_EXACT, BOUND_LOWER, BOUND_UPPER } ScoreBound;
+
+typedef struct {
+  int32_t value;
+  uint8_t kind;  // ScoreKind
+  uint8_t bound; // ScoreBound
+} UciScore;
+
+typedef struct {
+  uint16_t multipv;
+  uint16_t depth;
+  uint16_t seldepth;
+  bool has_score;
+  UciScore score;
+  uint64_t nodes;
+  uint64_t nps;
+  uint64_t time_ms;
+  uint16_t pv_count;
+  uint16_t *pv; // Points into caller provided storage, never allocated
+} UciInfo;
+
+typedef struct {
+  uint16_t depth;
+  uint16_t seldepth;
+  UciScore score;
+  uint32_t pv_offset; // Index of the first move in search_result_moves()
+  uint16_t pv_count;
+} PvLine;
+
+/* A finished search packed into a single allocation: this header, then
+   line_count PvLines, then every PV move back to back. It contains no
+   pointers, so it can be copied or written out with a single memcpy of
+   size bytes. */
+typedef struct {
+  uint32_t size;
+  uint16_t bestmove;
+  uint16_t ponder;
+  uint64_t nodes;
+  uint64_t nps;
+  uint64_t time_ms;
+  uint16_t line_count;
+  PvLine lines[];
+} SearchResult;
+
+/* Accumulates the latest info line per multipv slot until bestmove arrives. */
+typedef struct {
+  UciInfo lines[UCI_MAX_MULTIPV];
+  uint16_t pv[UCI_MAX_MULTIPV][UCI_MAX_PV];
+  size_t line_count;
+  uint64_t nodes;
+  uint64_t nps;
+  uint64_t time_ms;
+  uint16_t bestmove;
+  uint16_t ponder;
+  bool done;
+} SearchCollector;
+
+bool uci_parse_move(StrView token, uint16_t *move);
+void uci_format_move(uint16_t move, char out[UCI_MOVE_MAX_LEN]);
+bool uci_parse_info(StrView line, UciInfo *info, uint16_t *pv_storage,
+                    size_t pv_capacity);
+bool uci_parse_bestmove(StrView line, uint16_t *bestmove, uint16_t *ponder);
+
+void search_collector_reset(SearchCollector *collector);
+bool search_collector_feed(SearchCollector *collector, StrView line);
+SearchResult *search_collector_finish(SearchCollector *collector, Arena *arena);
+
+const uint16_t *search_result_moves(const SearchResult *result);
+
+#endif
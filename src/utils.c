@@ -1,21 +1,37 @@
+#define _GNU_SOURCE
 #include "utils.h"
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-size_t write_cb(void *ptr, size_t size, size_t nmemb, void *stream) {
-  size_t written = fwrite(ptr, size, nmemb, (FILE *)stream);
-  return written;
+/* Writes the whole buffer, retrying short writes and EINTR. */
+int write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
 }
 
 int ensure_directory_exists(const char *path) {
   struct stat st = {0};
 
   if (stat(path, &st) == -1) {
-    if (mkdir(path, 0700) == -1) {
+    // Another process may create it at the same time
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
       fprintf(stderr, "Failed to create directory %s: %s\n", path,
               strerror(errno));
       return -1;
@@ -24,6 +40,22 @@ int ensure_directory_exists(const char *path) {
   return 0;
 }
 
+static int remove_entry(const char *path, const struct stat *st, int type,
+                        struct FTW *ftw) {
+  (void)st;
+  (void)ftw;
+  return (type == FTW_DP ? rmdir(path) : unlink(path)) == 0 ? 0 : -1;
+}
+
+/* Removes a directory and everything below it, like rm -r. */
+int remove_directory(const char *path) {
+  if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+    fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
 int ensure_file_exists(const char *path) {
   struct stat st = {0};
 
@@ -99,3 +131,29 @@ bool parse_octal(const char *s, size_t size, ulong *value) {
   /* Field did not end in space or null byte. */
   return false;
 }
+
+/* Appends formatted text to a string builder without NUL terminating it. */
+void sb_appendf(Arena *arena, StringBuilder *sb, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (n <= 0) {
+    return;
+  }
+
+  if (sb->count + n + 1 > sb->capacity) {
+    size_t new_capacity = sb->capacity == 0 ? ARENA_DA_INIT_CAP : sb->capacity;
+    while (sb->count + n + 1 > new_capacity) {
+      new_capacity *= 2;
+    }
+    sb->items =
+        arena_realloc(arena, sb->items, sb->capacity, new_capacity);
+    sb->capacity = new_capacity;
+  }
+
+  va_start(args, format);
+  vsnprintf(sb->items + sb->count, n + 1, format, args);
+  va_end(args);
+  sb->count += n;
+}
@@ -1,6 +1,7 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "arena.h"
 #include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -9,11 +10,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-size_t write_cb(void *ptr, size_t size, size_t nmemb, void *stream);
+typedef struct {
+  char *items;
+  size_t count;
+  size_t capacity;
+} StringBuilder;
+
+int write_all(int fd, const void *data, size_t len);
 int ensure_directory_exists(const char *path);
+int remove_directory(const char *path);
 int ensure_file_exists(const char *path);
 bool check_file_accessible(const char *path);
 int make_file_executable(const char *path);
 bool parse_octal(const char *s, size_t size, ulong *value);
+void sb_appendf(Arena *arena, StringBuilder *sb, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
 
 #endif
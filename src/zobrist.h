@@ -0,0 +1,21 @@
+#ifndef ZOBRIST_H
+#define ZOBRIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Polyglot's numbers, so a position's key is also its key in a Polyglot
+   opening book. Pieces are indexed white pawn, knight, ..., king, then the
+   same for black; castling rights in the order of the CASTLE_* flags in
+   position.h. The side key is toggled in when white is to move. */
+typedef struct {
+  uint64_t pieces[12][64];
+  uint64_t castling[4];
+  uint64_t en_passant[8];
+  uint64_t side;
+} ZobristKeys;
+
+const ZobristKeys *zobrist_keys(void);
+uint64_t zobrist_mix(uint64_t key, uint64_t value);
+
+#endif